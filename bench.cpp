@@ -0,0 +1,645 @@
+// Micro-benchmarks for bosond's hot paths, using the synthetic frame
+// source and the CCI emulator so that no camera is needed.
+//
+// Each result is printed as one JSON object per line, preceded by a
+// line describing the host, so runs can be collected and compared
+// across releases and machines:
+//
+//   {"bench":"crc16","ops":524288,"ns_per_op":3.21,"cpu_ns_per_op":3.20,"mb_per_s":311.5}
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/utsname.h>
+#include <functional>
+#include <iostream>
+#include <string>
+#include <thread>
+#include <tclap/CmdLine.h>
+
+#include "UART_Connector.h"
+#include "Client_API.h"
+#include "flirCRC.h"
+
+#include "blobs.h"
+#include "cci.h"
+#include "cci_emulator.h"
+#include "clock.h"
+#include "cptv.h"
+#include "event_loop.h"
+#include "frame_codec.h"
+#include "frame_source.h"
+#include "frame_stats.h"
+#include "mailbox.h"
+#include "motion.h"
+#include "output.h"
+#include "pixel_pack.h"
+#include "stats.h"
+#include "trace.h"
+#include "tracker.h"
+
+// Bumped when benchmarks change in ways which make results incomparable.
+const int bench_format_version = 1;
+const size_t crc_block_bytes = 4096;
+
+static std::string filter;
+static double minSeconds;
+
+// A benchmark body runs n operations and returns the number of bytes
+// they processed (0 if throughput isn't meaningful).
+typedef std::function<uint64_t(uint64_t n)> Body;
+
+// CPU time of the calling thread, which excludes helper threads such
+// as consumers and emulators.
+static uint64_t threadCpuNs() {
+    struct timespec ts;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void run(const char *name, Body body) {
+    if (!filter.empty() && strstr(name, filter.c_str()) == NULL) {
+        return;
+    }
+
+    body(1);
+
+    // Grow the iteration count until a run takes long enough to time.
+    uint64_t n = 1;
+    uint64_t ns, cpuNs, bytes;
+    const uint64_t minNs = minSeconds * 1e9;
+    for (;;) {
+        uint64_t t0 = monotonicNs();
+        uint64_t c0 = threadCpuNs();
+        bytes = body(n);
+        ns = monotonicNs() - t0;
+        cpuNs = threadCpuNs() - c0;
+        if (ns >= minNs || n >= (1ULL << 40)) {
+            break;
+        }
+        uint64_t next = ns ? (uint64_t)(n * 1.2 * minNs / ns) : n * 100;
+        n = std::max(next, n * 2);
+    }
+
+    printf("{\"bench\":\"%s\",\"ops\":%llu,\"ns_per_op\":%.2f,\"cpu_ns_per_op\":%.2f",
+           name, (unsigned long long)n, (double)ns / n, (double)cpuNs / n);
+    if (bytes) {
+        printf(",\"mb_per_s\":%.1f", bytes / (ns / 1e9) / 1e6);
+    }
+    printf("}\n");
+    fflush(stdout);
+}
+
+static void printHost() {
+    struct utsname u;
+    uname(&u);
+    printf("{\"format\":%d,\"host\":\"%s\",\"machine\":\"%s\",\"kernel\":\"%s\",\"compiler\":\"%s\",\"cpus\":%u}\n",
+           bench_format_version, u.nodename, u.machine, u.release, __VERSION__,
+           std::thread::hardware_concurrency());
+}
+
+
+static void benchCRC() {
+    std::vector<uint8_t> block(crc_block_bytes);
+    for (size_t i = 0; i < block.size(); i++) {
+        block[i] = i * 131 + 7;
+    }
+    volatile int sink;
+    run("crc16", [&](uint64_t n) {
+        int crc = FLIR_CRC_INITIAL_VALUE;
+        for (uint64_t i = 0; i < n; i++) {
+            crc = ByteCRC16(block[i % crc_block_bytes], crc);
+        }
+        sink = crc;
+        return n;
+    });
+    (void)sink;
+}
+
+// Full command round trips (SDK framing, CRC, emulator decode and
+// reply) over a Unix domain socket to an in-process emulator.
+static void benchCCI() {
+    std::string path = "/tmp/bosond-bench-" + std::to_string(getpid());
+    int listenFd = socket(AF_UNIX, SOCK_STREAM, 0);
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, path.c_str(), sizeof(addr.sun_path)-1);
+    unlink(path.c_str());
+    if (bind(listenFd, (sockaddr *)&addr, sizeof(addr)) < 0 || listen(listenFd, 1) < 0) {
+        perror("bench cci socket");
+        return;
+    }
+
+    EmulatorConfig config;
+    CCIEmulator emulator(config);
+    std::thread server([&] {
+        int fd = accept(listenFd, NULL, NULL);
+        if (fd >= 0) {
+            emulator.serve(fd);
+            close(fd);
+        }
+    });
+
+    if (InitializeTTY(path.c_str()) == R_SUCCESS) {
+        run("cci_roundtrip", [](uint64_t n) {
+            uint32_t frames;
+            for (uint64_t i = 0; i < n; i++) {
+                if (cciCall([&] { return roicGetFrameCount(&frames); })) {
+                    fprintf(stderr, "bench cci: command failed\n");
+                    break;
+                }
+            }
+            return 0;
+        });
+        Close();
+    } else {
+        fprintf(stderr, "bench cci: couldn't connect to emulator\n");
+    }
+
+    emulator.stop();
+    shutdown(listenFd, SHUT_RDWR);
+    server.join();
+    close(listenFd);
+    unlink(path.c_str());
+}
+
+// Frame output to a local consumer which reads as fast as it can,
+// for each way bosond can write frames.
+static void benchOutput() {
+    static const struct {
+        const char *name;
+        int (*send)(int sock, const char *data, size_t len);
+    } modes[] = {
+        { "output_stream", sendAll },
+    };
+
+    SyntheticSource source("blobs", 2, 0);
+    if (source.open() < 0 || source.start() < 0) {
+        return;
+    }
+    Frame *frame = source.next();
+
+    for (auto &mode : modes) {
+        int fds[2];
+        if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) < 0) {
+            perror("bench output socketpair");
+            return;
+        }
+        int sendSize = source.frameBytes();
+        setsockopt(fds[0], SOL_SOCKET, SO_SNDBUF, &sendSize, sizeof(sendSize));
+
+        std::thread consumer([fd = fds[1]] {
+            std::vector<char> buf(1 << 16);
+            while (read(fd, buf.data(), buf.size()) > 0) {
+            }
+        });
+
+        run(mode.name, [&](uint64_t n) {
+            for (uint64_t i = 0; i < n; i++) {
+                if (mode.send(fds[0], (const char *)frame->data, frame->length) < 0) {
+                    perror("bench output");
+                    break;
+                }
+            }
+            return n * frame->length;
+        });
+
+        close(fds[0]);
+        consumer.join();
+        close(fds[1]);
+    }
+    source.release(frame);
+}
+
+// The event loop outputs, one frame at a time: queue it and run the
+// loop until the output releases it.
+static void benchLoopOutputs() {
+    enum Kind { STREAM, PACKED, URING, SPLICE };
+    static const struct {
+        const char *name;
+        Kind kind;
+    } modes[] = {
+        { "output_epoll", STREAM },
+        { "output_epoll_packed", PACKED },
+        { "output_uring", URING },
+        { "output_splice", SPLICE },
+    };
+
+    SyntheticSource source("blobs", 2, 0);
+    if (source.open() < 0 || source.start() < 0) {
+        return;
+    }
+    Frame *frame = source.next();
+
+    for (auto &mode : modes) {
+        if (!filter.empty() && strstr(mode.name, filter.c_str()) == NULL) {
+            continue;
+        }
+        EventLoop *loop = EventLoop::create(mode.kind == URING);
+        if (!loop) {
+            return;
+        }
+        if (mode.kind == URING && !loop->uring()) {
+            delete loop;
+            continue;
+        }
+
+        std::string path = "/tmp/bosond-bench-out-" + std::to_string(getpid());
+        int listenFd = socket(AF_UNIX, SOCK_STREAM, 0);
+        struct sockaddr_un addr;
+        memset(&addr, 0, sizeof(addr));
+        addr.sun_family = AF_UNIX;
+        strncpy(addr.sun_path, path.c_str(), sizeof(addr.sun_path)-1);
+        unlink(path.c_str());
+        if (bind(listenFd, (sockaddr *)&addr, sizeof(addr)) < 0 || listen(listenFd, 1) < 0) {
+            perror("bench output socket");
+            return;
+        }
+        std::thread consumer([listenFd] {
+            int fd = accept(listenFd, NULL, NULL);
+            std::vector<char> buf(1 << 16);
+            while (fd >= 0 && read(fd, buf.data(), buf.size()) > 0) {
+            }
+            close(fd);
+        });
+
+        Output *output;
+        int connected;
+        if (mode.kind == URING) {
+            loop->uring()->registerBuffers(source.buffers());
+            UringOutput *uring = new UringOutput(loop, 2);
+            connected = uring->connect(path, "\n", source.frameBytes());
+            output = uring;
+        } else if (mode.kind == SPLICE) {
+            SpliceOutput *splice = new SpliceOutput(loop, 2);
+            connected = splice->connect(path, "\n", source.frameBytes());
+            output = splice;
+        } else {
+            StreamOutput *stream = new StreamOutput(loop, 2, mode.kind == PACKED);
+            connected = stream->connect(path, "\n", source.frameBytes());
+            output = stream;
+        }
+        bool released;
+        output->onRelease([&](Frame *) {
+            released = true;
+            loop->stop();
+        });
+
+        if (connected == 0) {
+            run(mode.name, [&](uint64_t n) {
+                for (uint64_t i = 0; i < n; i++) {
+                    released = false;
+                    if (output->send(frame) < 0) {
+                        break;
+                    }
+                    while (!released && !output->failed()) {
+                        loop->run();
+                    }
+                }
+                return n * frame->length;
+            });
+        }
+
+        delete output;
+        consumer.join();
+        close(listenFd);
+        unlink(path.c_str());
+        delete loop;
+    }
+    source.release(frame);
+}
+
+// Publishing to a mailbox with one subscriber, and the subscriber
+// copying out the latest frame.
+static void benchMailbox() {
+    SyntheticSource source("blobs", 2, 0);
+    if (source.open() < 0 || source.start() < 0) {
+        return;
+    }
+    Frame *frame = source.next();
+
+    EventLoop *loop = EventLoop::create(false);
+    if (!loop) {
+        return;
+    }
+    std::string path = "/tmp/bosond-bench-mailbox-" + std::to_string(getpid());
+    MailboxOutput *mailbox = new MailboxOutput(loop);
+    mailbox->onRelease([](Frame *) {});
+    if (mailbox->listen(path, "\n", source.frameBytes()) < 0) {
+        return;
+    }
+
+    MailboxReader reader;
+    int connected = -1;
+    std::thread subscriber([&] {
+        connected = reader.connect(path);
+    });
+    loop->addTimer(1000000, [&] {
+        if (mailbox->subscribers() > 0) {
+            loop->stop();
+        }
+    });
+    loop->run();
+    subscriber.join();
+
+    if (connected == 0) {
+        run("mailbox_publish", [&](uint64_t n) {
+            for (uint64_t i = 0; i < n; i++) {
+                mailbox->send(frame);
+            }
+            return n * frame->length;
+        });
+
+        std::vector<uint8_t> copy(reader.frameBytes());
+        run("mailbox_read", [&](uint64_t n) {
+            uint64_t sequence, timestampNs;
+            uint64_t bytes = 0;
+            for (uint64_t i = 0; i < n; i++) {
+                bytes += reader.latest(copy.data(), &sequence, &timestampNs);
+            }
+            return bytes;
+        });
+    }
+
+    delete mailbox;
+    delete loop;
+    source.release(frame);
+}
+
+static void benchKernels() {
+    SyntheticSource source("blobs", 2, 0);
+    if (source.open() < 0 || source.start() < 0) {
+        return;
+    }
+    run("synthetic_blobs", [&](uint64_t n) {
+        for (uint64_t i = 0; i < n; i++) {
+            source.release(source.next());
+        }
+        return n * source.frameBytes();
+    });
+
+    // The vector kernel must agree exactly with the reference.
+    Frame *frame = source.next();
+    PixelSums reference, fast;
+    pixelSumsScalar(frame->data, frame_pixels, reference);
+    pixelSums(frame->data, frame_pixels, fast);
+    if (fast.min != reference.min || fast.max != reference.max ||
+        fast.sum != reference.sum || fast.sumSquares != reference.sumSquares) {
+        fprintf(stderr, "pixel sums: %s kernel disagrees with scalar\n", pixelSumsKernel());
+        exit(1);
+    }
+    run("pixel_sums_scalar", [&](uint64_t n) {
+        for (uint64_t i = 0; i < n; i++) {
+            pixelSumsScalar(frame->data, frame_pixels, reference);
+        }
+        return n * frame_pixels * pix_bytes;
+    });
+    std::string name = std::string("pixel_sums_") + pixelSumsKernel();
+    run(name.c_str(), [&](uint64_t n) {
+        for (uint64_t i = 0; i < n; i++) {
+            pixelSums(frame->data, frame_pixels, fast);
+        }
+        return n * frame_pixels * pix_bytes;
+    });
+    FrameStatsStage stage;
+    FrameStats frameStats;
+    run("frame_stats", [&](uint64_t n) {
+        for (uint64_t i = 0; i < n; i++) {
+            stage.process(frame->data, frame_pixels, frameStats);
+        }
+        return n * frame_pixels * pix_bytes;
+    });
+
+    // 14 bit packing, which must match the reference both ways.
+    std::vector<uint8_t> packed(packedBytes(frame_pixels)), packedFast(packed.size());
+    std::vector<uint16_t> unpacked(frame_pixels);
+    pack14Scalar(frame->data, frame_pixels, packed.data());
+    pack14(frame->data, frame_pixels, packedFast.data());
+    unpack14(packed.data(), frame_pixels, unpacked.data());
+    if (packed != packedFast || memcmp(unpacked.data(), frame->data, frame_pixels * pix_bytes) != 0) {
+        fprintf(stderr, "pixel packing: %s kernel disagrees with scalar\n", pack14Kernel());
+        exit(1);
+    }
+    run("pack14_scalar", [&](uint64_t n) {
+        for (uint64_t i = 0; i < n; i++) {
+            pack14Scalar(frame->data, frame_pixels, packed.data());
+        }
+        return n * frame_pixels * pix_bytes;
+    });
+    name = std::string("pack14_") + pack14Kernel();
+    run(name.c_str(), [&](uint64_t n) {
+        for (uint64_t i = 0; i < n; i++) {
+            pack14(frame->data, frame_pixels, packed.data());
+        }
+        return n * frame_pixels * pix_bytes;
+    });
+    run("unpack14_scalar", [&](uint64_t n) {
+        for (uint64_t i = 0; i < n; i++) {
+            unpack14Scalar(packed.data(), frame_pixels, unpacked.data());
+        }
+        return n * frame_pixels * pix_bytes;
+    });
+    name = std::string("unpack14_") + pack14Kernel();
+    run(name.c_str(), [&](uint64_t n) {
+        for (uint64_t i = 0; i < n; i++) {
+            unpack14(packed.data(), frame_pixels, unpacked.data());
+        }
+        return n * frame_pixels * pix_bytes;
+    });
+    source.release(frame);
+
+    // The blobs move, so this includes foreground pixels.
+    MotionDetector detector((MotionConfig()));
+    MotionResult result;
+    if (detector.open() == 0) {
+        for (int i = 0; i < 100; i++) {
+            frame = source.next();
+            detector.process(frame->data, result);
+            source.release(frame);
+        }
+        frame = source.next();
+        run("motion", [&](uint64_t n) {
+            for (uint64_t i = 0; i < n; i++) {
+                detector.process(frame->data, result);
+            }
+            return n * frame_pixels * pix_bytes;
+        });
+
+        BlobLabeller *labeller = new BlobLabeller(4);
+        BlobList *blobs = new BlobList;
+        run("blobs", [&](uint64_t n) {
+            for (uint64_t i = 0; i < n; i++) {
+                labeller->process(detector.mask(), frame->data, *blobs);
+            }
+            return n * frame_pixels;
+        });
+        run("blobs_threshold", [&](uint64_t n) {
+            for (uint64_t i = 0; i < n; i++) {
+                labeller->processThreshold(frame->data, 8300, *blobs);
+            }
+            return n * frame_pixels * pix_bytes;
+        });
+        Tracker tracker((TrackerConfig()));
+        TrackList tracks;
+        uint32_t sequence = 0;
+        run("track", [&](uint64_t n) {
+            for (uint64_t i = 0; i < n; i++) {
+                tracker.update(*blobs, sequence++, tracks);
+            }
+            return 0;
+        });
+        delete blobs;
+        delete labeller;
+        source.release(frame);
+    }
+
+    LatencyHistogram *histogram = new LatencyHistogram;
+    run("latency_record", [&](uint64_t n) {
+        for (uint64_t i = 0; i < n; i++) {
+            histogram->record(i * 7919 % 20000000);
+        }
+        return 0;
+    });
+    delete histogram;
+
+    TraceBuffer trace("bench", 0, 1 << 12);
+    run("trace_span", [&](uint64_t n) {
+        for (uint64_t i = 0; i < n; i++) {
+            trace.add("bench", i, i + 1, i);
+        }
+        return 0;
+    });
+}
+
+// Encoding recorded frames as CPTV: packing and deflating a frame on
+// this thread, and the writer's throughput with its worker pool.
+static void benchCptv() {
+    SyntheticSource source("blobs", 2, 0);
+    if (source.open() < 0 || source.start() < 0) {
+        return;
+    }
+    Frame *prev = source.next();
+    Frame *frame = source.next();
+    CptvFrameInfo info = CptvFrameInfo();
+
+    CptvFrameEncoder encoder(width, height);
+    run("cptv_pack", [&](uint64_t n) {
+        size_t length;
+        for (uint64_t i = 0; i < n; i++) {
+            encoder.pack(prev->data, frame->data, info, &length);
+        }
+        return n * frame_pixels * pix_bytes;
+    });
+    std::vector<uint8_t> out;
+    run("cptv_frame", [&](uint64_t n) {
+        uint32_t crc;
+        size_t length;
+        for (uint64_t i = 0; i < n; i++) {
+            encoder.encode(prev->data, frame->data, info, out, &crc, &length);
+        }
+        return n * frame_pixels * pix_bytes;
+    });
+
+    int cpus = std::thread::hardware_concurrency();
+    CptvWriter writer(width, height, cpus > 1 ? cpus - 1 : 1);
+    int fd = open("/dev/null", O_WRONLY | O_CLOEXEC);
+    if (fd >= 0 && writer.open(fd, CptvHeader()) == 0) {
+        run("cptv_write", [&](uint64_t n) {
+            for (uint64_t i = 0; i < n; i++) {
+                Frame *a = i & 1 ? frame : prev, *b = i & 1 ? prev : frame;
+                writer.add(a->data, b->data, info);
+            }
+            writer.flush(true);
+            return n * frame_pixels * pix_bytes;
+        });
+        writer.close();
+    }
+    source.release(frame);
+    source.release(prev);
+}
+
+// Compressing frames for the stream, alternating between two frames of
+// moving blobs, and decoding them again, which must give back exactly
+// the frames encoded.
+static void benchCompression() {
+    SyntheticSource source("blobs", 2, 0);
+    if (source.open() < 0 || source.start() < 0) {
+        return;
+    }
+    Frame *frames[2] = { source.next(), source.next() };
+    std::vector<uint16_t> decoded(frame_pixels);
+
+    for (int huffman = 0; huffman < 2; huffman++) {
+        FrameEncoder encoder(frame_pixels, huffman);
+        FrameDecoder decoder(frame_pixels);
+        size_t length;
+        for (int i = 0; i < 4; i++) {
+            const uint8_t *data = encoder.encode(frames[i & 1]->data, &length);
+            if (!data || decoder.decode(data, length, decoded.data()) < 0 ||
+                memcmp(decoded.data(), frames[i & 1]->data, frame_pixels * pix_bytes) != 0) {
+                fprintf(stderr, "compression: frame %d didn't survive a round trip\n", i);
+                exit(1);
+            }
+        }
+        run(huffman ? "compress_huffman" : "compress_delta", [&](uint64_t n) {
+            for (uint64_t i = 0; i < n; i++) {
+                encoder.encode(frames[i & 1]->data, &length);
+            }
+            return n * frame_pixels * pix_bytes;
+        });
+
+        // Each frame coded against the other, to decode in turn from the
+        // decoder's last frame, frames[1].
+        std::vector<uint8_t> encoded[2];
+        encoder.encode(frames[1]->data, &length);
+        for (int i = 0; i < 2; i++) {
+            const uint8_t *data = encoder.encode(frames[i]->data, &length);
+            encoded[i].assign(data, data + length);
+        }
+        run(huffman ? "decompress_huffman" : "decompress_delta", [&](uint64_t n) {
+            for (uint64_t i = 0; i < n; i++) {
+                decoder.decode(encoded[i & 1].data(), encoded[i & 1].size(), decoded.data());
+            }
+            return n * frame_pixels * pix_bytes;
+        });
+    }
+    source.release(frames[0]);
+    source.release(frames[1]);
+}
+
+int main(int argc, char **argv) {
+    try {
+        TCLAP::CmdLine cmd("Benchmark bosond's frame and camera command paths", ' ', "0.1");
+
+        TCLAP::ValueArg<std::string> filterArg("f", "filter", "Only run benchmarks whose name contains this", false, "", "string");
+        cmd.add(filterArg);
+
+        TCLAP::ValueArg<double> timeArg("s", "seconds", "Minimum time to run each benchmark for", false, 1.0, "float");
+        cmd.add(timeArg);
+
+        cmd.parse(argc, argv);
+        filter = filterArg.getValue();
+        minSeconds = timeArg.getValue();
+    } catch (TCLAP::ArgException &e) {
+        std::cerr << "error: " << e.error() << " for arg " << e.argId() << std::endl;
+        exit(2);
+    }
+
+    printHost();
+    benchCRC();
+    benchCCI();
+    benchOutput();
+    benchLoopOutputs();
+    benchMailbox();
+    benchKernels();
+    benchCptv();
+    benchCompression();
+    return 0;
+}
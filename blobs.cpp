@@ -0,0 +1,166 @@
+#include "blobs.h"
+
+#include <string.h>
+#include <algorithm>
+
+#include "frame_source.h"
+
+// At most every other pixel of a row starts a run.
+const size_t max_runs = (size_t)height * ((width + 1) / 2);
+
+typedef uint16_t v8hu __attribute__((vector_size(16)));
+typedef int16_t v8hi __attribute__((vector_size(16)));
+typedef int8_t v8qi __attribute__((vector_size(8)));
+
+
+BlobLabeller::BlobLabeller(int minArea) :
+    minArea(minArea < 1 ? 1 : minArea),
+    runs(max_runs),
+    components(max_runs),
+    order(max_runs),
+    rowMask(width),
+    numRuns(0),
+    prevStart(0),
+    prevEnd(0) {
+}
+
+uint32_t BlobLabeller::find(uint32_t run) {
+    while (runs[run].parent != run) {
+        runs[run].parent = runs[runs[run].parent].parent;
+        run = runs[run].parent;
+    }
+    return run;
+}
+
+// Cut a row into runs and join each with the runs above it that it
+// touches, including diagonally.
+void BlobLabeller::scanRow(int y, const uint8_t *mask, const uint16_t *pixels) {
+    size_t rowStart = numRuns;
+    size_t above = prevStart;
+    int x = 0;
+    while (x < width) {
+        // Background is the common case, so skip it a word at a time.
+        uint64_t word;
+        while (x + 8 <= width && (memcpy(&word, mask + x, 8), word == 0)) {
+            x += 8;
+        }
+        while (x < width && !mask[x]) {
+            x++;
+        }
+        if (x == width) {
+            break;
+        }
+        Run &run = runs[numRuns];
+        run.y = y;
+        run.x0 = x;
+        run.max = 0;
+        run.sum = 0;
+        for (; x < width && mask[x]; x++) {
+            uint16_t v = pixels[x];
+            run.max = v > run.max ? v : run.max;
+            run.sum += v;
+        }
+        run.x1 = x - 1;
+        run.parent = numRuns;
+
+        while (above < prevEnd && runs[above].x1 + 1 < run.x0) {
+            above++;
+        }
+        for (size_t a = above; a < prevEnd && runs[a].x0 <= run.x1 + 1; a++) {
+            uint32_t r1 = find(a), r2 = find(numRuns);
+            // The older root wins, so roots come before their runs.
+            if (r1 < r2) {
+                runs[r2].parent = r1;
+            } else if (r2 < r1) {
+                runs[r1].parent = r2;
+            }
+        }
+        numRuns++;
+    }
+    prevStart = rowStart;
+    prevEnd = numRuns;
+}
+
+void BlobLabeller::finish(BlobList &out) {
+    size_t numComponents = 0;
+    for (size_t i = 0; i < numRuns; i++) {
+        Run &run = runs[i];
+        uint32_t root = find(i);
+        uint32_t area = run.x1 - run.x0 + 1;
+        if (root == i) {
+            run.component = numComponents++;
+            Component &c = components[run.component];
+            c.x0 = run.x0;
+            c.x1 = run.x1;
+            c.y0 = c.y1 = run.y;
+            c.max = run.max;
+            c.area = area;
+            c.sumX = (uint64_t)(run.x0 + run.x1) * area / 2;
+            c.sumY = (uint64_t)run.y * area;
+            c.sum = run.sum;
+            continue;
+        }
+        run.component = runs[root].component;
+        Component &c = components[run.component];
+        c.x0 = run.x0 < c.x0 ? run.x0 : c.x0;
+        c.x1 = run.x1 > c.x1 ? run.x1 : c.x1;
+        c.y1 = run.y;
+        c.max = run.max > c.max ? run.max : c.max;
+        c.area += area;
+        c.sumX += (uint64_t)(run.x0 + run.x1) * area / 2;
+        c.sumY += (uint64_t)run.y * area;
+        c.sum += run.sum;
+    }
+
+    size_t found = 0;
+    for (size_t i = 0; i < numComponents; i++) {
+        if (components[i].area >= (uint32_t)minArea) {
+            order[found++] = i;
+        }
+    }
+    size_t count = found < (size_t)BlobList::max_blobs ? found : BlobList::max_blobs;
+    std::partial_sort(order.begin(), order.begin() + count, order.begin() + found,
+                      [this](uint32_t a, uint32_t b) { return components[a].area > components[b].area; });
+
+    out.found = found;
+    out.count = count;
+    for (size_t i = 0; i < count; i++) {
+        const Component &c = components[order[i]];
+        Blob &b = out.blobs[i];
+        b.x0 = c.x0;
+        b.y0 = c.y0;
+        b.x1 = c.x1;
+        b.y1 = c.y1;
+        b.area = c.area;
+        b.cx = (double)c.sumX / c.area;
+        b.cy = (double)c.sumY / c.area;
+        b.maxValue = c.max;
+        b.meanValue = (double)c.sum / c.area;
+    }
+}
+
+void BlobLabeller::process(const uint8_t *mask, const uint16_t *pixels, BlobList &out) {
+    numRuns = prevStart = prevEnd = 0;
+    for (int y = 0; y < height; y++) {
+        scanRow(y, mask + y * width, pixels + y * width);
+    }
+    finish(out);
+}
+
+void BlobLabeller::processThreshold(const uint16_t *pixels, uint16_t threshold, BlobList &out) {
+    numRuns = prevStart = prevEnd = 0;
+    const v8hu limit = (v8hu){} + threshold;
+    uint8_t *m = rowMask.data();
+    for (int y = 0; y < height; y++) {
+        const uint16_t *row = pixels + y * width;
+        for (int x = 0; x < width; x += 8) {
+            v8hu raw;
+            memcpy(&raw, row + x, sizeof(raw));
+            v8hi hot = raw >= limit;
+            v8qi mk = __builtin_convertvector(hot, v8qi);
+            memcpy(m + x, &mk, sizeof(mk));
+        }
+        scanRow(y, m, row);
+    }
+    finish(out);
+}
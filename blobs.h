@@ -0,0 +1,72 @@
+#ifndef BLOBS_H
+#define BLOBS_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <vector>
+
+// One 8-connected group of pixels.
+struct Blob {
+    uint16_t x0, y0, x1, y1;    // bounding box, inclusive
+    uint32_t area;              // pixels
+    float cx, cy;               // centroid
+    uint16_t maxValue;
+    float meanValue;
+};
+
+// The largest blobs in a frame, biggest first.
+struct BlobList {
+    static const int max_blobs = 16;
+
+    uint32_t found;             // blobs of at least the minimum area, listed or not
+    int count;
+    Blob blobs[max_blobs];
+};
+
+// Labels connected components in a single pass over the frame. Each
+// row is cut into runs of foreground pixels, which are joined with the
+// runs they touch in the row above using union-find, so the work is
+// per run rather than per pixel once the row is scanned. Buffers are
+// sized for the worst case up front, so it doesn't allocate per frame.
+class BlobLabeller {
+public:
+    BlobLabeller(int minArea);
+
+    // Blobs of non-zero mask pixels, such as the motion detector's
+    // foreground, with values taken from pixels.
+    void process(const uint8_t *mask, const uint16_t *pixels, BlobList &out);
+
+    // Blobs of pixels at or above threshold, such as hot targets.
+    void processThreshold(const uint16_t *pixels, uint16_t threshold, BlobList &out);
+
+private:
+    struct Run {
+        uint16_t y, x0, x1;     // x1 inclusive
+        uint16_t max;
+        uint32_t sum;
+        uint32_t parent;        // run index; roots are their own parent
+        uint32_t component;
+    };
+
+    struct Component {
+        uint16_t x0, y0, x1, y1;
+        uint16_t max;
+        uint32_t area;
+        uint64_t sumX, sumY, sum;
+    };
+
+    void scanRow(int y, const uint8_t *mask, const uint16_t *pixels);
+    uint32_t find(uint32_t run);
+    void finish(BlobList &out);
+
+    int minArea;
+    std::vector<Run> runs;
+    std::vector<Component> components;
+    std::vector<uint32_t> order;
+    std::vector<uint8_t> rowMask;   // for processThreshold
+    size_t numRuns;
+    size_t prevStart;               // runs of the previous row
+    size_t prevEnd;
+};
+
+#endif // BLOBS_H
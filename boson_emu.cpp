@@ -0,0 +1,168 @@
+// Emulates a FLIR Boson's command and control interface on a
+// pseudo-terminal or a Unix domain socket so that bosond (using
+// --cci-tty) and benchmarks can run without a camera.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <termios.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <iostream>
+#include <string>
+#include <tclap/CmdLine.h>
+
+#include "cci_emulator.h"
+
+static EmulatorConfig config;
+static std::string ptyLink;
+static std::string socketPath;
+static CCIEmulator *emulator;
+static volatile sig_atomic_t quit;
+
+
+void processArgs(int argc, char **argv) {
+    try {
+        TCLAP::CmdLine cmd("Emulate a FLIR Boson command interface", ' ', "0.1");
+
+        TCLAP::ValueArg<std::string> ptyArg("l", "pty-link", "Create a symlink to the emulator's pseudo-terminal at this path", false, "", "string");
+        cmd.add(ptyArg);
+
+        TCLAP::ValueArg<std::string> socketArg("s", "socket-path", "Listen on a Unix domain socket instead of a pseudo-terminal", false, "", "string");
+        cmd.add(socketArg);
+
+        TCLAP::ValueArg<unsigned> latencyArg("L", "latency-us", "Fixed response latency in microseconds", false, 0, "int");
+        cmd.add(latencyArg);
+
+        TCLAP::ValueArg<unsigned> jitterArg("j", "jitter-us", "Maximum random extra response latency in microseconds", false, 0, "int");
+        cmd.add(jitterArg);
+
+        TCLAP::ValueArg<double> crcArg("c", "crc-error-rate", "Fraction of responses sent with a bad CRC", false, 0, "float");
+        cmd.add(crcArg);
+
+        TCLAP::ValueArg<double> dropArg("D", "drop-rate", "Fraction of requests which are not answered", false, 0, "float");
+        cmd.add(dropArg);
+
+        TCLAP::ValueArg<unsigned> seedArg("S", "seed", "Random seed", false, 1, "int");
+        cmd.add(seedArg);
+
+        cmd.parse(argc, argv);
+
+        ptyLink = ptyArg.getValue();
+        socketPath = socketArg.getValue();
+        config.latencyUs = latencyArg.getValue();
+        config.jitterUs = jitterArg.getValue();
+        config.crcErrorRate = crcArg.getValue();
+        config.dropRate = dropArg.getValue();
+        config.seed = seedArg.getValue();
+
+    } catch (TCLAP::ArgException &e) {
+        std::cerr << "error: " << e.error() << " for arg " << e.argId() << std::endl;
+        exit(2);
+    }
+}
+
+void handleSignal(int) {
+    quit = 1;
+    emulator->stop();
+}
+
+int servePTY() {
+    int master = posix_openpt(O_RDWR | O_NOCTTY | O_CLOEXEC);
+    if (master < 0 || grantpt(master) < 0 || unlockpt(master) < 0) {
+        perror("posix_openpt");
+        return 1;
+    }
+    const char *name = ptsname(master);
+
+    // Hold the slave open so the master doesn't see EIO/HUP between
+    // clients, and make it raw so the framing bytes pass untouched.
+    int slave = open(name, O_RDWR | O_NOCTTY | O_CLOEXEC);
+    if (slave < 0) {
+        perror("open pty slave");
+        return 1;
+    }
+    struct termios tio;
+    if (tcgetattr(slave, &tio) == 0) {
+        cfmakeraw(&tio);
+        tcsetattr(slave, TCSANOW, &tio);
+    }
+
+    if (!ptyLink.empty()) {
+        unlink(ptyLink.c_str());
+        if (symlink(name, ptyLink.c_str()) < 0) {
+            perror("symlink");
+            return 1;
+        }
+    }
+    std::cout << "emulating Boson CCI on " << name << std::endl;
+
+    int result = emulator->serve(master);
+    if (!ptyLink.empty()) {
+        unlink(ptyLink.c_str());
+    }
+    close(slave);
+    close(master);
+    return result ? 1 : 0;
+}
+
+int serveSocket() {
+    int sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, socketPath.c_str(), sizeof(addr.sun_path)-1);
+    unlink(socketPath.c_str());
+    if (bind(sock, (sockaddr *)&addr, sizeof(addr)) < 0 || listen(sock, 1) < 0) {
+        perror("BIND");
+        return 1;
+    }
+    std::cout << "emulating Boson CCI on " << socketPath << std::endl;
+
+    // One client at a time, like the real serial link.
+    for (;;) {
+        int client = accept4(sock, NULL, NULL, SOCK_CLOEXEC);
+        if (client < 0) {
+            if (errno == EINTR) {
+                break;
+            }
+            perror("ACCEPT");
+            return 1;
+        }
+        emulator->serve(client);
+        close(client);
+        if (quit) {
+            break;
+        }
+    }
+    unlink(socketPath.c_str());
+    return 0;
+}
+
+int main(int argc, char **argv) {
+    processArgs(argc, argv);
+
+    emulator = new CCIEmulator(config);
+
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = handleSignal;
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+
+    int result = socketPath.empty() ? servePTY() : serveSocket();
+
+    EmulatorCounters c = emulator->counters();
+    std::cout << "requests: " << c.requests
+              << " responses: " << c.responses
+              << " bad crc: " << c.badCRC
+              << " dropped: " << c.dropped
+              << " corrupted: " << c.corrupted
+              << " unknown: " << c.unknown
+              << std::endl;
+    return result;
+}
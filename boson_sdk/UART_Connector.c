@@ -23,6 +23,9 @@
 
 uint8_t open_port(libusb_device_handle *devh);
 void close_port(libusb_device_handle *devh);
+uint8_t open_tty_port(const char *path);
+void close_tty_port();
+int tty_port_fd();
 void send_to_camera(libusb_device_handle *devh, uint8_t channel_ID, uint32_t sendBytes, uint8_t *sendPayload);//, uint32_t *receiveBytes, uint8_t *receivePayload);
 // void read_command(int32_t port_num, uint8_t channel_ID, uint32_t sendBytes, uint8_t *sendPayload, uint32_t *receiveBytes, uint8_t *receivePayload);
 void read_frame(libusb_device_handle *devh,uint8_t channel_ID, uint16_t start_byte_ms,uint32_t *receiveBytes, uint8_t *receiveBuffer);
@@ -33,6 +36,7 @@ static uint8_t isInitialized = 0;
 /* We use a global variable to keep the device handle
  */
 static struct libusb_device_handle *devh = NULL;
+static uint8_t usingTTY = 0;
 
 FLR_RESULT Initialize(libusb_device_handle *indevh)
 {
@@ -47,10 +51,31 @@ FLR_RESULT Initialize(libusb_device_handle *indevh)
 	return FLR_COMM_OK; // 0 == success.
 }
 
+FLR_RESULT InitializeTTY(const char *path)
+{
+	if (isInitialized) return R_UART_PORT_ALREADY_OPEN;
+
+    if (open_tty_port(path)) return R_UART_PORT_FAILURE;
+
+	usingTTY = 1;
+	isInitialized = 1;
+	return FLR_COMM_OK; // 0 == success.
+}
+
+int PortFD()
+{
+    return usingTTY ? tty_port_fd() : -1;
+}
+
 void Close()
 {
 //	__declspec( dllimport ) void close_port(int32_t port_num);
-    close_port(devh);
+    if (usingTTY) {
+        close_tty_port();
+    } else {
+        close_port(devh);
+    }
+	usingTTY = 0;
 	isInitialized = 0;
     devh = NULL;
 //	myPort = 0;
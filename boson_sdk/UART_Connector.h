@@ -23,6 +23,8 @@ void SendToCamera( uint8_t channelID,  uint32_t sendBytes, uint8_t *sendData);
 void ReadFrame( uint8_t channelID, uint32_t *receiveBytes, uint8_t *receiveData);
 void ReadUnframed(uint32_t *receiveBytes, uint8_t *receiveData);
 FLR_RESULT Initialize(libusb_device_handle *devh);
+FLR_RESULT InitializeTTY(const char *path);
+int PortFD();
 void Close();
 
 #endif //UART_CONNECTOR_H
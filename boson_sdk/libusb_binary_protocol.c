@@ -4,6 +4,7 @@
 #include "flirChannels.h"
 
 #include <stdio.h>
+#include <string.h>
 
 #ifdef Q_OS_WIN32
 
@@ -28,7 +29,14 @@ double difftime(long current, long reference)
 
 #include <time.h>
 #include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <termios.h>
 #include <sys/time.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
 
 #endif
 
@@ -46,6 +54,17 @@ static int EP_IN_ADDR  = 0x82;
 static int EP_OUT_ADDR = 0x01;
 static int IF_CDC_DATA = 3;
 
+/* Alternative transport: the kernel CDC-ACM driver's tty node
+ * (/dev/ttyACM*). When tty_fd is open it is used instead of libusb.
+ * tty_epfd is an epoll instance used to wait for the tty to become
+ * readable or writable so reads happen in large chunks without busy
+ * polling.
+ */
+static int tty_fd = -1;
+static int tty_epfd = -1;
+#define TTY_READ_BUF_SIZ   4096
+#define TTY_TIMEOUT_MS     1000
+
 #define ESCAPE_BYTE        0x9E
 #define START_FRAME_BYTE   0x8E
 #define END_FRAME_BYTE     0xAE
@@ -96,6 +115,103 @@ void close_port(libusb_device_handle *devh){
     libusb_release_interface(devh, IF_CDC_DATA);
 }
 
+uint8_t open_tty_port(const char *path){
+    struct termios tio;
+    struct epoll_event ev;
+
+    struct stat st;
+    if (stat(path, &st) == 0 && S_ISSOCK(st.st_mode)) {
+        /* A Unix domain socket, e.g. from the boson-emu CCI emulator. */
+        struct sockaddr_un addr;
+        memset(&addr, 0, sizeof(addr));
+        addr.sun_family = AF_UNIX;
+        strncpy(addr.sun_path, path, sizeof(addr.sun_path) - 1);
+        tty_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if (tty_fd < 0 || connect(tty_fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+            fprintf(stderr, "Error connecting to %s: %s\n", path, strerror(errno));
+            if (tty_fd >= 0) close(tty_fd);
+            tty_fd = -1;
+            return 1;
+        }
+        fcntl(tty_fd, F_SETFL, fcntl(tty_fd, F_GETFL) | O_NONBLOCK);
+    } else {
+        tty_fd = open(path, O_RDWR | O_NOCTTY | O_NONBLOCK | O_CLOEXEC);
+        if (tty_fd < 0) {
+            fprintf(stderr, "Error opening %s: %s\n", path, strerror(errno));
+            return 1;
+        }
+    }
+
+    /* Raw mode: no line discipline processing of the binary framing.
+     * The baud rate is ignored by CDC-ACM but set for real UARTs.
+     */
+    if (tcgetattr(tty_fd, &tio) == 0) {
+        cfmakeraw(&tio);
+        cfsetispeed(&tio, B921600);
+        cfsetospeed(&tio, B921600);
+        tio.c_cflag |= CLOCAL | CREAD;
+        tio.c_cc[VMIN] = 0;
+        tio.c_cc[VTIME] = 0;
+        if (tcsetattr(tty_fd, TCSANOW, &tio) < 0) {
+            fprintf(stderr, "Error configuring %s: %s\n", path, strerror(errno));
+        }
+        tcflush(tty_fd, TCIOFLUSH);
+    }
+
+    tty_epfd = epoll_create1(EPOLL_CLOEXEC);
+    if (tty_epfd < 0) {
+        fprintf(stderr, "Error creating epoll instance: %s\n", strerror(errno));
+        close(tty_fd);
+        tty_fd = -1;
+        return 1;
+    }
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN;
+    ev.data.fd = tty_fd;
+    if (epoll_ctl(tty_epfd, EPOLL_CTL_ADD, tty_fd, &ev) < 0) {
+        fprintf(stderr, "Error adding %s to epoll: %s\n", path, strerror(errno));
+        close(tty_epfd);
+        close(tty_fd);
+        tty_epfd = tty_fd = -1;
+        return 1;
+    }
+
+    return 0;
+}
+
+void close_tty_port(){
+    if (tty_epfd >= 0) close(tty_epfd);
+    if (tty_fd >= 0) close(tty_fd);
+    tty_epfd = tty_fd = -1;
+}
+
+int tty_port_fd(){
+    return tty_fd;
+}
+
+/* Wait for the tty to be ready for the given epoll events. Returns 1
+ * when ready, 0 on timeout and -1 on error.
+ */
+static int tty_wait(uint32_t events, int timeout_ms)
+{
+    struct epoll_event ev;
+    int n;
+
+    memset(&ev, 0, sizeof(ev));
+    ev.events = events;
+    ev.data.fd = tty_fd;
+    if (epoll_ctl(tty_epfd, EPOLL_CTL_MOD, tty_fd, &ev) < 0) {
+        return -1;
+    }
+    do {
+        n = epoll_wait(tty_epfd, &ev, 1, timeout_ms);
+    } while (n < 0 && errno == EINTR);
+    if (n > 0 && (ev.events & (EPOLLERR | EPOLLHUP)) && !(ev.events & events)) {
+        return -1;
+    }
+    return n;
+}
+
 double diff_timespec(struct timespec *current, struct timespec *reference)
 {
     double elapsed_sec = difftime(current->tv_sec, reference->tv_sec);
@@ -103,8 +219,46 @@ double diff_timespec(struct timespec *current, struct timespec *reference)
     return elapsed_sec;
 }
 
+static int16_t read_tty_byte()
+{
+    /* Drain whatever the driver has buffered in one read() and hand
+     * bytes out from the local buffer until it is exhausted.
+     */
+    static ssize_t actual_length = 0, index = 0;
+    static uint8_t in_byte[TTY_READ_BUF_SIZ];
+    while (index >= actual_length)
+    {
+        index = 0;
+        actual_length = read(tty_fd, in_byte, sizeof(in_byte));
+        if (actual_length > 0) {
+            break;
+        }
+        if (actual_length == 0 || errno == EAGAIN || errno == EWOULDBLOCK) {
+            actual_length = 0;
+            int rc = tty_wait(EPOLLIN, TTY_TIMEOUT_MS);
+            if (rc == 0) {
+                return -1;
+            } else if (rc < 0) {
+                fprintf(stderr, "Error while waiting for char: %s\n", strerror(errno));
+                return -1;
+            }
+        } else if (errno != EINTR) {
+            fprintf(stderr, "Error while reading char: %s\n", strerror(errno));
+            actual_length = 0;
+            return -1;
+        } else {
+            actual_length = 0;
+        }
+    }
+    return in_byte[index++];
+}
+
 static int16_t read_byte(libusb_device_handle *devh)
 {
+    if (tty_fd >= 0) {
+        return read_tty_byte();
+    }
+
     struct timespec start_t,current_t;
     double elapsed_sec;
     clock_gettime(CLOCK_MONOTONIC, &start_t);
@@ -622,8 +776,36 @@ static int32_t create_frame(uint8_t *frame_buf, uint8_t channel_ID, uint8_t *pay
     return(out_len);
 }
 
+static int write_tty_frame(uint8_t *frame_buf, uint32_t len)
+{
+    uint32_t written = 0;
+    while (written < len) {
+        ssize_t n = write(tty_fd, frame_buf + written, len - written);
+        if (n > 0) {
+            written += n;
+            continue;
+        }
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK) {
+            fprintf(stderr, "Error while sending char: %s\n", strerror(errno));
+            return -1;
+        }
+        if (tty_wait(EPOLLOUT, TTY_TIMEOUT_MS) <= 0) {
+            fprintf(stderr, "Timeout while sending char\n");
+            return -1;
+        }
+    }
+    return 0;
+}
+
 static int write_frame(libusb_device_handle *devh,uint8_t *frame_buf, uint32_t len)
 {
+    if (tty_fd >= 0) {
+        return write_tty_frame(frame_buf, len);
+    }
+
     int i;
 #ifdef DEBUGPRINT
     printf("Writing Frame (framewise): ");
@@ -2,18 +2,16 @@
 #include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
+#include <errno.h>
+#include <poll.h>
+#include <signal.h>
 #include <fcntl.h>               // open, O_RDWR
 #include <unistd.h>              // close
 #include <sys/ioctl.h>           // ioctl
-#include <sys/mman.h>
-#include <netinet/in.h>
-#include <sys/socket.h>
 #include <sys/types.h>
-#include <sys/un.h>
-#include <linux/videodev2.h>
 #include <string>
 #include <iostream>
-#include <chrono>
+#include <sstream>
 #include <tclap/CmdLine.h>
 
 // Boson SDK includes
@@ -21,16 +19,70 @@
 #include "UART_Connector.h"
 #include "Client_API.h"
 
-using namespace std::chrono;
+#include "blobs.h"
+#include "camera.h"
+#include "cci.h"
+#include "clock.h"
+#include "control.h"
+#include "event_loop.h"
+#include "frame_source.h"
+#include "frame_stats.h"
+#include "jitter.h"
+#include "logger.h"
+#include "mailbox.h"
+#include "metadata.h"
+#include "metrics.h"
+#include "motion.h"
+#include "output.h"
+#include "pixel_pack.h"
+#include "realtime.h"
+#include "recorder.h"
+#include "stats.h"
+#include "trace.h"
+#include "tracker.h"
+#include "uring.h"
+
 
 
-const int width = 640;
-const int height = 512;
-const int pix_bytes = 2;
 const int num_buffers = 2;
+const int camera_poll_ms = 100;
+const double default_fps = 60;
+const size_t prefault_stack_bytes = 256 * 1024;
+const uint64_t rate_interval_ns = 2000000000ULL;
+const size_t trace_events_per_thread = 1 << 16;
 
 static std::string videoDevice("/dev/video");
 static std::string socketPath;
+static std::string cciTTY;
+static std::string replayPath;
+static std::string syntheticPattern;
+static bool unthrottled;
+static bool loopReplay;
+static bool useCCI;
+static std::string controlPath;
+static std::string metricsAddress;
+static std::string tracePath;
+static bool realtime;
+static bool userptr;
+static bool useUring;
+static bool useSplice;
+static bool compressFrames;
+static bool compressHuffman;
+static bool packPixels;
+static std::string mailboxPath;
+static std::string metadataPath;
+static bool detectMotion;
+static MotionConfig motionConfig;
+static std::string eventsPath;
+static bool labelBlobs;
+static int blobThreshold;
+static int blobMinArea;
+static bool trackBlobs;
+static TrackerConfig trackerConfig;
+static RecorderConfig recorderConfig;
+static bool dropFfcFrames;
+static bool scheduleFfc;
+static double ffcMaxDrift;
 static bool printTimings;
 static bool sendFrames;
 
@@ -46,6 +98,111 @@ void processArgs(int argc, char **argv) {
         TCLAP::ValueArg<std::string> socketArg("p", "socket-path", "Path to output socket", false, "/var/run/lepton-frames", "string");
         cmd.add(socketArg);
 
+        TCLAP::ValueArg<std::string> ttyArg("c", "cci-tty", "Talk to the camera's command interface through this tty (e.g. /dev/ttyACM0) instead of libusb", false, "", "string");
+        cmd.add(ttyArg);
+
+        TCLAP::ValueArg<std::string> replayArg("r", "replay", "Replay frames from a raw Y16 or CPTV file instead of the camera", false, "", "string");
+        cmd.add(replayArg);
+
+        TCLAP::ValueArg<std::string> generateArg("g", "generate", "Generate synthetic frames instead of using the camera (ramp or blobs)", false, "", "string");
+        cmd.add(generateArg);
+
+        TCLAP::SwitchArg unthrottledArg("u", "unthrottled", "Produce replayed or generated frames as fast as possible");
+        cmd.add(unthrottledArg);
+
+        TCLAP::SwitchArg loopArg("", "loop", "Restart replay at the end of the file");
+        cmd.add(loopArg);
+
+        TCLAP::SwitchArg cciArg("", "no-cci", "Don't use the camera's command interface", true);
+        cmd.add(cciArg);
+
+        TCLAP::ValueArg<std::string> controlArg("s", "control-socket", "Serve statistics queries on this Unix domain socket", false, "", "string");
+        cmd.add(controlArg);
+
+        TCLAP::ValueArg<std::string> metricsArg("m", "metrics", "Serve OpenMetrics on this Unix domain socket path or host:port", false, "", "string");
+        cmd.add(metricsArg);
+
+        TCLAP::ValueArg<std::string> traceArg("", "trace", "Trace frame handling; SIGUSR2 or the trace control command writes Chrome trace JSON to this file", false, "", "string");
+        cmd.add(traceArg);
+
+        TCLAP::ValueArg<std::string> mailboxArg("", "mailbox", "Also publish the newest frame to subscribers of this Unix domain socket, without queueing", false, "", "string");
+        cmd.add(mailboxArg);
+
+        TCLAP::ValueArg<std::string> metadataArg("", "metadata", "Compute statistics for each frame and stream them as JSON to subscribers of this Unix domain socket", false, "", "string");
+        cmd.add(metadataArg);
+
+        TCLAP::SwitchArg motionArg("", "motion", "Detect motion against a per-pixel background model, reported in the metadata and as events");
+        cmd.add(motionArg);
+
+        TCLAP::ValueArg<double> sigmaArg("", "motion-sigma", "Standard deviations from the background for a pixel to count as moving", false, motionConfig.sigma, "float");
+        cmd.add(sigmaArg);
+
+        TCLAP::ValueArg<int> minPixelsArg("", "motion-min-pixels", "Moving pixels needed in a frame to start or continue a motion event", false, motionConfig.minPixels, "int");
+        cmd.add(minPixelsArg);
+
+        TCLAP::ValueArg<std::string> eventsArg("", "events", "Send motion events as JSON to subscribers of this Unix domain socket", false, "", "string");
+        cmd.add(eventsArg);
+
+        TCLAP::SwitchArg dropFfcArg("", "drop-ffc-frames", "Don't send frames captured during a flat field correction or while the image settles after one");
+        cmd.add(dropFfcArg);
+
+        TCLAP::SwitchArg blobsArg("", "blobs", "Report connected blobs of moving pixels in the metadata");
+        cmd.add(blobsArg);
+
+        TCLAP::ValueArg<int> blobThresholdArg("", "blob-threshold", "Report blobs of pixels at or above this value in the metadata instead", false, 0, "int");
+        cmd.add(blobThresholdArg);
+
+        TCLAP::ValueArg<int> blobMinAreaArg("", "blob-min-area", "Smallest blob to report, in pixels", false, 4, "int");
+        cmd.add(blobMinAreaArg);
+
+        TCLAP::SwitchArg ffcScheduleArg("", "ffc-schedule", "Run flat field corrections from bosond instead of the camera, deferring them while there is motion");
+        cmd.add(ffcScheduleArg);
+
+        TCLAP::ValueArg<double> ffcDriftArg("", "ffc-max-drift", "Furthest the FPA temperature may drift, in C, while an FFC is deferred for motion", false, 2.0, "float");
+        cmd.add(ffcDriftArg);
+
+        TCLAP::SwitchArg trackArg("", "track", "Follow blobs from frame to frame and report their tracks in the metadata");
+        cmd.add(trackArg);
+
+        TCLAP::ValueArg<double> trackDistanceArg("", "track-max-distance", "Furthest a blob may be from where a track was expected, in pixels", false, trackerConfig.maxDistance, "float");
+        cmd.add(trackDistanceArg);
+
+        TCLAP::ValueArg<std::string> recordArg("", "record", "Record clips of motion (and on the record control command) into this directory", false, "", "string");
+        cmd.add(recordArg);
+
+        TCLAP::ValueArg<double> recordPreArg("", "record-pre", "Seconds of frames from before a trigger to include in a clip", false, recorderConfig.preSeconds, "float");
+        cmd.add(recordPreArg);
+
+        TCLAP::ValueArg<double> recordPostArg("", "record-post", "Seconds to keep recording after the last trigger", false, recorderConfig.postSeconds, "float");
+        cmd.add(recordPostArg);
+
+        TCLAP::SwitchArg recordRawArg("", "record-raw", "Record clips as raw Y16 frames rather than CPTV");
+        cmd.add(recordRawArg);
+
+        TCLAP::ValueArg<int> recordThreadsArg("", "record-threads", "Threads compressing CPTV clips (0 for one per CPU, less one)", false, recorderConfig.threads, "int");
+        cmd.add(recordThreadsArg);
+
+        TCLAP::SwitchArg compressArg("", "compress", "Compress frames on the output socket losslessly (announced with a Compression header)");
+        cmd.add(compressArg);
+
+        TCLAP::SwitchArg compressHuffmanArg("", "compress-huffman", "Add a Huffman coding stage to --compress for smaller but slower frames");
+        cmd.add(compressHuffmanArg);
+
+        TCLAP::SwitchArg packArg("", "pack14", "Pack pixels to 14 bits on the output socket (announced as PixelBits: 14)");
+        cmd.add(packArg);
+
+        TCLAP::SwitchArg spliceArg("", "splice", "Hand frame pages to the consumer with vmsplice()/splice() instead of copying them; the output path may be a FIFO");
+        cmd.add(spliceArg);
+
+        TCLAP::SwitchArg uringArg("", "io-uring", "Use io_uring instead of epoll for the event loop if the kernel supports it");
+        cmd.add(uringArg);
+
+        TCLAP::SwitchArg userptrArg("", "userptr", "Capture into bosond's own huge page backed buffers (V4L2 USERPTR) instead of driver buffers");
+        cmd.add(userptrArg);
+
+        TCLAP::SwitchArg realtimeArg("R", "realtime", "Lock memory and pre-fault buffers and stack (needs CAP_IPC_LOCK or a large enough RLIMIT_MEMLOCK)");
+        cmd.add(realtimeArg);
+
         TCLAP::SwitchArg timingsArg("t", "print-timing", "Print frame timings");
         cmd.add(timingsArg);
 
@@ -56,6 +213,46 @@ void processArgs(int argc, char **argv) {
 
         videoDevice += std::to_string(deviceArg.getValue());
         socketPath = socketArg.getValue();
+        cciTTY = ttyArg.getValue();
+        replayPath = replayArg.getValue();
+        syntheticPattern = generateArg.getValue();
+        unthrottled = unthrottledArg.getValue();
+        loopReplay = loopArg.getValue();
+        useCCI = cciArg.getValue();
+        controlPath = controlArg.getValue();
+        metricsAddress = metricsArg.getValue();
+        tracePath = traceArg.getValue();
+        realtime = realtimeArg.getValue();
+        userptr = userptrArg.getValue();
+        useUring = uringArg.getValue();
+        useSplice = spliceArg.getValue();
+        compressHuffman = compressHuffmanArg.getValue();
+        compressFrames = compressArg.getValue() || compressHuffman;
+        packPixels = packArg.getValue();
+        mailboxPath = mailboxArg.getValue();
+        metadataPath = metadataArg.getValue();
+        scheduleFfc = ffcScheduleArg.getValue();
+        ffcMaxDrift = ffcDriftArg.getValue();
+        trackBlobs = trackArg.getValue();
+        trackerConfig.maxDistance = trackDistanceArg.getValue();
+        recorderConfig.dir = recordArg.getValue();
+        recorderConfig.preSeconds = recordPreArg.getValue();
+        recorderConfig.postSeconds = recordPostArg.getValue();
+        recorderConfig.raw = recordRawArg.getValue();
+        recorderConfig.threads = recordThreadsArg.getValue();
+        detectMotion = motionArg.getValue() || !eventsArg.getValue().empty() || scheduleFfc ||
+            !recorderConfig.dir.empty() ||
+            ((blobsArg.getValue() || trackBlobs) && blobThresholdArg.getValue() == 0);
+        motionConfig.sigma = sigmaArg.getValue();
+        motionConfig.minPixels = minPixelsArg.getValue();
+        eventsPath = eventsArg.getValue();
+        blobThreshold = blobThresholdArg.getValue();
+        if (blobThresholdArg.isSet() && (blobThreshold < 1 || blobThreshold > 0xffff)) {
+            throw TCLAP::CmdLineParseException("must be a pixel value from 1 to 65535", "blob-threshold");
+        }
+        labelBlobs = blobsArg.getValue() || blobThreshold > 0 || trackBlobs;
+        blobMinArea = blobMinAreaArg.getValue();
+        dropFfcFrames = dropFfcArg.getValue();
         printTimings = timingsArg.getValue();
         sendFrames = sendArg.getValue();
 
@@ -69,6 +266,14 @@ void processArgs(int argc, char **argv) {
 void initCCI() {
     libusb_device_handle* dev_h;
 
+    if (!cciTTY.empty()) {
+        if (InitializeTTY(cciTTY.c_str())) {
+            std::cerr << "couldn't open CCI tty " << cciTTY << std::endl;
+            exit(1);
+        }
+        return;
+    }
+
     if (libusb_init(NULL) < 0) {
         perror("Error: Failed libusb init");
         exit(1);
@@ -84,239 +289,550 @@ void initCCI() {
 
 int logCameraInfo() {
     uint32_t major, minor, patch;
-    if (int result = bosonGetSoftwareRev(&major, &minor, &patch)) {
+    if (int result = cciCall([&] { return bosonGetSoftwareRev(&major, &minor, &patch); }, "bosonGetSoftwareRev")) {
         std::cout << "failed to get software rev: " << result << '\n';
         return -1;
     }
 
     std::cout << "Boson firmware version: " << major << '.' << minor << '.' << patch << '\n';
     uint32_t camera_sn;
-    if (int result = bosonGetCameraSN(&camera_sn)) {
+    if (int result = cciCall([&] { return bosonGetCameraSN(&camera_sn); }, "bosonGetCameraSN")) {
         std::cout << "failed to get serial number: " << result << '\n';
         return -1;
     }
     std::cout << "Boson serial: " << camera_sn << '\n';
+    recorderConfig.cameraSerial = camera_sn;
 
     return 0;
 }
 
-int sendAll(int sock, const char *data, size_t len) {
-    int left = len;
-    int n;
 
-    while (left > 0) {
-        n = send(sock, data, left, 0);
-        if (n < 0) {
-            return n;
+// State of the capture thread's event loop.
+static EventLoop *loop;
+static FrameSource *source;
+static std::vector<Output *> outputs;
+static FrameStatsStage *frameStats;
+static MotionDetector *motion;
+static BlobLabeller *blobLabeller;
+static Tracker *tracker;
+static Recorder *recorder;
+static MetadataOutput *metadata;
+static MetadataOutput *events;
+static FrameMeta meta;
+static FfcPhase lastFfcPhase;
+static FfcScheduler *ffcScheduler;
+static char eventMessage[MetadataOutput::max_message_bytes];
+static TraceBuffer *queueTrack;
+static bool sourcePaused;
+static uint64_t idleNs;
+static uint64_t lateFrameNs;
+static bool first = true;
+static uint32_t lastSequence;
+static uint64_t lastTimestampNs;
+static uint64_t lastRateNs;
+static uint64_t lastRateFrames;
+
+// Drop one reference to a frame, handing the buffer back to the source
+// once the loop and every output are done with it.
+static void releaseFrame(Frame *frame) {
+    if (--frame->refs > 0) {
+        return;
+    }
+    TraceScope span("requeue", frame->sequence);
+    if (source->release(frame) < 0) {
+        exit(1);
+    }
+    if (sourcePaused) {
+        sourcePaused = false;
+        loop->modify(source->fd(), POLLIN);
+    }
+}
+
+// Work out the frame's metadata and publish it. This runs after the
+// frame has been handed to the outputs, so it doesn't delay them.
+static void analyseFrame(Frame *frame, FfcPhase phase) {
+    uint64_t startNs = monotonicNs();
+    meta.sequence = frame->sequence;
+    meta.timestampNs = frame->timestampNs;
+    meta.ffcPhase = phase;
+    if (frameStats) {
+        TraceScope span("frame stats", frame->sequence);
+        frameStats->process(frame->data, frame->length / pix_bytes, meta.stats);
+        meta.hasStats = true;
+    }
+    if (motion) {
+        TraceScope span("motion", frame->sequence);
+        // Frozen frames teach the model nothing, and the image steps
+        // when they end.
+        if (phase == FFC_PHASE_IN_PROGRESS) {
+            motion->hold(meta.motion);
+        } else {
+            if (phase == FFC_PHASE_SETTLING && lastFfcPhase != FFC_PHASE_SETTLING) {
+                motion->rebase();
+            }
+            motion->process(frame->data, meta.motion);
+        }
+        meta.hasMotion = true;
+        if (ffcScheduler) {
+            ffcScheduler->setMotionActive(meta.motion.active);
+        }
+        if (recorder && meta.motion.active) {
+            recorder->trigger("motion", recorder->postFrames());
+        }
+    }
+    if (blobLabeller) {
+        TraceScope span("blobs", frame->sequence);
+        if (blobThreshold > 0) {
+            blobLabeller->processThreshold(frame->data, blobThreshold, meta.blobs);
+            meta.hasBlobs = true;
+        } else {
+            // Frozen frames have no mask of their own.
+            meta.hasBlobs = phase != FFC_PHASE_IN_PROGRESS;
+            if (meta.hasBlobs) {
+                blobLabeller->process(motion->mask(), frame->data, meta.blobs);
+            }
+        }
+    }
+    if (tracker) {
+        if (meta.hasBlobs) {
+            tracker->update(meta.blobs, frame->sequence, meta.tracks);
+        } else {
+            tracker->hold(frame->sequence, meta.tracks);
+        }
+        meta.hasTracks = true;
+    }
+    lastFfcPhase = phase;
+    stats.latency[STAGE_ANALYSIS].record(monotonicNs() - startNs);
+
+    if (metadata) {
+        metadata->publish(meta);
+    }
+    int length = formatMotionEvent(meta, eventMessage, sizeof(eventMessage));
+    if (length > 0) {
+        if (events) {
+            events->broadcast(eventMessage, length);
+        }
+        if (printTimings) {
+            logger.log(stdout, "%s\n", eventMessage);
         }
-        left -= n;
-        data += n;
     }
-    return 0;
 }
 
+static void onFrameReady(uint32_t events) {
+    Frame *frame = source->next();
+    uint64_t dequeuedNs = monotonicNs();
+    if (!frame) {
+        if (source->atEnd()) {
+            loop->stop();
+            return;
+        }
+        if (errno != EAGAIN) {
+            exit(1);
+        }
+        // V4L2 reports an error while it has no buffers queued; wait
+        // for one to be released.
+        if (events & POLLERR) {
+            sourcePaused = true;
+            loop->modify(source->fd(), 0);
+        }
+        return;
+    }
 
-const char *ffcStatusToStr(FLR_BOSON_FFCSTATUS_E status) {
-    switch (status) {
-    case FLR_BOSON_NO_FFC_PERFORMED:
-        return "never";
-    case FLR_BOSON_FFC_IMMINENT:
-        return "imminent";
-    case FLR_BOSON_FFC_IN_PROGRESS:
-        return "in progress";
-    case FLR_BOSON_FFC_COMPLETE:
-        return "complete";
-    default:
-        return "unknown";
+    stats.latency[STAGE_DQBUF_WAIT].record(dequeuedNs - idleNs);
+    traceSpan("dequeue", idleNs, dequeuedNs, frame->sequence);
+    if (dequeuedNs >= frame->timestampNs) {
+        stats.latency[STAGE_QUEUE].record(dequeuedNs - frame->timestampNs);
+        if (queueTrack) {
+            queueTrack->add("queued", frame->timestampNs, dequeuedNs, frame->sequence);
+        }
     }
+    stats.count(COUNTER_FRAMES);
+    if (!first) {
+        if (frame->sequence - lastSequence > 1) {
+            stats.count(COUNTER_DROPPED, frame->sequence - lastSequence - 1);
+        }
+        if (lateFrameNs && frame->timestampNs - lastTimestampNs > lateFrameNs) {
+            stats.count(COUNTER_LATE);
+        }
+    }
+    first = false;
+    lastSequence = frame->sequence;
+    lastTimestampNs = frame->timestampNs;
+    jitter.record(frame->sequence, frame->timestampNs);
+
+    FfcPhase phase = useCCI ? ffcPhase(frame->timestampNs) : FFC_PHASE_NONE;
+
+    // Outputs keep their own references while they send.
+    frame->refs = 1;
+    if (dropFfcFrames && (phase == FFC_PHASE_IN_PROGRESS || phase == FFC_PHASE_SETTLING)) {
+        stats.count(COUNTER_FFC_DROPPED);
+    } else {
+        for (Output *output : outputs) {
+            frame->refs++;
+            if (output->send(frame) < 0) {
+                exit(1);
+            }
+        }
+    }
+    bool analyse = frameStats || motion || blobLabeller;
+    if (analyse || recorder) {
+        // io_uring writes would otherwise wait for the loop to submit
+        // them after analysis.
+        if (Uring *ring = loop->uring()) {
+            ring->submit();
+        }
+    }
+    if (recorder) {
+        recorder->push(frame);
+    }
+    if (analyse) {
+        analyseFrame(frame, phase);
+    }
+    releaseFrame(frame);
+    idleNs = monotonicNs();
 }
 
+static void onRateTimer() {
+    uint64_t now = monotonicNs();
+    uint64_t frames = stats.counters[COUNTER_FRAMES];
+    if (frames < lastRateFrames) {
+        // The counters were reset (the reset command) during the
+        // interval, so it has no meaningful rate; start a new one.
+        lastRateNs = now;
+        lastRateFrames = frames;
+        return;
+    }
+    double rate = (frames - lastRateFrames) / ((now - lastRateNs) / 1e9);
+    lastRateNs = now;
+    lastRateFrames = frames;
+    stats.frameRate = rate;
+
+    if (printTimings) {
+        if (useCCI && camera.valid) {
+            logger.log(stdout, "rate: %gHz worst jitter: %lluus frames: %u last ffc: %u ffc status: %s\n",
+                       rate, (unsigned long long)jitter.windowWorstNs() / 1000,
+                       camera.frameCount.load(), camera.lastFFCFrame.load(),
+                       ffcStatusToStr((FLR_BOSON_FFCSTATUS_E)camera.ffcStatus.load()));
+        } else {
+            logger.log(stdout, "rate: %gHz worst jitter: %lluus\n",
+                       rate, (unsigned long long)jitter.windowWorstNs() / 1000);
+        }
+    }
+}
 
-int main(int argc, char** argv) {
-    int fd;
-    struct v4l2_capability cap;
 
+int main(int argc, char** argv) {
     processArgs(argc, argv);
 
-    initCCI();
-    if (logCameraInfo()) {
+    // Before any threads start, so that they leave these signals to
+    // the loop.
+    loop = EventLoop::create(useUring);
+    if (!loop) {
         exit(1);
     }
+    loop->addSignals({ SIGINT, SIGTERM }, [](int) {
+        loop->stop();
+    });
 
-    if ((fd = open(videoDevice.c_str(), O_RDWR)) < 0) {
-        perror("Error : OPEN. Invalid Video Device\n");
+    if (realtime && lockMemory() < 0) {
         exit(1);
     }
 
-    // Check VideoCapture mode is available
-    if (ioctl(fd, VIDIOC_QUERYCAP, &cap) < 0) {
-        perror("ERROR : VIDIOC_QUERYCAP. Video Capture is not available\n");
-        exit(1);
+    if (!tracePath.empty()) {
+        if (traceStart(trace_events_per_thread, tracePath) < 0) {
+            exit(1);
+        }
+        traceThreadStart("capture");
     }
+    logger.start();
 
-    if (!(cap.capabilities & V4L2_CAP_VIDEO_CAPTURE)) {
-        fprintf(stderr, "The device does not handle single-planar video capture.\n");
-        exit(1);
+    if (useCCI) {
+        initCCI();
+        if (logCameraInfo()) {
+            exit(1);
+        }
     }
 
-    struct v4l2_format format;
-
-    // Common varibles
-    format.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
-    format.fmt.pix.pixelformat = V4L2_PIX_FMT_Y16;
-    format.fmt.pix.width = width;
-    format.fmt.pix.height = height;
-
-    // request desired FORMAT
-    if (ioctl(fd, VIDIOC_S_FMT, &format) < 0) {
-        perror("VIDIOC_S_FMT");
-        exit(1);
+    if (!replayPath.empty()) {
+        source = new ReplaySource(replayPath, num_buffers, !unthrottled, loopReplay);
+    } else if (!syntheticPattern.empty()) {
+        source = new SyntheticSource(syntheticPattern, num_buffers, unthrottled ? 0 : 60);
+    } else {
+        source = new V4L2Source(videoDevice, num_buffers, userptr);
     }
-
-    // Allocate mmap buffers for retrieving video frames.
-    struct v4l2_requestbuffers bufrequest;
-    bufrequest.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
-    bufrequest.memory = V4L2_MEMORY_MMAP;
-    bufrequest.count = num_buffers;
-    if (ioctl(fd, VIDIOC_REQBUFS, &bufrequest) < 0) {
-        perror("VIDIOC_REQBUFS");
+    if (source->open() < 0) {
         exit(1);
     }
 
-    // Now find out about the buffers that were created and map them.
-    struct v4l2_buffer bufferinfo[num_buffers];
-    void *buffer[num_buffers];
-    for (int i = 0; i < num_buffers; i++) {
-        memset(&bufferinfo[i], 0, sizeof(struct v4l2_buffer));
-        bufferinfo[i].type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
-        bufferinfo[i].memory = V4L2_MEMORY_MMAP;
-        bufferinfo[i].index = i;
-        if (ioctl(fd, VIDIOC_QUERYBUF, &bufferinfo[i]) < 0) {
-            perror("VIDIOC_QUERYBUF");
-            exit(1);
+    // Frames more than 1.5 nominal periods apart count as late. The
+    // camera reports its own rate; replayed and generated frames are
+    // paced by the source.
+    double fps = source->nominalFps();
+    if (replayPath.empty() && syntheticPattern.empty()) {
+        uint32_t cameraRate;
+        if (useCCI && cciCall([&] { return sysctrlGetCameraFrameRate(&cameraRate); }, "sysctrlGetCameraFrameRate") == R_SUCCESS && cameraRate > 0) {
+            fps = cameraRate;
+        } else {
+            fps = default_fps;
         }
+    }
+    uint64_t periodNs = fps > 0 ? 1e9 / fps : 0;
+    lateFrameNs = periodNs * 3 / 2;
+    jitter.setNominalPeriod(periodNs);
 
-        buffer[i] = mmap(NULL, bufferinfo[i].length, PROT_READ | PROT_WRITE, MAP_SHARED, fd, bufferinfo[i].m.offset);
-        if (buffer[i] == MAP_FAILED) {
-            perror("mmap");
-            exit(1);
+    // --compress packs bits of its own.
+    if (compressFrames && packPixels) {
+        if (sendFrames) {
+            std::cerr << "compression: overrides --pack14" << std::endl;
         }
-        memset(buffer[i], 0, bufferinfo[i].length);
+        packPixels = false;
     }
-
-    // Init socket.
-    int sock = socket(AF_UNIX, SOCK_STREAM, 0);
+    std::ostringstream headers, streamHeaders;
+    headers << "Brand: flir\n";
+    headers << "Model: boson\n";
+    headers << "ResX: " << width << '\n';
+    headers << "ResY: " << height << '\n';
+    headers << "FPS: 60\n";
+    // Only the stream is packed or compressed, not the mailbox.
+    streamHeaders << headers.str();
+    headers << "FrameSize: " << (width * height * pix_bytes) << '\n';
+    headers << "PixelBits: " << (pix_bytes * 8) << '\n';
+    headers << '\n';
+    if (packPixels) {
+        streamHeaders << "FrameSize: " << packedBytes(width * height) << '\n';
+        streamHeaders << "PixelBits: " << packed_pixel_bits << '\n';
+    } else {
+        streamHeaders << "FrameSize: " << (width * height * pix_bytes) << '\n';
+        streamHeaders << "PixelBits: " << (pix_bytes * 8) << '\n';
+    }
+    if (compressFrames) {
+        streamHeaders << (compressHuffman ? "Compression: delta-huffman\n" : "Compression: delta\n");
+    }
+    streamHeaders << '\n';
 
     if (sendFrames) {
-        int send_size = bufferinfo[0].length;
-        if (setsockopt(sock, SOL_SOCKET, SO_SNDBUF, (const void *)&send_size, sizeof(send_size)) < 0) {
-            perror("SETSOCKOPT");
+        if (compressFrames) {
+            CompressedOutput *stream = new CompressedOutput(loop, num_buffers, compressHuffman);
+            if (stream->connect(socketPath, streamHeaders.str(), source->frameBytes()) < 0) {
+                exit(1);
+            }
+            stats.outputFd = stream->fd();
+            outputs.push_back(stream);
+            if (useSplice) {
+                std::cerr << "compression: overrides --splice" << std::endl;
+            }
+        } else if (packPixels) {
+            // Packed frames are copies, so can't be spliced or written
+            // from the capture buffers.
+            StreamOutput *stream = new StreamOutput(loop, num_buffers, true);
+            if (stream->connect(socketPath, streamHeaders.str(), source->frameBytes()) < 0) {
+                exit(1);
+            }
+            stats.outputFd = stream->fd();
+            outputs.push_back(stream);
+            std::cerr << "pixel packing: " << pack14Kernel() << std::endl;
+            if (useSplice) {
+                std::cerr << "pixel packing: overrides --splice" << std::endl;
+            } else if (loop->uring()) {
+                std::cerr << "pixel packing: overrides the io_uring output" << std::endl;
+            }
+        } else if (useSplice) {
+            SpliceOutput *splice = new SpliceOutput(loop, num_buffers);
+            if (splice->connect(socketPath, streamHeaders.str(), source->frameBytes()) < 0) {
+                exit(1);
+            }
+            stats.outputFd = splice->fd();
+            outputs.push_back(splice);
+        } else if (Uring *ring = loop->uring()) {
+            // Let writes use the capture buffers without pinning them
+            // each time. Driver mmap buffers can't always be registered.
+            if (ring->registerBuffers(source->buffers()) < 0) {
+                perror("io_uring buffer registration failed, using plain writes");
+            }
+            UringOutput *stream = new UringOutput(loop, num_buffers);
+            if (stream->connect(socketPath, streamHeaders.str(), source->frameBytes()) < 0) {
+                exit(1);
+            }
+            stats.outputFd = stream->fd();
+            outputs.push_back(stream);
+        } else {
+            StreamOutput *stream = new StreamOutput(loop, num_buffers);
+            if (stream->connect(socketPath, streamHeaders.str(), source->frameBytes()) < 0) {
+                exit(1);
+            }
+            stats.outputFd = stream->fd();
+            outputs.push_back(stream);
+        }
+    }
+    if (!mailboxPath.empty()) {
+        MailboxOutput *mailbox = new MailboxOutput(loop);
+        if (mailbox->listen(mailboxPath, headers.str(), source->frameBytes()) < 0) {
             exit(1);
         }
-
-        struct sockaddr_un addr = { .sun_family = AF_UNIX };
-        strncpy(addr.sun_path, socketPath.c_str(), sizeof(addr.sun_path)-1);
-
-        if (connect(sock, (sockaddr*) (&addr), sizeof(addr)) < 0) {
-            perror("CONNECT");
+        outputs.push_back(mailbox);
+    }
+    for (Output *output : outputs) {
+        output->onRelease(releaseFrame);
+    }
+    if (!metadataPath.empty()) {
+        frameStats = new FrameStatsStage();
+        metadata = new MetadataOutput(loop);
+        if (metadata->listen(metadataPath) < 0) {
             exit(1);
         }
-
-        std::ostringstream headers;
-        headers << "Brand: flir\n";
-        headers << "Model: boson\n";
-        headers << "ResX: " << width << '\n';
-        headers << "ResY: " << height << '\n';
-        headers << "FPS: 60\n";
-        headers << "FrameSize: " << (width * height * pix_bytes) << '\n';
-        headers << "PixelBits: " << (pix_bytes * 2) << '\n';
-        headers << '\n';
-        auto header_str = headers.str();
-        if (sendAll(sock, header_str.data(), header_str.length()) < 0) {
-            perror("HEADERS");
+        std::cerr << "frame statistics: " << pixelSumsKernel() << std::endl;
+    }
+    if (detectMotion) {
+        motion = new MotionDetector(motionConfig);
+        if (motion->open() < 0) {
             exit(1);
         }
     }
-
-    // Activate streaming
-    if (ioctl(fd, VIDIOC_STREAMON, &bufferinfo[0].type) < 0) {
-        perror("VIDIOC_STREAMON");
-        exit(1);
+    if (labelBlobs) {
+        blobLabeller = new BlobLabeller(blobMinArea);
     }
-
-    steady_clock::time_point t0 = steady_clock::now();
-
-    // Indices of the buffer being filled (i_active) and the buffer
-    // that is full and is ready to send (i_full).
-    int i_active = 0;
-    int i_full = 1;
-
-    // Put the first buffer in the incoming queue.
-    if (ioctl(fd, VIDIOC_QBUF, &bufferinfo[i_active]) < 0) {
-        perror("VIDIOC_QBUF");
-        exit(1);
+    if (trackBlobs) {
+        tracker = new Tracker(trackerConfig);
     }
-
-    int count = 0;
-    for (;;) {
-        // Wait for active buffer to be filled.
-        if (ioctl(fd, VIDIOC_DQBUF, &bufferinfo[i_active]) < 0) {
-            perror("VIDIOC_DQBUF");
+    if (!recorderConfig.dir.empty()) {
+        recorder = new Recorder(recorderConfig);
+        if (recorder->open(fps > 0 ? fps : default_fps) < 0) {
             exit(1);
         }
+        recorder->start();
+    }
+    if (!eventsPath.empty()) {
+        events = new MetadataOutput(loop);
+        if (events->listen(eventsPath) < 0) {
+            exit(1);
+        }
+    }
 
-        std::swap(i_active, i_full);  // Switch buffer roles
+    ControlServer *control = NULL;
+    if (!controlPath.empty()) {
+        control = new ControlServer();
+        control->addCommand("stats", [](const std::string &) {
+            return stats.toJSON();
+        });
+        control->addCommand("jitter", [](const std::string &) {
+            return jitter.toJSON();
+        });
+        control->addCommand("reset", [](const std::string &) {
+            stats.reset();
+            jitter.reset();
+            return std::string("ok\n");
+        });
+        control->addCommand("record", [](const std::string &args) {
+            if (!recorder) {
+                return std::string("recording not enabled (use --record)\n");
+            }
+            recorder->request(atof(args.c_str()));
+            return std::string("ok\n");
+        });
+        control->addCommand("ffc", [](const std::string &) {
+            if (!useCCI) {
+                return std::string("no camera command interface\n");
+            }
+            logger.log(stdout, "ffc: requested over the control socket\n");
+            if (cciCall([] { return bosonRunFFC(); }, "bosonRunFFC")) {
+                return std::string("failed\n");
+            }
+            return std::string("ok\n");
+        });
+        control->addCommand("trace", [](const std::string &args) {
+            if (!trace_enabled) {
+                return std::string("tracing not enabled (use --trace)\n");
+            }
+            std::string path = args.empty() ? tracePath : args;
+            if (traceDump(path) < 0) {
+                return std::string("failed\n");
+            }
+            return "wrote " + path + "\n";
+        });
+        if (control->start(controlPath) < 0) {
+            exit(1);
+        }
+    }
 
-        // Put next buffer in the incoming queue so the video driver
-        // can start filling it.
-        if (ioctl(fd, VIDIOC_QBUF, &bufferinfo[i_active]) < 0) {
-            perror("VIDIOC_QBUF");
+    MetricsServer *metrics = NULL;
+    if (!metricsAddress.empty()) {
+        metrics = new MetricsServer();
+        if (metrics->start(metricsAddress) < 0) {
             exit(1);
         }
+    }
 
-        // Send full buffer while other buffer is being filled.
-        if (sendFrames) {
-            if (sendAll(sock, (const char *) buffer[i_full], bufferinfo[i_full].length) < 0) {
-                perror("SEND");
-                exit(1);
-            }
+    CameraPoller *poller = NULL;
+    if (useCCI) {
+        if (scheduleFfc) {
+            ffcScheduler = new FfcScheduler(ffcMaxDrift);
         }
+        poller = new CameraPoller();
+        poller->start(camera_poll_ms, ffcScheduler);
+    }
 
-        if (printTimings) {
-            count++;
-            if (count == 120) {
-                steady_clock::time_point t1 = steady_clock::now();
-                auto us = duration_cast<microseconds>(t1 - t0).count();
-                auto rate = count / ((float)us / 1e6);
-                t0 = t1;
-                count = 0;
-
-                /* Example of how to retrieve metadata from camera */
-                uint32_t frameCount;
-                if (roicGetFrameCount(&frameCount)) {
-                    std::cout << "failed to retrieve frame count" << std::endl;
-                    exit(3);
-                }
-                uint32_t ffcCount;
-                if (bosonGetLastFFCFrameCount(&ffcCount)) {
-                    std::cout << "failed to retrieve FFC frame count" << std::endl;
-                    exit(3);
-                }
-
-                FLR_BOSON_FFCSTATUS_E ffcStatus;
-                if (bosonGetFfcStatus(&ffcStatus)) {
-                    std::cout << "failed to retrieve FFC status" << std::endl;
-                    exit(3);
-                }
-
-                std::cout << "rate: " << rate << "Hz "
-                          << "frames: " << frameCount
-                          << " last ffc: " << ffcCount
-                          << " ffc status: " << ffcStatusToStr(ffcStatus)
-                          << std::endl;
-            }
+    if (periodNs) {
+        jitter.start();
+    }
+
+    if (source->start() < 0) {
+        exit(1);
+    }
+
+    queueTrack = trace_enabled ? traceTrack("driver queue") : NULL;
+    if (loop->add(source->fd(), POLLIN, onFrameReady) < 0 ||
+        loop->addTimer(rate_interval_ns, onRateTimer) < 0) {
+        exit(1);
+    }
+    std::cerr << "event loop: " << loop->name() << std::endl;
+
+    // Nothing on this thread should fault or allocate from here on.
+    if (realtime) {
+        prefaultStack(prefault_stack_bytes);
+    }
+    lastRateNs = idleNs = monotonicNs();
+    watchAllocations();
+
+    int result = loop->run();
+    for (Output *output : outputs) {
+        if (output->failed()) {
+            result = -1;
         }
     }
 
-    return 0;
+    if (uint64_t n = stats.counters[COUNTER_ALLOCATIONS]) {
+        fprintf(stderr, "warning: capture thread made %llu heap allocations while streaming\n", (unsigned long long)n);
+    }
+    jitter.stop();
+    if (recorder) {
+        recorder->stop();
+    }
+    // The poller may still log, handing FFC back to the camera.
+    if (poller) {
+        poller->stop();
+        delete poller;
+    }
+    delete ffcScheduler;
+    logger.stop();
+    if (metrics) {
+        metrics->stop();
+        delete metrics;
+    }
+    if (control) {
+        control->stop();
+        delete control;
+    }
+    for (Output *output : outputs) {
+        delete output;
+    }
+    delete events;
+    delete metadata;
+    delete recorder;
+    delete tracker;
+    delete blobLabeller;
+    delete motion;
+    delete frameStats;
+    delete source;
+    delete loop;
+    return result < 0 ? 1 : 0;
 }
@@ -0,0 +1,65 @@
+#include "buffer_arena.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+
+BufferArena::BufferArena() : base(NULL), size(0), stride(0), numBuffers(0), kind(NONE) {
+}
+
+BufferArena::~BufferArena() {
+    if (base) {
+        munmap(base, size);
+    }
+}
+
+int BufferArena::allocate(size_t bufferBytes, int count) {
+    size_t page = sysconf(_SC_PAGESIZE);
+    stride = (bufferBytes + page - 1) / page * page;
+    numBuffers = count;
+    size = (stride * count + huge_page_bytes - 1) / huge_page_bytes * huge_page_bytes;
+
+    // Reserved huge pages (vm.nr_hugepages) first.
+    void *p = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+    if (p != MAP_FAILED) {
+        base = (uint8_t *)p;
+        kind = HUGETLB;
+    } else {
+        // Otherwise ordinary pages, aligned so the kernel can back them
+        // with transparent huge pages.
+        size_t mapped = size + huge_page_bytes;
+        p = mmap(NULL, mapped, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (p == MAP_FAILED) {
+            perror("buffer arena mmap");
+            return -1;
+        }
+        uintptr_t start = (uintptr_t)p;
+        uintptr_t aligned = (start + huge_page_bytes - 1) & ~(uintptr_t)(huge_page_bytes - 1);
+        if (aligned > start) {
+            munmap(p, aligned - start);
+        }
+        size_t tail = start + mapped - (aligned + size);
+        if (tail) {
+            munmap((void *)(aligned + size), tail);
+        }
+        base = (uint8_t *)aligned;
+        kind = THP;
+        madvise(base, size, MADV_HUGEPAGE);
+    }
+
+    memset(base, 0, size);
+    return 0;
+}
+
+const char *BufferArena::backing() const {
+    switch (kind) {
+    case HUGETLB:
+        return "huge pages";
+    case THP:
+        return "transparent huge pages";
+    default:
+        return "none";
+    }
+}
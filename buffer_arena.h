@@ -0,0 +1,37 @@
+#ifndef BUFFER_ARENA_H
+#define BUFFER_ARENA_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// One contiguous block of frame buffers owned by bosond, backed by
+// huge pages when the system has them reserved and otherwise aligned
+// for transparent huge pages. Keeping all frames in a few large pages
+// saves TLB misses in stages which walk whole frames.
+class BufferArena {
+public:
+    static const size_t huge_page_bytes = 2 * 1024 * 1024;
+
+    BufferArena();
+    ~BufferArena();
+
+    // Reserve count buffers of at least bufferBytes each, page aligned,
+    // cleared (and so faulted in).
+    int allocate(size_t bufferBytes, int count);
+
+    uint8_t *buffer(int i) { return base + i * stride; }
+    size_t bufferBytes() const { return stride; }
+    int count() const { return numBuffers; }
+
+    // How the memory is backed, for logging.
+    const char *backing() const;
+
+private:
+    uint8_t *base;
+    size_t size;
+    size_t stride;
+    int numBuffers;
+    enum { NONE, HUGETLB, THP } kind;
+};
+
+#endif // BUFFER_ARENA_H
@@ -0,0 +1,263 @@
+#include "camera.h"
+
+#include <sched.h>
+#include <stdlib.h>
+#include <chrono>
+
+#include "cci.h"
+#include "clock.h"
+#include "control.h"
+#include "logger.h"
+#include "stats.h"
+#include "trace.h"
+
+const uint64_t slow_poll_ns = 1000000000ULL;
+const uint64_t ffc_settle_ns = 500000000ULL;
+// How long to wait for a requested FFC to show up before asking again.
+const uint64_t ffc_request_timeout_ns = 10000000000ULL;
+
+CameraState camera;
+
+
+CameraState::CameraState() :
+    valid(false),
+    ffcStatus(FLR_BOSON_NO_FFC_PERFORMED),
+    frameCount(0),
+    lastFFCFrame(0),
+    fpaTempCx10(0),
+    updatedNs(0),
+    ffcEndedNs(0),
+    ffcTempCx10(0) {
+}
+
+CameraPoller::CameraPoller() : intervalMs(1000), scheduler(NULL), slowDueNs(0), stopping(false) {
+}
+
+CameraPoller::~CameraPoller() {
+    stop();
+}
+
+void CameraPoller::start(int interval, FfcScheduler *ffcScheduler) {
+    intervalMs = interval;
+    scheduler = ffcScheduler;
+    stopping = false;
+    thread = std::thread(&CameraPoller::run, this);
+}
+
+void CameraPoller::stop() {
+    {
+        std::lock_guard<std::mutex> lock(mu);
+        stopping = true;
+    }
+    wake.notify_all();
+    if (thread.joinable()) {
+        thread.join();
+    }
+}
+
+void CameraPoller::run() {
+    demoteThread(SCHED_OTHER);
+    traceThreadStart("camera poller");
+
+    auto due = std::chrono::steady_clock::now();
+    std::unique_lock<std::mutex> lock(mu);
+    while (!stopping) {
+        lock.unlock();
+        if (poll() && scheduler) {
+            scheduler->update(monotonicNs());
+        }
+        lock.lock();
+        due += std::chrono::milliseconds(intervalMs);
+        wake.wait_until(lock, due, [this] { return stopping; });
+    }
+    lock.unlock();
+    if (scheduler) {
+        scheduler->stop();
+    }
+}
+
+bool CameraPoller::poll() {
+    FLR_BOSON_FFCSTATUS_E ffcStatus;
+    uint32_t frameCount, lastFFCFrame;
+    int16_t temp;
+
+    if (cciCall([&] { return bosonGetFfcStatus(&ffcStatus); }, "bosonGetFfcStatus") ||
+        cciCall([&] { return roicGetFrameCount(&frameCount); }, "roicGetFrameCount") ||
+        cciCall([&] { return bosonGetLastFFCFrameCount(&lastFFCFrame); }, "bosonGetLastFFCFrameCount")) {
+        return false;
+    }
+    uint64_t now = monotonicNs();
+    if (now >= slowDueNs) {
+        if (cciCall([&] { return bosonlookupFPATempDegCx10(&temp); }, "bosonlookupFPATempDegCx10")) {
+            return false;
+        }
+        camera.fpaTempCx10 = temp;
+        slowDueNs = now + slow_poll_ns;
+    }
+
+    // An FFC too short to see in progress still moves the frame count.
+    if (camera.valid && lastFFCFrame != camera.lastFFCFrame) {
+        stats.count(COUNTER_FFC);
+        camera.ffcEndedNs = now;
+        camera.ffcTempCx10 = camera.fpaTempCx10.load();
+    } else if (camera.ffcStatus == FLR_BOSON_FFC_IN_PROGRESS && ffcStatus != FLR_BOSON_FFC_IN_PROGRESS) {
+        camera.ffcEndedNs = now;
+        camera.ffcTempCx10 = camera.fpaTempCx10.load();
+    }
+    camera.ffcStatus = ffcStatus;
+    camera.frameCount = frameCount;
+    camera.lastFFCFrame = lastFFCFrame;
+    camera.updatedNs = now;
+    camera.valid = true;
+    return true;
+}
+
+
+FfcScheduler::FfcScheduler(double maxDriftC) :
+    maxDriftCx10(maxDriftC * 10 + 0.5),
+    tempThresholdCx10(0),
+    frameThreshold(0),
+    started(false),
+    baselined(false),
+    lastFFCFrame(0),
+    lastFFCTempCx10(0),
+    due(false),
+    deferred(false),
+    requestedNs(0),
+    motionActive(false) {
+}
+
+int FfcScheduler::start() {
+    uint16_t temp;
+    uint32_t frames;
+    if (cciCall([&] { return bosonGetFFCTempThreshold(&temp); }, "bosonGetFFCTempThreshold") ||
+        cciCall([&] { return bosonGetFFCFrameThreshold(&frames); }, "bosonGetFFCFrameThreshold") ||
+        cciCall([&] { return bosonSetFFCMode(FLR_BOSON_MANUAL_FFC); }, "bosonSetFFCMode")) {
+        return -1;
+    }
+    tempThresholdCx10 = temp;
+    frameThreshold = frames;
+    if (maxDriftCx10 < tempThresholdCx10) {
+        maxDriftCx10 = tempThresholdCx10;
+    }
+    started = true;
+    logger.log(stdout, "ffc: scheduling in bosond; due after %.1fC or %u frames, deferred for motion up to %.1fC or %u frames\n",
+               tempThresholdCx10 / 10.0, frameThreshold, maxDriftCx10 / 10.0, 2 * frameThreshold);
+    return 0;
+}
+
+void FfcScheduler::stop() {
+    if (started &&
+        cciCall([&] { return bosonSetFFCMode(FLR_BOSON_AUTO_FFC); }, "bosonSetFFCMode") == R_SUCCESS) {
+        logger.log(stdout, "ffc: handed back to the camera\n");
+        started = false;
+    }
+}
+
+void FfcScheduler::update(uint64_t nowNs) {
+    if (!started && start() < 0) {
+        return;
+    }
+    uint32_t ffcFrame = camera.lastFFCFrame;
+    int temp = camera.fpaTempCx10;
+    // Measure from the latest FFC, whoever asked for it.
+    if (!baselined || ffcFrame != lastFFCFrame) {
+        if (baselined) {
+            logger.log(stdout, "ffc: done at frame %u, %.1fC\n", ffcFrame, temp / 10.0);
+        }
+        baselined = true;
+        lastFFCFrame = ffcFrame;
+        lastFFCTempCx10 = temp;
+        due = deferred = false;
+        requestedNs = 0;
+        return;
+    }
+    if (camera.ffcStatus == FLR_BOSON_FFC_IN_PROGRESS ||
+        (requestedNs && nowNs < requestedNs + ffc_request_timeout_ns)) {
+        return;
+    }
+    if (requestedNs) {
+        logger.log(stdout, "ffc: the camera didn't run the requested FFC\n");
+        requestedNs = 0;
+    }
+
+    int drift = abs(temp - lastFFCTempCx10);
+    uint32_t frames = camera.frameCount - lastFFCFrame;
+    if (!(tempThresholdCx10 && drift >= tempThresholdCx10) &&
+        !(frameThreshold && frames >= frameThreshold)) {
+        return;
+    }
+    if (!due) {
+        due = true;
+        logger.log(stdout, "ffc: due, %.1fC drift over %u frames\n", drift / 10.0, frames);
+    }
+    if (motionActive.load(std::memory_order_relaxed)) {
+        if (drift < maxDriftCx10 && !(frameThreshold && frames >= 2 * frameThreshold)) {
+            if (!deferred) {
+                deferred = true;
+                stats.count(COUNTER_FFC_DEFERRED);
+                logger.log(stdout, "ffc: deferred while motion is active\n");
+            }
+            return;
+        }
+        logger.log(stdout, "ffc: running during motion, deferred as long as allowed (%.1fC drift over %u frames)\n",
+                   drift / 10.0, frames);
+    } else if (deferred) {
+        logger.log(stdout, "ffc: running deferred FFC now motion has stopped\n");
+    } else {
+        logger.log(stdout, "ffc: running while the scene is quiet\n");
+    }
+    runFFC(nowNs);
+}
+
+void FfcScheduler::runFFC(uint64_t nowNs) {
+    requestedNs = nowNs;
+    if (cciCall([] { return bosonRunFFC(); }, "bosonRunFFC")) {
+        logger.log(stdout, "ffc: bosonRunFFC failed\n");
+    }
+}
+
+FfcPhase ffcPhase(uint64_t timestampNs) {
+    if (!camera.valid.load(std::memory_order_relaxed)) {
+        return FFC_PHASE_NONE;
+    }
+    switch (camera.ffcStatus.load(std::memory_order_relaxed)) {
+    case FLR_BOSON_FFC_IMMINENT:
+        return FFC_PHASE_IMMINENT;
+    case FLR_BOSON_FFC_IN_PROGRESS:
+        return FFC_PHASE_IN_PROGRESS;
+    }
+    uint64_t endedNs = camera.ffcEndedNs.load(std::memory_order_relaxed);
+    if (endedNs && timestampNs < endedNs + ffc_settle_ns) {
+        return FFC_PHASE_SETTLING;
+    }
+    return FFC_PHASE_NONE;
+}
+
+const char *ffcPhaseName(FfcPhase phase) {
+    switch (phase) {
+    case FFC_PHASE_IMMINENT:
+        return "imminent";
+    case FFC_PHASE_IN_PROGRESS:
+        return "in_progress";
+    case FFC_PHASE_SETTLING:
+        return "settling";
+    default:
+        return "none";
+    }
+}
+
+const char *ffcStatusToStr(FLR_BOSON_FFCSTATUS_E status) {
+    switch (status) {
+    case FLR_BOSON_NO_FFC_PERFORMED:
+        return "never";
+    case FLR_BOSON_FFC_IMMINENT:
+        return "imminent";
+    case FLR_BOSON_FFC_IN_PROGRESS:
+        return "in progress";
+    case FLR_BOSON_FFC_COMPLETE:
+        return "complete";
+    default:
+        return "unknown";
+    }
+}
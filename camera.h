@@ -0,0 +1,115 @@
+#ifndef CAMERA_H
+#define CAMERA_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+
+#include "EnumTypes.h"
+
+// Camera state read periodically over the command interface. Fields
+// are atomics so the capture thread and exporters can read them
+// without taking the command interface lock.
+struct CameraState {
+    std::atomic<bool> valid;            // at least one poll succeeded
+    std::atomic<int> ffcStatus;         // FLR_BOSON_FFCSTATUS_E
+    std::atomic<uint32_t> frameCount;   // camera's own frame counter
+    std::atomic<uint32_t> lastFFCFrame; // frame count at the last FFC
+    std::atomic<int> fpaTempCx10;       // focal plane temperature, C x 10
+    std::atomic<uint64_t> updatedNs;    // monotonic time of the last poll
+    std::atomic<uint64_t> ffcEndedNs;   // when the poller saw the last FFC finish
+    std::atomic<int> ffcTempCx10;       // focal plane temperature then
+
+    CameraState();
+};
+
+extern CameraState camera;
+
+// Takes flat field corrections out of the camera's hands, so they
+// don't land in the middle of a sighting. The camera is switched to
+// manual FFC, and an FFC is due when the camera's own temperature or
+// frame threshold would have triggered one. A due FFC runs straight
+// away if the scene is quiet; while motion is active it is deferred
+// until the FPA has drifted maxDriftC from the last one, or twice the
+// frame threshold has passed, and then runs regardless. Every decision
+// is logged. Runs on the poller thread, after each poll.
+class FfcScheduler {
+public:
+    FfcScheduler(double maxDriftC);
+
+    void update(uint64_t nowNs);
+
+    // Hand FFC back to the camera.
+    void stop();
+
+    // Set by the capture thread from the motion detector.
+    void setMotionActive(bool active) { motionActive.store(active, std::memory_order_relaxed); }
+
+private:
+    int start();
+    void runFFC(uint64_t nowNs);
+
+    int maxDriftCx10;
+    int tempThresholdCx10;      // camera's thresholds, 0 if disabled
+    uint32_t frameThreshold;
+    bool started;
+    bool baselined;
+    uint32_t lastFFCFrame;
+    int lastFFCTempCx10;
+    bool due;
+    bool deferred;
+    uint64_t requestedNs;       // when bosonRunFFC was last sent
+    std::atomic<bool> motionActive;
+};
+
+// Polls the camera from a normal priority thread so that slow or
+// failing commands never stall frame capture. FFC state and frame
+// counters are polled every interval, often enough to tag frames with
+// their FFC phase; the temperature only once a second. FFCs seen by
+// the poller are counted in stats, and passed to the scheduler if
+// there is one.
+class CameraPoller {
+public:
+    CameraPoller();
+    ~CameraPoller();
+
+    void start(int intervalMs, FfcScheduler *scheduler = NULL);
+    void stop();
+
+private:
+    void run();
+    bool poll();
+
+    int intervalMs;
+    FfcScheduler *scheduler;
+    uint64_t slowDueNs;
+    bool stopping;
+    std::mutex mu;
+    std::condition_variable wake;
+    std::thread thread;
+};
+
+const char *ffcStatusToStr(FLR_BOSON_FFCSTATUS_E status);
+
+// Where a frame falls relative to a flat field correction. While one
+// is in progress the shutter is closed and the image frozen, and for a
+// while after it the image steps and settles, so these frames make
+// poor recordings and false motion.
+enum FfcPhase {
+    FFC_PHASE_NONE,
+    FFC_PHASE_IMMINENT,
+    FFC_PHASE_IN_PROGRESS,
+    FFC_PHASE_SETTLING,
+};
+
+// The phase of a frame captured at timestampNs, from the poller's
+// latest view of the camera. Frames are only as well placed as the
+// poll interval allows, so settling is counted from when the poller
+// saw the FFC finish.
+FfcPhase ffcPhase(uint64_t timestampNs);
+const char *ffcPhaseName(FfcPhase phase);
+
+#endif // CAMERA_H
@@ -0,0 +1,3 @@
+#include "cci.h"
+
+std::mutex cci_mutex;
@@ -0,0 +1,34 @@
+#ifndef CCI_H
+#define CCI_H
+
+#include <mutex>
+
+#include "Client_API.h"
+#include "clock.h"
+#include "stats.h"
+#include "trace.h"
+
+// The Boson SDK keeps its framing state in globals, so commands from
+// different threads must not overlap.
+extern std::mutex cci_mutex;
+
+// Run one camera command (a call into the SDK's Client_API), timing the
+// round trip and counting failures. The name labels it in traces.
+//
+//   uint32_t frames;
+//   cciCall([&] { return roicGetFrameCount(&frames); }, "roicGetFrameCount");
+template <typename F>
+FLR_RESULT cciCall(F command, const char *name = "cci") {
+    std::lock_guard<std::mutex> lock(cci_mutex);
+    uint64_t t0 = monotonicNs();
+    FLR_RESULT result = command();
+    uint64_t t1 = monotonicNs();
+    stats.latency[STAGE_CCI].record(t1 - t0);
+    traceSpan(name, t0, t1);
+    if (result != R_SUCCESS) {
+        stats.count(COUNTER_CCI_ERRORS);
+    }
+    return result;
+}
+
+#endif // CCI_H
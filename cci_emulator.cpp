@@ -0,0 +1,419 @@
+#include "cci_emulator.h"
+
+#include <errno.h>
+#include <math.h>
+#include <poll.h>
+#include <string.h>
+#include <unistd.h>
+#include <thread>
+
+#include "EnumTypes.h"
+#include "FunctionCodes.h"
+#include "ReturnCodes.h"
+#include "Serializer_BuiltIn.h"
+#include "flirCRC.h"
+
+using namespace std::chrono;
+
+const uint8_t escape_byte = 0x9E;
+const uint8_t start_frame_byte = 0x8E;
+const uint8_t end_frame_byte = 0xAE;
+const uint8_t escaped_escape_byte = 0x91;
+const uint8_t escaped_start_frame_byte = 0x81;
+const uint8_t escaped_end_frame_byte = 0xA1;
+
+const uint8_t command_channel = 0x00;
+const size_t max_frame_bytes = 2048;
+const size_t payload_header_bytes = 12;  // sequence, function ID, status
+
+// FFC timing, in frames at the emulated frame rate.
+const uint32_t ffc_imminent_frames = 120;
+const uint32_t ffc_duration_frames = 30;
+
+// Set commands which only store a value for the matching get command.
+static const struct {
+    uint32_t set;
+    uint32_t get;
+} stored_pairs[] = {
+    { GAO_SETFFCSTATE, GAO_GETFFCSTATE },
+    { GAO_SETAVERAGERSTATE, GAO_GETAVERAGERSTATE },
+    { BOSON_SETGAINMODE, BOSON_GETGAINMODE },
+    { BOSON_SETFFCWAITCLOSEFRAMES, BOSON_GETFFCWAITCLOSEFRAMES },
+    { SYSCTRL_SETFREEZESTATE, SYSCTRL_GETFREEZESTATE },
+};
+
+
+CCIEmulator::CCIEmulator(const EmulatorConfig &config) :
+    config(config),
+    rng(config.seed),
+    start(steady_clock::now()),
+    stopped(false),
+    count(),
+    ffcMode(FLR_BOSON_AUTO_FFC),
+    ffcTempThreshold(10),
+    ffcFrameThreshold(3 * 60 * config.frameRate),
+    ffcPending(false),
+    ffcStart(0),
+    ffcDone(false),
+    lastFFCFrame(0),
+    lastFFCTemp(0) {
+    lastFFCTemp = fpaTempCx10(0);
+}
+
+void CCIEmulator::stop() {
+    stopped = true;
+}
+
+EmulatorCounters CCIEmulator::counters() {
+    std::lock_guard<std::mutex> lock(mu);
+    return count;
+}
+
+uint32_t CCIEmulator::frameCount() {
+    auto us = duration_cast<microseconds>(steady_clock::now() - start).count();
+    return (uint32_t)(us * config.frameRate / 1000000);
+}
+
+int CCIEmulator::ffcStatus() {
+    std::lock_guard<std::mutex> lock(mu);
+    uint32_t frame = frameCount();
+    updateFFC(frame);
+    if (ffcPending) {
+        return frame < ffcStart ? FLR_BOSON_FFC_IMMINENT : FLR_BOSON_FFC_IN_PROGRESS;
+    }
+    return ffcDone ? FLR_BOSON_FFC_COMPLETE : FLR_BOSON_NO_FFC_PERFORMED;
+}
+
+// The focal plane array slowly warms up with a small periodic wobble.
+int16_t CCIEmulator::fpaTempCx10(uint32_t frame) {
+    double minutes = (double)frame / config.frameRate / 60.0;
+    return (int16_t)(300 + minutes * 2 + 5 * sin(minutes / 3));
+}
+
+// Complete a pending FFC once it has run, and schedule a new one when
+// the automatic thresholds are crossed. Must be called with mu held.
+void CCIEmulator::updateFFC(uint32_t frame) {
+    if (ffcPending && frame >= ffcStart + ffc_duration_frames) {
+        ffcPending = false;
+        ffcDone = true;
+        lastFFCFrame = ffcStart;
+        lastFFCTemp = fpaTempCx10(ffcStart);
+    }
+    if (!ffcPending && ffcMode == FLR_BOSON_AUTO_FFC) {
+        uint32_t since = frame - lastFFCFrame;
+        int drift = abs(fpaTempCx10(frame) - lastFFCTemp);
+        if ((ffcFrameThreshold && since >= ffcFrameThreshold) ||
+            (ffcTempThreshold && drift >= ffcTempThreshold)) {
+            ffcPending = true;
+            ffcStart = frame + ffc_imminent_frames;
+        }
+    }
+}
+
+int CCIEmulator::serve(int fd) {
+    uint8_t in[4096];
+    uint8_t frame[max_frame_bytes];
+    size_t frameLen = 0;
+    bool inFrame = false;
+    bool inEscape = false;
+
+    while (!stopped) {
+        struct pollfd pfd = { fd, POLLIN, 0 };
+        int n = poll(&pfd, 1, 100);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        if (n == 0) {
+            continue;
+        }
+
+        ssize_t got = read(fd, in, sizeof(in));
+        if (got == 0) {
+            return 0;
+        }
+        if (got < 0) {
+            if (errno == EINTR || errno == EAGAIN || errno == EWOULDBLOCK) {
+                continue;
+            }
+            // A pty master reports EIO while no client has the slave open.
+            if (errno == EIO) {
+                usleep(10000);
+                continue;
+            }
+            return -1;
+        }
+
+        for (ssize_t i = 0; i < got; i++) {
+            uint8_t c = in[i];
+            if (c == start_frame_byte) {
+                inFrame = true;
+                inEscape = false;
+                frameLen = 0;
+                continue;
+            }
+            if (!inFrame) {
+                continue;
+            }
+            if (c == end_frame_byte) {
+                inFrame = false;
+                handleFrame(fd, frame, frameLen);
+                continue;
+            }
+            if (inEscape) {
+                inEscape = false;
+                switch (c) {
+                case escaped_escape_byte:
+                    c = escape_byte;
+                    break;
+                case escaped_start_frame_byte:
+                    c = start_frame_byte;
+                    break;
+                case escaped_end_frame_byte:
+                    c = end_frame_byte;
+                    break;
+                }
+            } else if (c == escape_byte) {
+                inEscape = true;
+                continue;
+            }
+            if (frameLen == sizeof(frame)) {
+                inFrame = false;  // overrun; resync on the next start byte
+                continue;
+            }
+            frame[frameLen++] = c;
+        }
+    }
+    return 0;
+}
+
+// buf holds an unescaped frame: channel ID, payload, CRC (big endian).
+void CCIEmulator::handleFrame(int fd, const uint8_t *buf, size_t len) {
+    std::unique_lock<std::mutex> lock(mu);
+    count.requests++;
+
+    if (len < 1 + payload_header_bytes + 2) {
+        count.badCRC++;
+        return;
+    }
+    uint16_t crc = calcFlirCRC16Bytes(len - 2, (char *)buf);
+    if (buf[len - 2] != (crc >> 8) || buf[len - 1] != (crc & 0xFF)) {
+        count.badCRC++;
+        return;
+    }
+    if (buf[0] != command_channel) {
+        return;
+    }
+
+    const uint8_t *payload = buf + 1;
+    size_t payloadLen = len - 3;
+    uint32_t seq, fnID;
+    byteToUINT_32(payload, &seq);
+    byteToUINT_32(payload + 4, &fnID);
+
+    Bytes reply(payload_header_bytes);
+    uint32_t status = handleCommand(fnID, payload + payload_header_bytes,
+                                    payloadLen - payload_header_bytes, reply);
+    UINT_32ToByte(seq, reply.data());
+    UINT_32ToByte(fnID, reply.data() + 4);
+    UINT_32ToByte(status, reply.data() + 8);
+
+    std::uniform_real_distribution<double> chance(0, 1);
+    if (config.dropRate > 0 && chance(rng) < config.dropRate) {
+        count.dropped++;
+        return;
+    }
+    bool corrupt = config.crcErrorRate > 0 && chance(rng) < config.crcErrorRate;
+    if (corrupt) {
+        count.corrupted++;
+    }
+    unsigned delayUs = config.latencyUs;
+    if (config.jitterUs) {
+        delayUs += std::uniform_int_distribution<unsigned>(0, config.jitterUs)(rng);
+    }
+    count.responses++;
+    lock.unlock();
+
+    if (delayUs) {
+        std::this_thread::sleep_for(microseconds(delayUs));
+    }
+    writeFrame(fd, reply.data(), reply.size(), corrupt);
+}
+
+static void putU32(std::vector<uint8_t> &out, uint32_t v) {
+    size_t at = out.size();
+    out.resize(at + 4);
+    UINT_32ToByte(v, out.data() + at);
+}
+
+static void putU16(std::vector<uint8_t> &out, uint16_t v) {
+    size_t at = out.size();
+    out.resize(at + 2);
+    UINT_16ToByte(v, out.data() + at);
+}
+
+// Appends any reply data to reply and returns the payload status.
+// Must be called with mu held.
+uint32_t CCIEmulator::handleCommand(uint32_t fnID, const uint8_t *data, size_t len, Bytes &reply) {
+    uint32_t frame = frameCount();
+    updateFFC(frame);
+
+    switch (fnID) {
+    case BOSON_GETCAMERASN:
+        putU32(reply, config.serial);
+        return R_SUCCESS;
+    case BOSON_GETSOFTWAREREV:
+        putU32(reply, 2);
+        putU32(reply, 0);
+        putU32(reply, 16);
+        return R_SUCCESS;
+    case ROIC_GETFRAMECOUNT:
+        putU32(reply, frame);
+        return R_SUCCESS;
+    case SYSCTRL_GETCAMERAFRAMERATE:
+        putU32(reply, config.frameRate);
+        return R_SUCCESS;
+    case ROIC_GETFPATEMP:
+        putU16(reply, (uint16_t)(fpaTempCx10(frame) + 2731));
+        return R_SUCCESS;
+    case BOSON_LOOKUPFPATEMPDEGCX10:
+        putU16(reply, (uint16_t)fpaTempCx10(frame));
+        return R_SUCCESS;
+    case BOSON_LOOKUPFPATEMPDEGKX10:
+        putU16(reply, (uint16_t)(fpaTempCx10(frame) + 2731));
+        return R_SUCCESS;
+    case BOSON_GETFFCSTATUS: {
+        int32_t status = FLR_BOSON_NO_FFC_PERFORMED;
+        if (ffcPending) {
+            status = frame < ffcStart ? FLR_BOSON_FFC_IMMINENT : FLR_BOSON_FFC_IN_PROGRESS;
+        } else if (ffcDone) {
+            status = FLR_BOSON_FFC_COMPLETE;
+        }
+        putU32(reply, (uint32_t)status);
+        return R_SUCCESS;
+    }
+    case BOSON_GETFFCINPROGRESS:
+        putU16(reply, (ffcPending && frame >= ffcStart) ? 1 : 0);
+        return R_SUCCESS;
+    case BOSON_GETLASTFFCFRAMECOUNT:
+        putU32(reply, lastFFCFrame);
+        return R_SUCCESS;
+    case BOSON_RUNFFC:
+        if (!ffcPending || frame < ffcStart) {
+            ffcPending = true;
+            ffcStart = frame;
+        }
+        return R_SUCCESS;
+    case BOSON_SETFFCMODE: {
+        if (len < 4) {
+            return R_CAM_PKG_INSUFFICIENT_BYTES;
+        }
+        int32_t mode;
+        byteToINT_32(data, &mode);
+        if (mode < 0 || mode >= FLR_BOSON_FFCMODE_END) {
+            return R_CAM_API_INVALID_INPUT;
+        }
+        ffcMode = mode;
+        if (ffcMode != FLR_BOSON_AUTO_FFC && ffcPending && frame < ffcStart) {
+            ffcPending = false;  // cancel an imminent automatic FFC
+        }
+        return R_SUCCESS;
+    }
+    case BOSON_GETFFCMODE:
+        putU32(reply, (uint32_t)ffcMode);
+        return R_SUCCESS;
+    case BOSON_SETFFCTEMPTHRESHOLD:
+        if (len < 2) {
+            return R_CAM_PKG_INSUFFICIENT_BYTES;
+        }
+        byteToUINT_16(data, &ffcTempThreshold);
+        return R_SUCCESS;
+    case BOSON_GETFFCTEMPTHRESHOLD:
+        putU16(reply, ffcTempThreshold);
+        return R_SUCCESS;
+    case BOSON_SETFFCFRAMETHRESHOLD:
+        if (len < 4) {
+            return R_CAM_PKG_INSUFFICIENT_BYTES;
+        }
+        byteToUINT_32(data, &ffcFrameThreshold);
+        return R_SUCCESS;
+    case BOSON_GETFFCFRAMETHRESHOLD:
+        putU32(reply, ffcFrameThreshold);
+        return R_SUCCESS;
+    }
+
+    for (auto &pair : stored_pairs) {
+        if (fnID == pair.set) {
+            stored[pair.get] = Bytes(data, data + len);
+            return R_SUCCESS;
+        }
+        if (fnID == pair.get) {
+            auto it = stored.find(fnID);
+            if (it == stored.end()) {
+                break;  // never set, so the size of the reply is unknown
+            }
+            reply.insert(reply.end(), it->second.begin(), it->second.end());
+            return R_SUCCESS;
+        }
+    }
+
+    count.unknown++;
+    return R_CAM_DSPCH_BAD_CMD_ID;
+}
+
+static void putEscaped(uint8_t *out, size_t &n, uint8_t c) {
+    switch (c) {
+    case escape_byte:
+        out[n++] = escape_byte;
+        out[n++] = escaped_escape_byte;
+        break;
+    case start_frame_byte:
+        out[n++] = escape_byte;
+        out[n++] = escaped_start_frame_byte;
+        break;
+    case end_frame_byte:
+        out[n++] = escape_byte;
+        out[n++] = escaped_end_frame_byte;
+        break;
+    default:
+        out[n++] = c;
+    }
+}
+
+int CCIEmulator::writeFrame(int fd, const uint8_t *payload, size_t len, bool corrupt) {
+    uint8_t out[2 * max_frame_bytes + 8];
+    size_t n = 0;
+    if (len > max_frame_bytes - 5) {
+        return -1;
+    }
+
+    int crc = ByteCRC16(command_channel, FLIR_CRC_INITIAL_VALUE);
+    out[n++] = start_frame_byte;
+    putEscaped(out, n, command_channel);
+    for (size_t i = 0; i < len; i++) {
+        crc = ByteCRC16(payload[i], crc);
+        putEscaped(out, n, payload[i]);
+    }
+    if (corrupt) {
+        crc ^= 0x5A5A;
+    }
+    putEscaped(out, n, (crc >> 8) & 0xFF);
+    putEscaped(out, n, crc & 0xFF);
+    out[n++] = end_frame_byte;
+
+    size_t written = 0;
+    while (written < n) {
+        ssize_t w = write(fd, out + written, n - written);
+        if (w > 0) {
+            written += w;
+        } else if (w < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            struct pollfd pfd = { fd, POLLOUT, 0 };
+            poll(&pfd, 1, 100);
+        } else if (w < 0 && errno != EINTR) {
+            return -1;
+        }
+    }
+    return 0;
+}
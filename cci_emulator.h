@@ -0,0 +1,87 @@
+#ifndef CCI_EMULATOR_H
+#define CCI_EMULATOR_H
+
+#include <stdint.h>
+#include <atomic>
+#include <chrono>
+#include <map>
+#include <mutex>
+#include <random>
+#include <vector>
+
+// Behaviour of the emulated camera link. Rates are probabilities per
+// response in the range [0, 1].
+struct EmulatorConfig {
+    unsigned latencyUs = 0;      // fixed delay before each response
+    unsigned jitterUs = 0;       // extra uniformly distributed delay
+    double crcErrorRate = 0;     // responses sent with a corrupted CRC
+    double dropRate = 0;         // requests which are never answered
+    uint32_t seed = 1;
+    uint32_t serial = 123456;
+    uint32_t frameRate = 60;
+};
+
+struct EmulatorCounters {
+    uint64_t requests;
+    uint64_t responses;
+    uint64_t badCRC;        // requests received with a bad CRC
+    uint64_t dropped;
+    uint64_t corrupted;
+    uint64_t unknown;       // requests for unimplemented function codes
+};
+
+// Emulates the command and control interface (CCI) of a FLIR Boson.
+// Requests are decoded using the same framing as the SDK's
+// create_frame()/read_frame() (START/END/ESCAPE bytes, channel ID and
+// FLIR CRC16) and answered from a simple model of the camera state,
+// including automatic and manual flat field corrections (FFC).
+class CCIEmulator {
+public:
+    explicit CCIEmulator(const EmulatorConfig &config);
+
+    // Serve requests arriving on fd until EOF, an error or stop().
+    // Returns 0 on EOF or stop, -1 on error.
+    int serve(int fd);
+    void stop();
+
+    EmulatorCounters counters();
+
+    // Current camera frame count, derived from the emulated frame rate.
+    uint32_t frameCount();
+
+    // FFC state at the current frame (an FLR_BOSON_FFCSTATUS_E).
+    int ffcStatus();
+
+private:
+    typedef std::vector<uint8_t> Bytes;
+
+    void handleFrame(int fd, const uint8_t *buf, size_t len);
+    uint32_t handleCommand(uint32_t fnID, const uint8_t *data, size_t len, Bytes &reply);
+    int writeFrame(int fd, const uint8_t *payload, size_t len, bool corrupt);
+    void updateFFC(uint32_t frame);
+    int16_t fpaTempCx10(uint32_t frame);
+
+    EmulatorConfig config;
+    std::mt19937 rng;
+    std::chrono::steady_clock::time_point start;
+    std::atomic<bool> stopped;
+    std::mutex mu;  // guards the camera state and counters
+
+    EmulatorCounters count;
+
+    // Camera state.
+    int32_t ffcMode;
+    uint16_t ffcTempThreshold;   // degrees C x 10
+    uint32_t ffcFrameThreshold;
+    bool ffcPending;
+    uint32_t ffcStart;           // frame the pending FFC starts at
+    bool ffcDone;
+    uint32_t lastFFCFrame;
+    int16_t lastFFCTemp;
+
+    // Values written with set commands which have no side effects,
+    // keyed by the matching get command.
+    std::map<uint32_t, Bytes> stored;
+};
+
+#endif // CCI_EMULATOR_H
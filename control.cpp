@@ -0,0 +1,151 @@
+#include "control.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sched.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "trace.h"
+
+const int command_timeout_ms = 200;
+const size_t max_command_bytes = 256;
+
+
+void demoteThread(int policy) {
+    struct sched_param param;
+    memset(&param, 0, sizeof(param));
+    pthread_setschedparam(pthread_self(), policy, &param);
+}
+
+ControlServer::ControlServer() : listenFd(-1), wakeFd(-1) {
+}
+
+ControlServer::~ControlServer() {
+    stop();
+}
+
+void ControlServer::addCommand(const std::string &name, Handler handler) {
+    commands[name] = handler;
+}
+
+int ControlServer::start(const std::string &socketPath) {
+    path = socketPath;
+    listenFd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (listenFd < 0) {
+        perror("control socket");
+        return -1;
+    }
+
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, path.c_str(), sizeof(addr.sun_path)-1);
+    unlink(path.c_str());
+    if (bind(listenFd, (sockaddr *)&addr, sizeof(addr)) < 0 || listen(listenFd, 4) < 0) {
+        perror("control bind");
+        return -1;
+    }
+
+    wakeFd = eventfd(0, EFD_CLOEXEC);
+    thread = std::thread(&ControlServer::run, this);
+    return 0;
+}
+
+void ControlServer::stop() {
+    if (thread.joinable()) {
+        uint64_t one = 1;
+        if (write(wakeFd, &one, sizeof(one)) < 0) {
+            perror("control stop");
+        }
+        thread.join();
+    }
+    if (listenFd >= 0) {
+        close(listenFd);
+        unlink(path.c_str());
+        listenFd = -1;
+    }
+    if (wakeFd >= 0) {
+        close(wakeFd);
+        wakeFd = -1;
+    }
+}
+
+void ControlServer::run() {
+    demoteThread(SCHED_OTHER);
+    traceThreadStart("control");
+
+    for (;;) {
+        struct pollfd fds[2] = {
+            { listenFd, POLLIN, 0 },
+            { wakeFd, POLLIN, 0 },
+        };
+        if (poll(fds, 2, -1) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("control poll");
+            return;
+        }
+        if (fds[1].revents) {
+            return;
+        }
+        int client = accept4(listenFd, NULL, NULL, SOCK_CLOEXEC);
+        if (client < 0) {
+            continue;
+        }
+        serveClient(client);
+        close(client);
+    }
+}
+
+void ControlServer::serveClient(int client) {
+    // Read one command line, giving up quickly if none is sent.
+    std::string line;
+    char buf[64];
+    while (line.find('\n') == std::string::npos && line.size() < max_command_bytes) {
+        struct pollfd pfd = { client, POLLIN, 0 };
+        if (poll(&pfd, 1, command_timeout_ms) <= 0) {
+            break;
+        }
+        ssize_t n = read(client, buf, sizeof(buf));
+        if (n <= 0) {
+            break;
+        }
+        line.append(buf, n);
+    }
+    line = line.substr(0, line.find_first_of("\r\n"));
+
+    std::string name = line.substr(0, line.find(' '));
+    std::string args = name.size() < line.size() ? line.substr(name.size() + 1) : "";
+    if (name.empty()) {
+        name = "stats";
+    }
+
+    std::string reply;
+    auto it = commands.find(name);
+    if (it == commands.end()) {
+        reply = "error: unknown command: " + name + "\n";
+    } else {
+        reply = it->second(args);
+    }
+
+    const char *p = reply.data();
+    size_t left = reply.size();
+    while (left > 0) {
+        ssize_t n = send(client, p, left, MSG_NOSIGNAL);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return;
+        }
+        p += n;
+        left -= n;
+    }
+}
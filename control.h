@@ -0,0 +1,45 @@
+#ifndef CONTROL_H
+#define CONTROL_H
+
+#include <functional>
+#include <map>
+#include <string>
+#include <thread>
+
+// Answers queries on a Unix domain socket without disturbing the
+// capture thread. A client connects, sends a single command line
+// (optional: "stats" is assumed if nothing arrives) and reads the
+// reply until the server closes the connection.
+//
+//   $ echo stats | socat - UNIX-CONNECT:/var/run/bosond-control
+class ControlServer {
+public:
+    // Handlers receive any text after the command name.
+    typedef std::function<std::string(const std::string &args)> Handler;
+
+    ControlServer();
+    ~ControlServer();
+
+    // Register a command. Must be called before start().
+    void addCommand(const std::string &name, Handler handler);
+
+    int start(const std::string &path);
+    void stop();
+
+private:
+    void run();
+    void serveClient(int client);
+
+    std::map<std::string, Handler> commands;
+    std::string path;
+    int listenFd;
+    int wakeFd;
+    std::thread thread;
+};
+
+// Move the calling thread to a non real-time scheduling policy
+// (SCHED_OTHER or SCHED_IDLE). Threads inherit bosond's FIFO priority
+// otherwise.
+void demoteThread(int policy);
+
+#endif // CONTROL_H
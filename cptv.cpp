@@ -0,0 +1,578 @@
+#include "cptv.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "trace.h"
+
+// Section types and field keys.
+const uint8_t section_header = 'H';
+const uint8_t section_frame = 'F';
+
+const uint8_t field_timestamp = 'T';
+const uint8_t field_x_resolution = 'X';
+const uint8_t field_y_resolution = 'Y';
+const uint8_t field_compression = 'C';
+const uint8_t field_device_name = 'D';
+const uint8_t field_fps = 'Z';
+const uint8_t field_brand = 'B';
+const uint8_t field_model = 'E';
+const uint8_t field_firmware = 'V';
+const uint8_t field_camera_serial = 'N';
+
+const uint8_t field_bit_width = 'w';
+const uint8_t field_frame_size = 'f';
+const uint8_t field_time_on = 't';
+const uint8_t field_last_ffc_time = 'c';
+const uint8_t field_temp_c = 'a';
+const uint8_t field_last_ffc_temp_c = 'b';
+const uint8_t field_background_frame = 'g';
+
+const uint8_t compression_snake_delta = 1;
+const int frame_fields = 6;
+const size_t frame_fields_bytes = 2 + frame_fields * 2 + 4 + 1 + 4 + 4 + 4 + 4;
+// Second differences of 16 bit pixels need at most 18 bits.
+const int max_bit_width = 18;
+// Bit packed deltas have few repeated strings for deflate to find, so
+// Huffman coding alone gets nearly all of its gain in a third of the
+// time.
+const int deflate_level = Z_BEST_SPEED;
+const int deflate_strategy = Z_HUFFMAN_ONLY;
+// A minimal gzip header (no name or mtime, Unix) and the empty final
+// block that ends a stream of sync flushed pieces.
+const uint8_t gzip_header[10] = { 0x1f, 0x8b, 8, 0, 0, 0, 0, 0, 0, 3 };
+const uint8_t deflate_end[2] = { 3, 0 };
+
+static uint64_t getLE(const uint8_t *p, int n) {
+    uint64_t v = 0;
+    for (int i = n - 1; i >= 0; i--) {
+        v = (v << 8) | p[i];
+    }
+    return v;
+}
+
+static float getFloat(const uint8_t *p) {
+    uint32_t bits = (uint32_t)getLE(p, 4);
+    float f;
+    memcpy(&f, &bits, sizeof(f));
+    return f;
+}
+
+static uint8_t *putLE(uint8_t *p, uint64_t v, int n) {
+    for (int i = 0; i < n; i++) {
+        *p++ = v >> (8 * i);
+    }
+    return p;
+}
+
+static uint8_t *putField(uint8_t *p, uint8_t key, uint64_t v, int n) {
+    *p++ = n;
+    *p++ = key;
+    return putLE(p, v, n);
+}
+
+static uint8_t *putFloat(uint8_t *p, uint8_t key, float f) {
+    uint32_t bits;
+    memcpy(&bits, &f, sizeof(bits));
+    return putField(p, key, bits, 4);
+}
+
+static void putString(std::vector<uint8_t> &out, uint8_t key, const std::string &s) {
+    size_t n = s.size() < 255 ? s.size() : 255;
+    out.push_back(n);
+    out.push_back(key);
+    out.insert(out.end(), s.begin(), s.begin() + n);
+}
+
+static void putField(std::vector<uint8_t> &out, uint8_t key, uint64_t v, int n) {
+    uint8_t field[10];
+    out.insert(out.end(), field, putField(field, key, v, n));
+}
+
+// Start a raw deflate stream, for pieces of a gzip member.
+static int deflateStart(z_stream &zs) {
+    memset(&zs, 0, sizeof(zs));
+    return deflateInit2(&zs, deflate_level, Z_DEFLATED, -15, 8, deflate_strategy);
+}
+
+// Deflate data into out on its own, ending with a sync flush. Returns
+// the number of bytes of out used, or -1.
+static int deflatePiece(z_stream &zs, const uint8_t *data, size_t length, std::vector<uint8_t> &out) {
+    deflateReset(&zs);
+    // A sync flush adds an empty stored block beyond the bound.
+    size_t bound = deflateBound(&zs, length) + 16;
+    if (out.size() < bound) {
+        out.resize(bound);
+    }
+    zs.next_in = (Bytef *)data;
+    zs.avail_in = length;
+    zs.next_out = out.data();
+    zs.avail_out = out.size();
+    if (deflate(&zs, Z_SYNC_FLUSH) != Z_OK || zs.avail_in != 0) {
+        return -1;
+    }
+    return out.size() - zs.avail_out;
+}
+
+CptvReader::CptvReader() : gz(NULL), hdr() {
+}
+
+CptvReader::~CptvReader() {
+    close();
+}
+
+void CptvReader::close() {
+    if (gz) {
+        gzclose(gz);
+        gz = NULL;
+    }
+}
+
+// Read a section of the given type, returning its fields as
+// consecutive (length, key, value...) records.
+int CptvReader::readSection(uint8_t type) {
+    uint8_t head[2];
+    int n = gzread(gz, head, 2);
+    if (n == 0) {
+        return 0;
+    }
+    if (n != 2 || head[0] != type) {
+        return -1;
+    }
+    fields.clear();
+    for (int i = 0; i < head[1]; i++) {
+        uint8_t fh[2];
+        if (gzread(gz, fh, 2) != 2) {
+            return -1;
+        }
+        size_t at = fields.size();
+        fields.resize(at + 2 + fh[0]);
+        fields[at] = fh[0];
+        fields[at + 1] = fh[1];
+        if (fh[0] && gzread(gz, &fields[at + 2], fh[0]) != fh[0]) {
+            return -1;
+        }
+    }
+    return 1;
+}
+
+int CptvReader::open(const std::string &path) {
+    close();
+    gz = gzopen(path.c_str(), "rb");
+    if (!gz) {
+        perror("CPTV open");
+        return -1;
+    }
+    gzbuffer(gz, 128 * 1024);
+
+    uint8_t magic[5];
+    if (gzread(gz, magic, 5) != 5 || memcmp(magic, "CPTV", 4) != 0) {
+        fprintf(stderr, "%s: not a CPTV file\n", path.c_str());
+        return -1;
+    }
+    if (magic[4] != cptv_version) {
+        fprintf(stderr, "%s: unsupported CPTV version %d\n", path.c_str(), magic[4]);
+        return -1;
+    }
+
+    // A section has at most 255 fields of at most 255 bytes each.
+    fields.reserve(255 * (2 + 255));
+    if (readSection(section_header) != 1) {
+        fprintf(stderr, "%s: bad CPTV header\n", path.c_str());
+        return -1;
+    }
+    hdr = CptvHeader();
+    hdr.fps = 9;  // files from Lepton cameras predate the FPS field
+    for (size_t i = 0; i < fields.size(); i += 2 + fields[i]) {
+        uint8_t len = fields[i];
+        const uint8_t *v = &fields[i + 2];
+        switch (fields[i + 1]) {
+        case field_timestamp: hdr.timestampUs = getLE(v, len); break;
+        case field_x_resolution: hdr.width = getLE(v, len); break;
+        case field_y_resolution: hdr.height = getLE(v, len); break;
+        case field_compression: hdr.compression = v[0]; break;
+        case field_fps: hdr.fps = v[0]; break;
+        case field_camera_serial: hdr.cameraSerial = getLE(v, len); break;
+        case field_firmware: hdr.firmware = getLE(v, len); break;
+        case field_brand: hdr.brand.assign((const char *)v, len); break;
+        case field_model: hdr.model.assign((const char *)v, len); break;
+        case field_device_name: hdr.deviceName.assign((const char *)v, len); break;
+        }
+    }
+    if (hdr.width == 0 || hdr.height == 0) {
+        fprintf(stderr, "%s: missing CPTV resolution\n", path.c_str());
+        return -1;
+    }
+    prev.assign(hdr.width * hdr.height, 0);
+    packed.reserve(maxFrameSize() + 4);
+    return 0;
+}
+
+int CptvReader::next(uint16_t *pix, CptvFrameInfo *info) {
+    int r = readSection(section_frame);
+    if (r != 1) {
+        return r;
+    }
+
+    uint8_t bitWidth = 0;
+    uint32_t frameSize = 0;
+    CptvFrameInfo fi = CptvFrameInfo();
+    for (size_t i = 0; i < fields.size(); i += 2 + fields[i]) {
+        uint8_t len = fields[i];
+        const uint8_t *v = &fields[i + 2];
+        switch (fields[i + 1]) {
+        case field_bit_width: bitWidth = v[0]; break;
+        case field_frame_size: frameSize = getLE(v, len); break;
+        case field_time_on: fi.timeOnMs = getLE(v, len); break;
+        case field_last_ffc_time: fi.lastFFCMs = getLE(v, len); break;
+        case field_temp_c: fi.tempC = getFloat(v); break;
+        case field_last_ffc_temp_c: fi.lastFFCTempC = getFloat(v); break;
+        case field_background_frame: fi.background = v[0] != 0; break;
+        }
+    }
+    if (info) {
+        *info = fi;
+    }
+
+    size_t count = prev.size();
+    if (frameSize < 4 || frameSize > maxFrameSize() || bitWidth == 0 || bitWidth > 32 ||
+        (uint64_t)(count - 1) * bitWidth > ((uint64_t)frameSize - 4) * 8) {
+        return -1;
+    }
+    packed.resize(frameSize + 4);
+    if (gzread(gz, packed.data(), frameSize) != (int)frameSize) {
+        return -1;
+    }
+    memset(&packed[frameSize], 0, 4);
+
+    // Unpack the second order deltas (MSB first, two's complement)
+    // while walking the snake, undoing both delta stages as we go.
+    int32_t delta = (int32_t)getLE(packed.data(), 4);
+    const uint8_t *in = packed.data() + 4;
+    uint64_t bits = 0;
+    int nbits = 0;
+    int shift = 64 - bitWidth;
+    size_t i = 0;
+    for (uint32_t y = 0; y < hdr.height; y++) {
+        bool forward = (y & 1) == 0;
+        for (uint32_t n = 0; n < hdr.width; n++) {
+            uint32_t x = forward ? n : hdr.width - 1 - n;
+            if (i > 0) {
+                while (nbits < bitWidth) {
+                    bits |= (uint64_t)*in++ << (56 - nbits);
+                    nbits += 8;
+                }
+                delta += (int32_t)((int64_t)bits >> shift);
+                bits <<= bitWidth;
+                nbits -= bitWidth;
+            }
+            size_t idx = y * hdr.width + x;
+            int32_t v = prev[idx] + delta;
+            prev[idx] = v;
+            pix[idx] = (uint16_t)v;
+            i++;
+        }
+    }
+    return 1;
+}
+
+
+CptvFrameEncoder::CptvFrameEncoder(uint32_t width, uint32_t height) :
+    width(width),
+    height(height),
+    deltas(width * height),
+    section(frame_fields_bytes + 4 + ((size_t)width * height * max_bit_width + 7) / 8 + 8) {
+    deflateStart(zs);
+}
+
+CptvFrameEncoder::~CptvFrameEncoder() {
+    deflateEnd(&zs);
+}
+
+const uint8_t *CptvFrameEncoder::pack(const uint16_t *prev, const uint16_t *pix,
+                                      const CptvFrameInfo &info, size_t *length) {
+    // Walk the snake taking deltas against the previous frame, and
+    // difference those in turn. The first is stored whole; the rest
+    // set the bit width.
+    int32_t last = 0;
+    uint32_t range = 0;
+    size_t i = 0;
+    for (uint32_t y = 0; y < height; y++) {
+        const uint16_t *row = pix + y * width;
+        const uint16_t *prevRow = prev ? prev + y * width : NULL;
+        bool forward = (y & 1) == 0;
+        for (uint32_t n = 0; n < width; n++) {
+            uint32_t x = forward ? n : width - 1 - n;
+            int32_t delta = (int32_t)row[x] - (prevRow ? prevRow[x] : 0);
+            int32_t v = delta - last;
+            last = delta;
+            deltas[i] = v;
+            range |= i ? (uint32_t)(v ^ (v >> 31)) : 0;
+            i++;
+        }
+    }
+    // Enough bits for the largest magnitude plus a sign.
+    int bitWidth = range ? 33 - __builtin_clz(range) : 1;
+
+    uint8_t *payload = section.data() + frame_fields_bytes;
+    uint8_t *out = putLE(payload, deltas[0], 4);
+    uint32_t mask = (1u << bitWidth) - 1;
+    uint64_t bits = 0;
+    int nbits = 0;
+    for (size_t j = 1; j < i; j++) {
+        bits = (bits << bitWidth) | ((uint32_t)deltas[j] & mask);
+        nbits += bitWidth;
+        if (nbits >= 32) {
+            nbits -= 32;
+            uint32_t word = __builtin_bswap32((uint32_t)(bits >> nbits));
+            memcpy(out, &word, 4);
+            out += 4;
+        }
+    }
+    for (; nbits >= 8; nbits -= 8) {
+        *out++ = bits >> (nbits - 8);
+    }
+    if (nbits > 0) {
+        *out++ = bits << (8 - nbits);
+    }
+
+    uint8_t *p = section.data();
+    *p++ = section_frame;
+    *p++ = frame_fields;
+    p = putField(p, field_time_on, info.timeOnMs, 4);
+    p = putField(p, field_bit_width, bitWidth, 1);
+    p = putField(p, field_frame_size, out - payload, 4);
+    p = putField(p, field_last_ffc_time, info.lastFFCMs, 4);
+    p = putFloat(p, field_temp_c, info.tempC);
+    p = putFloat(p, field_last_ffc_temp_c, info.lastFFCTempC);
+    *length = out - section.data();
+    return section.data();
+}
+
+int CptvFrameEncoder::encode(const uint16_t *prev, const uint16_t *pix, const CptvFrameInfo &info,
+                             std::vector<uint8_t> &out, uint32_t *crc, size_t *length) {
+    const uint8_t *data = pack(prev, pix, info, length);
+    *crc = crc32(0, data, *length);
+    return deflatePiece(zs, data, *length, out);
+}
+
+
+CptvWriter::CptvWriter(uint32_t width, uint32_t height, int threads) :
+    width(width),
+    height(height),
+    jobs((threads < 1 ? 1 : threads) * 2),
+    fd(-1),
+    crc(0),
+    length(0),
+    framesWritten(0),
+    queued(0),
+    started(0),
+    finished(0),
+    stopping(false) {
+    for (int i = 0; i < (threads < 1 ? 1 : threads); i++) {
+        workers.emplace_back(&CptvWriter::work, this);
+    }
+}
+
+CptvWriter::~CptvWriter() {
+    abandon();
+    {
+        std::lock_guard<std::mutex> lock(mu);
+        stopping = true;
+    }
+    workReady.notify_all();
+    for (std::thread &worker : workers) {
+        worker.join();
+    }
+}
+
+void CptvWriter::work() {
+    traceThreadStart("cptv");
+    CptvFrameEncoder encoder(width, height);
+
+    std::unique_lock<std::mutex> lock(mu);
+    for (;;) {
+        workReady.wait(lock, [this] { return stopping || started < queued; });
+        if (started == queued) {
+            break;
+        }
+        Job &job = jobs[started++ % jobs.size()];
+        lock.unlock();
+        {
+            TraceScope span("cptv compress");
+            job.outLength = encoder.encode(job.prev, job.pix, job.info, job.out, &job.crc, &job.length);
+        }
+        lock.lock();
+        job.done = true;
+        jobDone.notify_all();
+    }
+}
+
+int CptvWriter::writeAll(const uint8_t *data, size_t n) {
+    while (n > 0) {
+        ssize_t w = write(fd, data, n);
+        if (w < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        data += w;
+        n -= w;
+    }
+    return 0;
+}
+
+int CptvWriter::open(int fileFd, const CptvHeader &header) {
+    abandon();
+    fd = fileFd;
+    framesWritten = 0;
+
+    std::vector<uint8_t> head = { 'C', 'P', 'T', 'V', cptv_version, section_header, 0 };
+    putField(head, field_timestamp, header.timestampUs, 8);
+    putField(head, field_x_resolution, width, 4);
+    putField(head, field_y_resolution, height, 4);
+    putField(head, field_compression, compression_snake_delta, 1);
+    putField(head, field_fps, header.fps, 1);
+    uint8_t fields = 5;
+    if (!header.deviceName.empty()) {
+        putString(head, field_device_name, header.deviceName);
+        fields++;
+    }
+    if (!header.brand.empty()) {
+        putString(head, field_brand, header.brand);
+        fields++;
+    }
+    if (!header.model.empty()) {
+        putString(head, field_model, header.model);
+        fields++;
+    }
+    if (header.cameraSerial) {
+        putField(head, field_camera_serial, header.cameraSerial, 4);
+        fields++;
+    }
+    if (header.firmware) {
+        putField(head, field_firmware, header.firmware, 4);
+        fields++;
+    }
+    head[6] = fields;
+
+    z_stream zs;
+    std::vector<uint8_t> out;
+    int n = deflateStart(zs) == Z_OK ? deflatePiece(zs, head.data(), head.size(), out) : -1;
+    deflateEnd(&zs);
+    if (n < 0) {
+        errno = EIO;
+        abandon();
+        return -1;
+    }
+    crc = crc32(0, head.data(), head.size());
+    length = head.size();
+    if (writeAll(gzip_header, sizeof(gzip_header)) < 0 || writeAll(out.data(), n) < 0) {
+        abandon();
+        return -1;
+    }
+    return 0;
+}
+
+int CptvWriter::add(const uint16_t *prev, const uint16_t *pix, const CptvFrameInfo &info) {
+    if (fd < 0) {
+        errno = EBADF;
+        return -1;
+    }
+    std::unique_lock<std::mutex> lock(mu);
+    if (queued - finished == jobs.size() && writeOldest(lock, true) < 0) {
+        lock.unlock();
+        abandon();
+        return -1;
+    }
+    Job &job = jobs[queued++ % jobs.size()];
+    job.prev = prev;
+    job.pix = pix;
+    job.info = info;
+    job.done = false;
+    lock.unlock();
+    workReady.notify_one();
+    return 0;
+}
+
+// Write out the oldest job if it is finished, or once it is if wait is
+// set. Returns 1 if it was written, 0 if not and -1 on error.
+int CptvWriter::writeOldest(std::unique_lock<std::mutex> &lock, bool wait) {
+    if (finished == queued) {
+        return 0;
+    }
+    Job &job = jobs[finished % jobs.size()];
+    if (!job.done) {
+        if (!wait) {
+            return 0;
+        }
+        jobDone.wait(lock, [&job] { return job.done; });
+    }
+    finished++;
+    if (job.outLength < 0) {
+        errno = EIO;
+        return -1;
+    }
+    // The slot can't be reused until this returns, as only the caller
+    // adds jobs.
+    lock.unlock();
+    int r = writeAll(job.out.data(), job.outLength);
+    lock.lock();
+    if (r < 0) {
+        return -1;
+    }
+    crc = crc32_combine(crc, job.crc, job.length);
+    length += job.length;
+    framesWritten++;
+    return 1;
+}
+
+int CptvWriter::flush(bool wait) {
+    if (fd < 0) {
+        errno = EBADF;
+        return -1;
+    }
+    std::unique_lock<std::mutex> lock(mu);
+    int r;
+    while ((r = writeOldest(lock, wait)) > 0) {
+    }
+    if (r < 0) {
+        lock.unlock();
+        abandon();
+        return -1;
+    }
+    return 0;
+}
+
+int CptvWriter::close() {
+    if (flush(true) < 0) {
+        return -1;
+    }
+    uint8_t trailer[8];
+    putLE(putLE(trailer, crc, 4), length, 4);
+    if (writeAll(deflate_end, sizeof(deflate_end)) < 0 || writeAll(trailer, sizeof(trailer)) < 0) {
+        abandon();
+        return -1;
+    }
+    int r = ::close(fd);
+    fd = -1;
+    return r;
+}
+
+// Drop the file in progress, once the workers are done with its frames.
+void CptvWriter::abandon() {
+    std::unique_lock<std::mutex> lock(mu);
+    for (; finished < queued; finished++) {
+        Job &job = jobs[finished % jobs.size()];
+        jobDone.wait(lock, [&job] { return job.done; });
+    }
+    if (fd >= 0) {
+        int err = errno;
+        ::close(fd);
+        errno = err;
+        fd = -1;
+    }
+}
@@ -0,0 +1,166 @@
+#ifndef CPTV_H
+#define CPTV_H
+
+#include <stdint.h>
+#include <zlib.h>
+#include <condition_variable>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+// CPTV is the Cacophony Project's thermal video format: a gzipped
+// stream of a header section followed by frame sections. Each section
+// is a type byte, a field count and fields of (length, key, value)
+// with little endian values. Frame pixels are delta encoded against
+// the previous frame, the deltas walked in a "snake" (alternate rows
+// reversed), differenced again and bit packed at the smallest width
+// that holds them.
+
+const uint8_t cptv_version = 2;
+
+struct CptvHeader {
+    uint64_t timestampUs;   // recording start, microseconds since epoch
+    uint32_t width;
+    uint32_t height;
+    uint8_t compression;
+    uint8_t fps;
+    std::string brand;
+    std::string model;
+    std::string deviceName;
+    uint32_t cameraSerial;
+    uint32_t firmware;
+};
+
+struct CptvFrameInfo {
+    uint32_t timeOnMs;      // camera uptime when the frame was captured
+    uint32_t lastFFCMs;     // camera uptime at the last FFC
+    float tempC;            // FPA temperature
+    float lastFFCTempC;
+    bool background;
+};
+
+class CptvReader {
+public:
+    CptvReader();
+    ~CptvReader();
+
+    int open(const std::string &path);
+    void close();
+    const CptvHeader &header() { return hdr; }
+
+    // Decode the next frame into pix (width * height values).
+    // Returns 1 for a frame, 0 at the end of the file and -1 on error.
+    int next(uint16_t *pix, CptvFrameInfo *info);
+
+private:
+    int readSection(uint8_t type);
+
+    // The largest frame a valid file can have: the first pixel and 32
+    // bit deltas for the rest.
+    size_t maxFrameSize() const { return 4 + (prev.size() - 1) * 4; }
+
+    gzFile gz;
+    CptvHeader hdr;
+    std::vector<int32_t> prev;
+    // Reserved in open() for the largest section and frame, so reading
+    // frames doesn't allocate.
+    std::vector<uint8_t> fields;
+    std::vector<uint8_t> packed;
+};
+
+// Packs and deflates one frame section at a time. Each frame depends
+// only on itself and the frame before it, so frames can be encoded
+// independently, one encoder per thread.
+class CptvFrameEncoder {
+public:
+    CptvFrameEncoder(uint32_t width, uint32_t height);
+    ~CptvFrameEncoder();
+
+    // Build the frame section for pix, delta encoded against prev (NULL
+    // for the first frame of a file). Returns a pointer to it.
+    const uint8_t *pack(const uint16_t *prev, const uint16_t *pix, const CptvFrameInfo &info, size_t *length);
+
+    // Pack a frame and deflate it into out as raw deflate data ending on
+    // a byte boundary (a sync flush), so pieces can be concatenated.
+    // Returns the number of bytes of out used, or -1 on error, and sets
+    // the CRC and length of the section for the gzip trailer.
+    int encode(const uint16_t *prev, const uint16_t *pix, const CptvFrameInfo &info,
+               std::vector<uint8_t> &out, uint32_t *crc, size_t *length);
+
+private:
+    uint32_t width;
+    uint32_t height;
+    std::vector<int32_t> deltas;
+    std::vector<uint8_t> section;
+    z_stream zs;
+};
+
+// Writes a CPTV file, compressing frames on a pool of worker threads.
+// Frames are deflated independently and the pieces joined, in order,
+// into a single gzip member (as pigz does), combining their CRCs, so
+// any gzip reader can read the result. Workers inherit the scheduling
+// of the thread that creates the writer.
+class CptvWriter {
+public:
+    CptvWriter(uint32_t width, uint32_t height, int threads);
+    ~CptvWriter();
+
+    // Start a file on fd, which the writer then owns, and write its
+    // header. The header's resolution is the writer's.
+    int open(int fd, const CptvHeader &header);
+
+    // Queue a frame for compression. pix and prev (the frame before it
+    // in the file, NULL for the first) must stay unchanged until
+    // written() counts the frame. Blocks, writing out finished frames,
+    // while every worker is busy.
+    int add(const uint16_t *prev, const uint16_t *pix, const CptvFrameInfo &info);
+
+    // Write out the frames that have finished compressing, in order,
+    // waiting for all of them if wait is set.
+    int flush(bool wait);
+
+    // Write out the remaining frames and the gzip trailer, and close
+    // the file. After an error from any of these calls the file has
+    // already been closed, once the workers are done with its frames.
+    int close();
+
+    // Frames written to the file since it was opened.
+    uint64_t written() const { return framesWritten; }
+
+private:
+    struct Job {
+        const uint16_t *prev;
+        const uint16_t *pix;
+        CptvFrameInfo info;
+        std::vector<uint8_t> out;
+        int outLength;      // -1 if compression failed
+        uint32_t crc;
+        size_t length;
+        bool done;
+    };
+
+    void work();
+    int writeOldest(std::unique_lock<std::mutex> &lock, bool wait);
+    int writeAll(const uint8_t *data, size_t length);
+    void abandon();
+
+    uint32_t width;
+    uint32_t height;
+    std::vector<Job> jobs;
+    std::vector<std::thread> workers;
+    int fd;
+    uint32_t crc;
+    uint32_t length;        // uncompressed bytes, mod 2^32 as gzip has it
+    uint64_t framesWritten;
+    uint64_t queued;        // jobs added
+    uint64_t started;       // jobs taken by workers
+    uint64_t finished;      // jobs written out
+
+    std::mutex mu;
+    std::condition_variable workReady;
+    std::condition_variable jobDone;
+    bool stopping;
+};
+
+#endif // CPTV_H
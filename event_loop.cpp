@@ -0,0 +1,359 @@
+#include "event_loop.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <poll.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/signalfd.h>
+#include <sys/timerfd.h>
+#include <map>
+
+#include "uring.h"
+
+const int max_epoll_events = 16;
+const unsigned uring_entries = 64;
+
+
+EventLoop::~EventLoop() {
+    for (int fd : ownFds) {
+        close(fd);
+    }
+}
+
+int EventLoop::addTimer(uint64_t intervalNs, std::function<void()> callback) {
+    int fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (fd < 0) {
+        perror("timerfd_create");
+        return -1;
+    }
+    struct itimerspec spec;
+    spec.it_interval.tv_sec = intervalNs / 1000000000ULL;
+    spec.it_interval.tv_nsec = intervalNs % 1000000000ULL;
+    spec.it_value = spec.it_interval;
+    if (timerfd_settime(fd, 0, &spec, NULL) < 0) {
+        perror("timerfd_settime");
+        close(fd);
+        return -1;
+    }
+    ownFds.push_back(fd);
+    return add(fd, POLLIN, [fd, callback](uint32_t) {
+        uint64_t expirations;
+        if (read(fd, &expirations, sizeof(expirations)) == sizeof(expirations)) {
+            callback();
+        }
+    });
+}
+
+int EventLoop::addSignals(const std::vector<int> &signals, std::function<void(int)> callback) {
+    sigset_t set;
+    sigemptyset(&set);
+    for (int sig : signals) {
+        sigaddset(&set, sig);
+    }
+    int err = pthread_sigmask(SIG_BLOCK, &set, NULL);
+    if (err) {
+        fprintf(stderr, "pthread_sigmask: %s\n", strerror(err));
+        return -1;
+    }
+    int fd = signalfd(-1, &set, SFD_NONBLOCK | SFD_CLOEXEC);
+    if (fd < 0) {
+        perror("signalfd");
+        return -1;
+    }
+    ownFds.push_back(fd);
+    return add(fd, POLLIN, [fd, callback](uint32_t) {
+        struct signalfd_siginfo info;
+        while (read(fd, &info, sizeof(info)) == sizeof(info)) {
+            callback(info.ssi_signo);
+        }
+    });
+}
+
+
+namespace {
+
+struct Handler {
+    int fd;
+    uint32_t events;
+    EventLoop::Callback callback;
+    bool removed;
+};
+
+class EpollLoop : public EventLoop {
+public:
+    EpollLoop() : epfd(-1) {}
+
+    ~EpollLoop() {
+        for (auto &h : handlers) {
+            delete h.second;
+        }
+        for (Handler *h : removedHandlers) {
+            delete h;
+        }
+        if (epfd >= 0) {
+            close(epfd);
+        }
+    }
+
+    int init() {
+        epfd = epoll_create1(EPOLL_CLOEXEC);
+        if (epfd < 0) {
+            perror("epoll_create1");
+            return -1;
+        }
+        return 0;
+    }
+
+    int add(int fd, uint32_t events, Callback callback) {
+        Handler *h = new Handler{ fd, 0, callback, false };
+        handlers[fd] = h;
+        return modify(fd, events);
+    }
+
+    // epoll always reports errors and hangups for registered fds, so
+    // unwatched ones are removed from the epoll set.
+    int modify(int fd, uint32_t events) {
+        auto it = handlers.find(fd);
+        if (it == handlers.end()) {
+            return -1;
+        }
+        Handler *h = it->second;
+        if (h->events == events) {
+            return 0;
+        }
+        struct epoll_event ev;
+        ev.events = events;
+        ev.data.ptr = h;
+        int op = !events ? EPOLL_CTL_DEL : h->events ? EPOLL_CTL_MOD : EPOLL_CTL_ADD;
+        if (epoll_ctl(epfd, op, fd, &ev) < 0) {
+            perror("epoll_ctl");
+            return -1;
+        }
+        h->events = events;
+        return 0;
+    }
+
+    int remove(int fd) {
+        auto it = handlers.find(fd);
+        if (it == handlers.end()) {
+            return -1;
+        }
+        if (it->second->events) {
+            epoll_ctl(epfd, EPOLL_CTL_DEL, fd, NULL);
+        }
+        // Events for it may still be pending in the current batch.
+        it->second->removed = true;
+        removedHandlers.push_back(it->second);
+        handlers.erase(it);
+        return 0;
+    }
+
+    int run() {
+        struct epoll_event events[max_epoll_events];
+        stopping = false;
+        while (!stopping) {
+            int n = epoll_wait(epfd, events, max_epoll_events, -1);
+            if (n < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                perror("epoll_wait");
+                return -1;
+            }
+            for (int i = 0; i < n && !stopping; i++) {
+                Handler *h = (Handler *)events[i].data.ptr;
+                if (!h->removed && h->events) {
+                    h->callback(events[i].events);
+                }
+            }
+            for (Handler *h : removedHandlers) {
+                delete h;
+            }
+            removedHandlers.clear();
+        }
+        return 0;
+    }
+
+    const char *name() { return "epoll"; }
+
+private:
+    int epfd;
+    std::map<int, Handler *> handlers;
+    std::vector<Handler *> removedHandlers;
+};
+
+
+// One-shot poll requests, re-armed after each completion while the
+// handler still wants events.
+class UringLoop : public EventLoop {
+public:
+    UringLoop() : failed(false) {}
+
+    ~UringLoop() {
+        for (auto &p : polls) {
+            delete p.second;
+        }
+    }
+
+    int init() {
+        return ring.init(uring_entries);
+    }
+
+    int add(int fd, uint32_t events, Callback callback) {
+        Poll *p = new Poll(this, fd, events, callback);
+        polls[fd] = p;
+        if (events) {
+            p->arm();
+        }
+        return 0;
+    }
+
+    int modify(int fd, uint32_t events) {
+        auto it = polls.find(fd);
+        if (it == polls.end()) {
+            return -1;
+        }
+        Poll *p = it->second;
+        p->events = events;
+        if (events && !p->inFlight) {
+            p->arm();
+        } else if (p->inFlight && events != p->armedEvents && !p->cancelling) {
+            // complete() re-arms the cancelled poll with the new events.
+            p->cancel();
+        }
+        return failed ? -1 : 0;
+    }
+
+    int remove(int fd) {
+        auto it = polls.find(fd);
+        if (it == polls.end()) {
+            return -1;
+        }
+        Poll *p = it->second;
+        polls.erase(it);
+        p->events = 0;
+        p->removed = true;
+        if (p->inFlight) {
+            p->cancel();    // deleted when the cancelled poll completes
+        } else if (!p->dispatching) {
+            delete p;
+        }
+        return 0;
+    }
+
+    int run() {
+        stopping = false;
+        while (!stopping) {
+            if (ring.submit(1) < 0) {
+                perror("io_uring_enter");
+                return -1;
+            }
+            ring.reap();
+        }
+        return failed ? -1 : 0;
+    }
+
+    const char *name() { return "io_uring"; }
+    Uring *uring() { return &ring; }
+
+private:
+    struct Poll : public IoRequest {
+        Poll(UringLoop *loop, int fd, uint32_t events, Callback callback) :
+            loop(loop), fd(fd), events(events), callback(callback),
+            armedEvents(0), inFlight(false), cancelling(false), removed(false),
+            dispatching(false) {
+        }
+
+        void arm() {
+            struct io_uring_sqe *sqe = loop->ring.sqe(this);
+            if (!sqe) {
+                loop->fail();
+                return;
+            }
+            sqe->opcode = IORING_OP_POLL_ADD;
+            sqe->fd = fd;
+            sqe->poll32_events = events;
+            armedEvents = events;
+            inFlight = true;
+        }
+
+        void cancel() {
+            struct io_uring_sqe *sqe = loop->ring.sqe(NULL);
+            if (!sqe) {
+                loop->fail();
+                return;
+            }
+            sqe->opcode = IORING_OP_POLL_REMOVE;
+            sqe->addr = (uint64_t)(uintptr_t)this;
+            cancelling = true;
+        }
+
+        void complete(int res, uint32_t) {
+            inFlight = false;
+            cancelling = false;
+            if (res < 0 && res != -ECANCELED && !removed) {
+                fprintf(stderr, "io_uring poll on fd %d: %s\n", fd, strerror(-res));
+                return;
+            }
+            if (res > 0 && events && !removed) {
+                dispatching = true;
+                callback(res);
+                dispatching = false;
+            }
+            if (removed) {
+                if (!inFlight) {
+                    delete this;
+                }
+                return;
+            }
+            if (events && !inFlight) {
+                arm();
+            }
+        }
+
+        UringLoop *loop;
+        int fd;
+        uint32_t events;
+        Callback callback;
+        uint32_t armedEvents;   // what the poll in flight waits for
+        bool inFlight;
+        bool cancelling;
+        bool removed;
+        bool dispatching;
+    };
+
+    // A poll which can't be queued would never fire, so give up rather
+    // than leave its handler waiting forever.
+    void fail() {
+        fprintf(stderr, "io_uring: submission queue full\n");
+        failed = true;
+        stopping = true;
+    }
+
+    Uring ring;
+    std::map<int, Poll *> polls;
+    bool failed;
+};
+
+} // namespace
+
+
+EventLoop *EventLoop::create(bool useUring) {
+    if (useUring) {
+        UringLoop *loop = new UringLoop();
+        if (loop->init() == 0) {
+            return loop;
+        }
+        perror("io_uring not available, using epoll");
+        delete loop;
+    }
+    EpollLoop *loop = new EpollLoop();
+    if (loop->init() < 0) {
+        delete loop;
+        return NULL;
+    }
+    return loop;
+}
@@ -0,0 +1,59 @@
+#ifndef EVENT_LOOP_H
+#define EVENT_LOOP_H
+
+#include <stdint.h>
+#include <functional>
+#include <vector>
+
+class Uring;
+
+// Dispatches file descriptor readiness to callbacks on one thread,
+// so the capture thread can wait on the video device, output sockets,
+// timers and signals at once instead of blocking in each in turn.
+// Backed by epoll, or by io_uring poll requests where the kernel
+// supports it.
+class EventLoop {
+public:
+    // events is a mask of POLLIN, POLLOUT, POLLERR and POLLHUP.
+    typedef std::function<void(uint32_t events)> Callback;
+
+    // An io_uring loop if useUring and the kernel allows it, otherwise
+    // epoll. Returns NULL on failure.
+    static EventLoop *create(bool useUring);
+
+    virtual ~EventLoop();
+
+    // Watch fd for POLLIN and/or POLLOUT. Errors and hangups are only
+    // reported while some events are watched; 0 registers the fd
+    // without watching it.
+    virtual int add(int fd, uint32_t events, Callback callback) = 0;
+    virtual int modify(int fd, uint32_t events) = 0;
+    virtual int remove(int fd) = 0;
+
+    // Dispatch events until stop() is called from a callback. May be
+    // called again afterwards.
+    virtual int run() = 0;
+    void stop() { stopping = true; }
+
+    // Call callback every intervalNs using a timerfd.
+    int addTimer(uint64_t intervalNs, std::function<void()> callback);
+
+    // Receive the signals through a signalfd. They are blocked in the
+    // calling thread, so this must be called before starting threads
+    // which should inherit that.
+    int addSignals(const std::vector<int> &signals, std::function<void(int)> callback);
+
+    virtual const char *name() = 0;
+
+    // The io_uring the loop runs on, or NULL for epoll, for callers
+    // which want to submit their own operations to it.
+    virtual Uring *uring() { return NULL; }
+
+protected:
+    EventLoop() : stopping(false) {}
+
+    bool stopping;
+    std::vector<int> ownFds;    // timerfds and signalfds
+};
+
+#endif // EVENT_LOOP_H
@@ -0,0 +1,199 @@
+#include "frame_codec.h"
+
+#include <endian.h>
+#include <string.h>
+#include <algorithm>
+
+// Zig-zag mapped differences of 16 bit pixels need up to 17 bits.
+const int max_bit_width = 17;
+const size_t max_block_bytes = 1 + 2 * max_bit_width;
+// Bit packed values have few repeated strings for deflate to find, so
+// Huffman coding alone gets nearly all of its gain, much faster.
+const int deflate_level = Z_BEST_SPEED;
+
+
+// Difference and zig-zag map a block, returning the bit width of its
+// largest value.
+static int mapBlock(const uint16_t *pix, const uint16_t *prev, uint32_t *values) {
+    uint32_t any = 0;
+    for (int k = 0; k < codec_block_pixels; k++) {
+        int32_t d = (int32_t)pix[k] - prev[k];
+        values[k] = ((uint32_t)d << 1) ^ (uint32_t)(d >> 31);
+        any |= values[k];
+    }
+    return any ? 32 - __builtin_clz(any) : 0;
+}
+
+static uint8_t *packBlock(const uint32_t *values, int width, uint8_t *out) {
+    *out++ = width;
+    uint64_t bits = 0;
+    int nbits = 0;
+    for (int k = 0; k < codec_block_pixels; k++) {
+        bits |= (uint64_t)values[k] << nbits;
+        nbits += width;
+        if (nbits >= 32) {
+            uint32_t word = htole32((uint32_t)bits);
+            memcpy(out, &word, 4);
+            out += 4;
+            bits >>= 32;
+            nbits -= 32;
+        }
+    }
+    // A block is a whole number of 16 bit words.
+    if (nbits > 0) {
+        uint16_t half = htole16((uint16_t)bits);
+        memcpy(out, &half, 2);
+        out += 2;
+    }
+    return out;
+}
+
+
+FrameEncoder::FrameEncoder(size_t pixels, bool huffman) :
+    pixels(pixels),
+    huffman(huffman),
+    key(true),
+    prev(pixels),
+    packed(1 + (pixels + codec_block_pixels - 1) / codec_block_pixels * max_block_bytes) {
+    memset(&zs, 0, sizeof(zs));
+    if (huffman) {
+        deflateInit2(&zs, deflate_level, Z_DEFLATED, -15, 8, Z_HUFFMAN_ONLY);
+        deflated.resize(1 + deflateBound(&zs, packed.size()));
+    }
+}
+
+FrameEncoder::~FrameEncoder() {
+    if (huffman) {
+        deflateEnd(&zs);
+    }
+}
+
+void FrameEncoder::reset() {
+    key = true;
+}
+
+const uint8_t *FrameEncoder::encode(const uint16_t *pix, size_t *length) {
+    uint8_t *out = packed.data();
+    *out++ = key ? codec_key_frame : 0;
+    if (key) {
+        std::fill(prev.begin(), prev.end(), 0);
+        key = false;
+    }
+
+    uint32_t values[codec_block_pixels];
+    size_t whole = pixels - pixels % codec_block_pixels;
+    for (size_t i = 0; i < whole; i += codec_block_pixels) {
+        int width = mapBlock(pix + i, &prev[i], values);
+        out = packBlock(values, width, out);
+    }
+    if (whole < pixels) {
+        uint16_t tail[codec_block_pixels] = {}, tailPrev[codec_block_pixels] = {};
+        memcpy(tail, pix + whole, (pixels - whole) * sizeof(uint16_t));
+        memcpy(tailPrev, &prev[whole], (pixels - whole) * sizeof(uint16_t));
+        int width = mapBlock(tail, tailPrev, values);
+        out = packBlock(values, width, out);
+    }
+    memcpy(prev.data(), pix, pixels * sizeof(uint16_t));
+    *length = out - packed.data();
+    if (!huffman) {
+        return packed.data();
+    }
+
+    deflateReset(&zs);
+    zs.next_in = packed.data() + 1;
+    zs.avail_in = *length - 1;
+    zs.next_out = deflated.data() + 1;
+    zs.avail_out = deflated.size() - 1;
+    if (deflate(&zs, Z_FINISH) != Z_STREAM_END) {
+        return NULL;
+    }
+    size_t n = deflated.size() - zs.avail_out;
+    if (n >= *length) {
+        return packed.data();
+    }
+    deflated[0] = packed[0] | codec_deflated;
+    *length = n;
+    return deflated.data();
+}
+
+
+FrameDecoder::FrameDecoder(size_t pixels) :
+    pixels(pixels),
+    started(false),
+    prev(pixels),
+    inflated((pixels + codec_block_pixels - 1) / codec_block_pixels * max_block_bytes) {
+    memset(&zs, 0, sizeof(zs));
+    inflateInit2(&zs, -15);
+}
+
+FrameDecoder::~FrameDecoder() {
+    inflateEnd(&zs);
+}
+
+int FrameDecoder::decode(const uint8_t *data, size_t length, uint16_t *pix) {
+    if (length < 1) {
+        return -1;
+    }
+    uint8_t flags = data[0];
+    if (flags & codec_key_frame) {
+        std::fill(prev.begin(), prev.end(), 0);
+        started = true;
+    } else if (!started) {
+        return -1;
+    }
+    const uint8_t *in = data + 1;
+    const uint8_t *end = data + length;
+    if (flags & codec_deflated) {
+        inflateReset(&zs);
+        zs.next_in = (Bytef *)in;
+        zs.avail_in = end - in;
+        zs.next_out = inflated.data();
+        zs.avail_out = inflated.size();
+        if (inflate(&zs, Z_FINISH) != Z_STREAM_END) {
+            started = false;
+            return -1;
+        }
+        in = inflated.data();
+        end = in + (inflated.size() - zs.avail_out);
+    }
+    if (unpack(in, end, pix) < 0) {
+        // Later frames can't be trusted until the next key frame.
+        started = false;
+        return -1;
+    }
+    memcpy(prev.data(), pix, pixels * sizeof(uint16_t));
+    return 0;
+}
+
+int FrameDecoder::unpack(const uint8_t *in, const uint8_t *end, uint16_t *pix) {
+    for (size_t i = 0; i < pixels; i += codec_block_pixels) {
+        if (in == end) {
+            return -1;
+        }
+        int width = *in++;
+        if (width > max_bit_width || end - in < 2 * width) {
+            return -1;
+        }
+        const uint8_t *next = in + 2 * width;
+        size_t n = std::min((size_t)codec_block_pixels, pixels - i);
+        uint32_t mask = (1u << width) - 1;
+        uint64_t bits = 0;
+        int nbits = 0;
+        for (size_t k = 0; k < n; k++) {
+            while (nbits < width) {
+                uint16_t half;
+                memcpy(&half, in, 2);
+                bits |= (uint64_t)le16toh(half) << nbits;
+                in += 2;
+                nbits += 16;
+            }
+            uint32_t z = bits & mask;
+            bits >>= width;
+            nbits -= width;
+            int32_t d = (int32_t)(z >> 1) ^ -(int32_t)(z & 1);
+            pix[i + k] = prev[i + k] + d;
+        }
+        in = next;
+    }
+    return in == end ? 0 : -1;
+}
@@ -0,0 +1,74 @@
+#ifndef FRAME_CODEC_H
+#define FRAME_CODEC_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <zlib.h>
+#include <vector>
+
+// Lossless compression for the frame stream, announced to consumers by
+// a "Compression: delta" header (or "delta-huffman" if the Huffman
+// stage is on). Each pixel is coded as its difference from the same
+// pixel of the previous frame, zig-zag mapped so that small
+// differences of either sign are small numbers, and packed in blocks
+// of codec_block_pixels at the fewest bits that hold the block's
+// largest. Thermal scenes change little from frame to frame, so most
+// blocks need only a few bits for the sensor noise. On the stream,
+// each frame is its length (4 bytes, little endian) followed by:
+//
+//   flags    1 byte: codec_key_frame if the differences are from zero
+//            (the first frame), codec_deflated if the rest is raw
+//            deflate data (Huffman coded only)
+//   blocks   for each block, a byte with its bit width w, then its
+//            values at w bits each, least significant bit first
+//            (2 * w bytes)
+//
+// The final block of a frame whose size isn't a multiple of the block
+// is padded with zeros.
+const int codec_block_pixels = 16;
+const uint8_t codec_key_frame = 1;
+const uint8_t codec_deflated = 2;
+
+class FrameEncoder {
+public:
+    FrameEncoder(size_t pixels, bool huffman);
+    ~FrameEncoder();
+
+    // Encode a frame against the last one encoded. Returns the encoded
+    // frame, valid until the next call, and sets its length, or NULL
+    // if the Huffman stage failed.
+    const uint8_t *encode(const uint16_t *pix, size_t *length);
+
+    // Make the next frame a key frame.
+    void reset();
+
+private:
+    size_t pixels;
+    bool huffman;
+    bool key;
+    std::vector<uint16_t> prev;
+    std::vector<uint8_t> packed;
+    std::vector<uint8_t> deflated;
+    z_stream zs;
+};
+
+class FrameDecoder {
+public:
+    FrameDecoder(size_t pixels);
+    ~FrameDecoder();
+
+    // Decode a frame (without its length) into pix. Returns 0, or -1 if
+    // it is corrupt or a delta frame arrived before any key frame.
+    int decode(const uint8_t *data, size_t length, uint16_t *pix);
+
+private:
+    int unpack(const uint8_t *in, const uint8_t *end, uint16_t *pix);
+
+    size_t pixels;
+    bool started;
+    std::vector<uint16_t> prev;
+    std::vector<uint8_t> inflated;
+    z_stream zs;
+};
+
+#endif // FRAME_CODEC_H
@@ -0,0 +1,340 @@
+#include "frame_source.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>               // open, O_RDWR
+#include <time.h>
+#include <unistd.h>              // close
+#include <sys/ioctl.h>           // ioctl
+#include <sys/mman.h>
+#include <sys/timerfd.h>
+
+#include "clock.h"
+
+
+V4L2Source::V4L2Source(const std::string &device, int numBuffers, bool userptr) :
+    device(device),
+    videoFd(-1),
+    memory(userptr ? V4L2_MEMORY_USERPTR : V4L2_MEMORY_MMAP),
+    bufferinfo(numBuffers),
+    frames(numBuffers) {
+}
+
+V4L2Source::~V4L2Source() {
+    for (size_t i = 0; memory == V4L2_MEMORY_MMAP && i < frames.size(); i++) {
+        if (frames[i].data) {
+            munmap(frames[i].data, bufferinfo[i].length);
+        }
+    }
+    if (videoFd >= 0) {
+        close(videoFd);
+    }
+}
+
+int V4L2Source::open() {
+    struct v4l2_capability cap;
+
+    if ((videoFd = ::open(device.c_str(), O_RDWR | O_NONBLOCK)) < 0) {
+        perror("Error : OPEN. Invalid Video Device\n");
+        return -1;
+    }
+
+    // Check VideoCapture mode is available
+    if (ioctl(videoFd, VIDIOC_QUERYCAP, &cap) < 0) {
+        perror("ERROR : VIDIOC_QUERYCAP. Video Capture is not available\n");
+        return -1;
+    }
+
+    if (!(cap.capabilities & V4L2_CAP_VIDEO_CAPTURE)) {
+        fprintf(stderr, "The device does not handle single-planar video capture.\n");
+        return -1;
+    }
+
+    struct v4l2_format format;
+
+    // Common varibles
+    format.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+    format.fmt.pix.pixelformat = V4L2_PIX_FMT_Y16;
+    format.fmt.pix.width = width;
+    format.fmt.pix.height = height;
+
+    // request desired FORMAT
+    if (ioctl(videoFd, VIDIOC_S_FMT, &format) < 0) {
+        perror("VIDIOC_S_FMT");
+        return -1;
+    }
+
+    // Allocate buffers for retrieving video frames.
+    struct v4l2_requestbuffers bufrequest;
+    memset(&bufrequest, 0, sizeof(bufrequest));
+    bufrequest.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+    bufrequest.memory = memory;
+    bufrequest.count = bufferinfo.size();
+    if (ioctl(videoFd, VIDIOC_REQBUFS, &bufrequest) < 0) {
+        perror("VIDIOC_REQBUFS");
+        return -1;
+    }
+    if (bufrequest.count < bufferinfo.size()) {
+        bufferinfo.resize(bufrequest.count);
+        frames.resize(bufrequest.count);
+    }
+
+    if (memory == V4L2_MEMORY_USERPTR) {
+        return userBuffers(format.fmt.pix.sizeimage);
+    }
+    return mapBuffers();
+}
+
+// Find out about the buffers the driver created and map them.
+int V4L2Source::mapBuffers() {
+    for (size_t i = 0; i < bufferinfo.size(); i++) {
+        memset(&bufferinfo[i], 0, sizeof(struct v4l2_buffer));
+        bufferinfo[i].type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+        bufferinfo[i].memory = V4L2_MEMORY_MMAP;
+        bufferinfo[i].index = i;
+        if (ioctl(videoFd, VIDIOC_QUERYBUF, &bufferinfo[i]) < 0) {
+            perror("VIDIOC_QUERYBUF");
+            return -1;
+        }
+
+        void *buffer = mmap(NULL, bufferinfo[i].length, PROT_READ | PROT_WRITE, MAP_SHARED, videoFd, bufferinfo[i].m.offset);
+        if (buffer == MAP_FAILED) {
+            perror("mmap");
+            return -1;
+        }
+        memset(buffer, 0, bufferinfo[i].length);
+
+        frames[i] = Frame();
+        frames[i].data = (uint16_t *)buffer;
+        frames[i].length = bufferinfo[i].length;
+        frames[i].index = i;
+    }
+    return 0;
+}
+
+// Hand the driver buffers from our own arena.
+int V4L2Source::userBuffers(size_t sizeImage) {
+    if (sizeImage == 0) {
+        sizeImage = frame_pixels * pix_bytes;
+    }
+    if (arena.allocate(sizeImage, bufferinfo.size()) < 0) {
+        return -1;
+    }
+    fprintf(stderr, "capturing into %d user buffers backed by %s\n", arena.count(), arena.backing());
+
+    for (size_t i = 0; i < bufferinfo.size(); i++) {
+        memset(&bufferinfo[i], 0, sizeof(struct v4l2_buffer));
+        bufferinfo[i].type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+        bufferinfo[i].memory = V4L2_MEMORY_USERPTR;
+        bufferinfo[i].index = i;
+        bufferinfo[i].m.userptr = (unsigned long)arena.buffer(i);
+        bufferinfo[i].length = sizeImage;
+
+        frames[i] = Frame();
+        frames[i].data = (uint16_t *)arena.buffer(i);
+        frames[i].length = sizeImage;
+        frames[i].index = i;
+    }
+    return 0;
+}
+
+int V4L2Source::start() {
+    // Put all buffers in the incoming queue.
+    for (size_t i = 0; i < bufferinfo.size(); i++) {
+        if (ioctl(videoFd, VIDIOC_QBUF, &bufferinfo[i]) < 0) {
+            perror("VIDIOC_QBUF");
+            return -1;
+        }
+    }
+
+    // Activate streaming
+    if (ioctl(videoFd, VIDIOC_STREAMON, &bufferinfo[0].type) < 0) {
+        perror("VIDIOC_STREAMON");
+        return -1;
+    }
+    return 0;
+}
+
+Frame *V4L2Source::next() {
+    struct v4l2_buffer buf;
+    memset(&buf, 0, sizeof(buf));
+    buf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+    buf.memory = memory;
+
+    // Take a filled buffer.
+    if (ioctl(videoFd, VIDIOC_DQBUF, &buf) < 0) {
+        if (errno != EAGAIN) {
+            perror("VIDIOC_DQBUF");
+        }
+        return NULL;
+    }
+
+    Frame *frame = &frames[buf.index];
+    frame->sequence = buf.sequence;
+    frame->timestampNs = (uint64_t)buf.timestamp.tv_sec * 1000000000ULL +
+                         (uint64_t)buf.timestamp.tv_usec * 1000;
+    return frame;
+}
+
+int V4L2Source::release(Frame *frame) {
+    // Put the buffer back in the incoming queue so the video driver
+    // can fill it again.
+    if (ioctl(videoFd, VIDIOC_QBUF, &bufferinfo[frame->index]) < 0) {
+        perror("VIDIOC_QBUF");
+        return -1;
+    }
+    return 0;
+}
+
+size_t V4L2Source::frameBytes() {
+    return bufferinfo.empty() ? 0 : bufferinfo[0].length;
+}
+
+std::vector<struct iovec> V4L2Source::buffers() {
+    std::vector<struct iovec> iov(frames.size());
+    for (size_t i = 0; i < frames.size(); i++) {
+        iov[i].iov_base = frames[i].data;
+        iov[i].iov_len = bufferinfo[i].length;
+    }
+    return iov;
+}
+
+
+GeneratedSource::GeneratedSource(int numBuffers, double fps) :
+    numBuffers(numBuffers),
+    fps(fps),
+    ended(false),
+    pending(NULL),
+    sequence(0),
+    filled(0),
+    dueNs(0),
+    timerFd(-1) {
+}
+
+GeneratedSource::~GeneratedSource() {
+    if (timerFd >= 0) {
+        close(timerFd);
+    }
+}
+
+int GeneratedSource::allocate() {
+    if (arena.allocate(frameBytes(), numBuffers) < 0) {
+        return -1;
+    }
+    frames.resize(numBuffers);
+    inUse.assign(numBuffers, false);
+    for (int i = 0; i < numBuffers; i++) {
+        frames[i] = Frame();
+        frames[i].data = (uint16_t *)arena.buffer(i);
+        frames[i].length = frameBytes();
+        frames[i].index = i;
+    }
+    return 0;
+}
+
+int GeneratedSource::start() {
+    timerFd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC);
+    if (timerFd < 0) {
+        perror("timerfd_create");
+        return -1;
+    }
+    dueNs = monotonicNs();
+    prepare();
+    return 0;
+}
+
+// Fill the next frame into a free buffer and set the timer for when it
+// is due. At the end of the stream the timer fires at once so that a
+// waiting caller finds out.
+void GeneratedSource::prepare() {
+    if (pending || ended) {
+        return;
+    }
+    int i = 0;
+    while (i < numBuffers && inUse[i]) {
+        i++;
+    }
+    if (i == numBuffers) {
+        return;
+    }
+
+    // A frame more than a period overdue was due while no buffer was
+    // free, and the camera would have dropped it; skip it so the stream
+    // keeps to the recording's timeline and the sequence shows the gap.
+    uint64_t nowNs = fps > 0 ? monotonicNs() : 0;
+    Frame *frame = &frames[i];
+    while (!ended) {
+        if (!fill(frame)) {
+            ended = true;
+            break;
+        }
+        // Pace to absolute deadlines so that time spent by the caller
+        // doesn't accumulate as drift.
+        if (fps > 0 && filled > 0) {
+            dueNs += (uint64_t)(interval() * 1e9);
+        }
+        filled++;
+        if (fps > 0 && dueNs + (uint64_t)(1e9 / fps) < nowNs) {
+            sequence++;
+            continue;
+        }
+        inUse[i] = true;
+        pending = frame;
+        break;
+    }
+
+    // A zero expiry would disarm the timer, so due "now" is 1 ns.
+    uint64_t due = (fps > 0 && !ended) ? dueNs : 1;
+    struct itimerspec spec;
+    memset(&spec, 0, sizeof(spec));
+    spec.it_value.tv_sec = due / 1000000000ULL;
+    spec.it_value.tv_nsec = due % 1000000000ULL;
+    if (timerfd_settime(timerFd, TFD_TIMER_ABSTIME, &spec, NULL) < 0) {
+        perror("timerfd_settime");
+    }
+}
+
+Frame *GeneratedSource::next() {
+    prepare();
+    if (!pending) {
+        if (!ended) {
+            fprintf(stderr, "frame source: no free buffers\n");
+        }
+        return NULL;
+    }
+
+    uint64_t expirations;
+    while (read(timerFd, &expirations, sizeof(expirations)) < 0) {
+        if (errno != EINTR) {
+            perror("frame source timer");
+            return NULL;
+        }
+    }
+
+    Frame *frame = pending;
+    pending = NULL;
+    frame->sequence = sequence++;
+    frame->timestampNs = monotonicNs();
+    return frame;
+}
+
+int GeneratedSource::release(Frame *frame) {
+    inUse[frame->index] = false;
+    prepare();
+    return 0;
+}
+
+size_t GeneratedSource::frameBytes() {
+    return frame_pixels * pix_bytes;
+}
+
+std::vector<struct iovec> GeneratedSource::buffers() {
+    std::vector<struct iovec> iov(frames.size());
+    for (size_t i = 0; i < frames.size(); i++) {
+        iov[i].iov_base = frames[i].data;
+        iov[i].iov_len = arena.bufferBytes();
+    }
+    return iov;
+}
@@ -0,0 +1,194 @@
+#ifndef FRAME_SOURCE_H
+#define FRAME_SOURCE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/uio.h>
+#include <linux/videodev2.h>
+#include <string>
+#include <vector>
+
+#include "buffer_arena.h"
+
+class CptvReader;
+
+const int width = 640;
+const int height = 512;
+const int pix_bytes = 2;
+const int frame_pixels = width * height;
+
+// A Y16 frame owned by a FrameSource until it is released.
+struct Frame {
+    uint16_t *data;
+    size_t length;          // bytes to send for this frame
+    uint32_t sequence;      // incrementing frame number from the source
+    uint64_t timestampNs;   // capture time (CLOCK_MONOTONIC)
+    int index;              // source specific buffer index
+    int refs;               // holders (capture loop, outputs) before release
+};
+
+// Something which produces frames: a camera, a recording or a
+// generator. Sources own a fixed pool of buffers; callers must
+// release() each frame returned by next() before the pool runs out.
+class FrameSource {
+public:
+    virtual ~FrameSource() {}
+
+    // Prepare the source (open devices/files, allocate buffers).
+    virtual int open() = 0;
+
+    // Begin producing frames.
+    virtual int start() = 0;
+
+    // Wait for the next frame. Returns NULL at the end of the stream
+    // or on error (see atEnd()).
+    virtual Frame *next() = 0;
+
+    // Hand a frame back to the source for reuse.
+    virtual int release(Frame *frame) = 0;
+
+    // Size in bytes of each frame buffer.
+    virtual size_t frameBytes() = 0;
+
+    // True once a finite source has produced all of its frames.
+    virtual bool atEnd() { return false; }
+
+    // Nominal frame rate in Hz, or 0 if unknown or unpaced.
+    virtual double nominalFps() { return 0; }
+
+    // A descriptor which polls readable when next() has a frame ready.
+    // Only valid after start().
+    virtual int fd() = 0;
+
+    // The memory of each buffer frames are returned in, for outputs
+    // which register it with the kernel. Only valid after open().
+    virtual std::vector<struct iovec> buffers() = 0;
+};
+
+// Frames from a Boson through Video4Linux2, using driver allocated
+// mmap buffers or, with userptr, buffers in bosond's own arena. The
+// device is non-blocking: next() returns NULL with errno EAGAIN if no
+// frame is ready.
+class V4L2Source : public FrameSource {
+public:
+    V4L2Source(const std::string &device, int numBuffers, bool userptr = false);
+    ~V4L2Source();
+
+    int open();
+    int start();
+    Frame *next();
+    int release(Frame *frame);
+    size_t frameBytes();
+
+    int fd() { return videoFd; }
+    std::vector<struct iovec> buffers();
+
+private:
+    int mapBuffers();
+    int userBuffers(size_t sizeImage);
+
+    std::string device;
+    int videoFd;
+    enum v4l2_memory memory;
+    BufferArena arena;
+    std::vector<struct v4l2_buffer> bufferinfo;
+    std::vector<Frame> frames;
+};
+
+// Base for sources which fill buffers they allocate themselves,
+// optionally paced to a frame rate. The next frame is filled as soon
+// as a buffer is free and a timerfd fires when it is due; next() waits
+// for that. When paced, a frame that can't be filled until more than a
+// period after it was due is skipped, leaving a gap in the sequence as
+// V4L2 does.
+class GeneratedSource : public FrameSource {
+public:
+    GeneratedSource(int numBuffers, double fps);
+    ~GeneratedSource();
+
+    int start();
+    Frame *next();
+    int release(Frame *frame);
+    size_t frameBytes();
+    bool atEnd() { return ended && !pending; }
+    double nominalFps() { return fps; }
+    int fd() { return timerFd; }
+    std::vector<struct iovec> buffers();
+
+protected:
+    int allocate();
+
+    // Fill the frame's pixels. Returns false at the end of the stream.
+    virtual bool fill(Frame *frame) = 0;
+
+    // Seconds between the previous frame and the one just filled (the
+    // nominal period by default).
+    virtual double interval() { return 1.0 / fps; }
+
+    int numBuffers;
+    double fps;             // 0 means unthrottled
+    bool ended;
+
+private:
+    void prepare();
+
+    BufferArena arena;
+    std::vector<Frame> frames;
+    std::vector<bool> inUse;
+    Frame *pending;         // filled, waiting until it is due
+    uint32_t sequence;
+    uint32_t filled;
+    uint64_t dueNs;
+    int timerFd;
+};
+
+// Replays a recording. Both raw files of concatenated little endian
+// 640x512 Y16 frames and CPTV files are supported (detected from the
+// gzip magic number). Playback runs at the recording's frame rate,
+// or as fast as possible when realtime is false.
+class ReplaySource : public GeneratedSource {
+public:
+    ReplaySource(const std::string &path, int numBuffers, bool realtime, bool loop);
+    ~ReplaySource();
+
+    int open();
+
+protected:
+    bool fill(Frame *frame);
+    double interval();
+
+private:
+    int rewind();
+
+    std::string path;
+    bool loop;
+    CptvReader *cptv;
+    int rawFd;
+    uint32_t lastTimeOnMs;
+    double lastInterval;
+};
+
+// Generates test images: a moving diagonal ramp ("ramp") or noisy
+// background with warm moving targets ("blobs").
+class SyntheticSource : public GeneratedSource {
+public:
+    SyntheticSource(const std::string &pattern, int numBuffers, double fps);
+
+    int open();
+
+protected:
+    bool fill(Frame *frame);
+
+private:
+    struct Blob {
+        float x, y, dx, dy, radius;
+        uint16_t heat;
+    };
+
+    std::string pattern;
+    std::vector<uint16_t> noise;
+    std::vector<Blob> blobs;
+    uint32_t count;
+};
+
+#endif // FRAME_SOURCE_H
@@ -0,0 +1,251 @@
+#include "frame_stats.h"
+
+#include <string.h>
+
+#if defined(__ARM_NEON)
+#include <arm_neon.h>
+#elif defined(__x86_64__) || defined(__SSE2__)
+#include <immintrin.h>
+#endif
+
+const double frame_percentiles[num_frame_percentiles] = { 0.01, 0.05, 0.5, 0.95, 0.99 };
+
+// Vector kernels sum pixels into 32 bit lanes, each of which takes
+// two pixels per step. Flushing to 64 bits every block_pixels keeps
+// them from overflowing whatever the values.
+const size_t block_pixels = 1 << 16;
+
+
+void pixelSumsScalar(const uint16_t *pixels, size_t count, PixelSums &out) {
+    uint16_t lo = 0xffff, hi = 0;
+    uint64_t sum = 0, sumSquares = 0;
+    for (size_t i = 0; i < count; i++) {
+        uint32_t v = pixels[i];
+        lo = v < lo ? v : lo;
+        hi = v > hi ? v : hi;
+        sum += v;
+        sumSquares += v * v;
+    }
+    out.min = lo;
+    out.max = hi;
+    out.sum = sum;
+    out.sumSquares = sumSquares;
+}
+
+// Fold the tail which doesn't fill a vector into the vector results.
+static void addTail(const uint16_t *pixels, size_t count, PixelSums &out) {
+    PixelSums tail;
+    pixelSumsScalar(pixels, count, tail);
+    out.min = tail.min < out.min ? tail.min : out.min;
+    out.max = tail.max > out.max ? tail.max : out.max;
+    out.sum += tail.sum;
+    out.sumSquares += tail.sumSquares;
+}
+
+#if defined(__ARM_NEON)
+
+static void pixelSumsNeon(const uint16_t *pixels, size_t count, PixelSums &out) {
+    uint16x8_t lo = vdupq_n_u16(0xffff), hi = vdupq_n_u16(0);
+    uint64x2_t sum = vdupq_n_u64(0), squares = vdupq_n_u64(0);
+    size_t i = 0;
+    while (i + 8 <= count) {
+        size_t end = i + block_pixels < count ? i + block_pixels : count;
+        uint32x4_t blockSum = vdupq_n_u32(0);
+        for (; i + 8 <= end; i += 8) {
+            uint16x8_t v = vld1q_u16(pixels + i);
+            lo = vminq_u16(lo, v);
+            hi = vmaxq_u16(hi, v);
+            blockSum = vpadalq_u16(blockSum, v);
+            uint16x4_t l = vget_low_u16(v), h = vget_high_u16(v);
+            squares = vpadalq_u32(squares, vmull_u16(l, l));
+            squares = vpadalq_u32(squares, vmull_u16(h, h));
+        }
+        sum = vpadalq_u32(sum, blockSum);
+    }
+
+    uint16_t lanes[8];
+    vst1q_u16(lanes, lo);
+    out.min = 0xffff;
+    for (uint16_t l : lanes) {
+        out.min = l < out.min ? l : out.min;
+    }
+    vst1q_u16(lanes, hi);
+    out.max = 0;
+    for (uint16_t l : lanes) {
+        out.max = l > out.max ? l : out.max;
+    }
+    out.sum = vgetq_lane_u64(sum, 0) + vgetq_lane_u64(sum, 1);
+    out.sumSquares = vgetq_lane_u64(squares, 0) + vgetq_lane_u64(squares, 1);
+    addTail(pixels + i, count - i, out);
+}
+
+#elif defined(__x86_64__) || defined(__SSE2__)
+
+// SSE2 only has signed 16 bit min and max, so values are biased by
+// 0x8000 to compare them.
+static void pixelSumsSSE2(const uint16_t *pixels, size_t count, PixelSums &out) {
+    const __m128i bias = _mm_set1_epi16((short)0x8000);
+    const __m128i zero = _mm_setzero_si128();
+    __m128i lo = _mm_set1_epi16(0x7fff), hi = _mm_set1_epi16((short)0x8000);
+    __m128i sum = zero, squares = zero;
+    size_t i = 0;
+    while (i + 8 <= count) {
+        size_t end = i + block_pixels < count ? i + block_pixels : count;
+        __m128i blockSum = zero;
+        for (; i + 8 <= end; i += 8) {
+            __m128i v = _mm_loadu_si128((const __m128i *)(pixels + i));
+            __m128i biased = _mm_xor_si128(v, bias);
+            lo = _mm_min_epi16(lo, biased);
+            hi = _mm_max_epi16(hi, biased);
+            blockSum = _mm_add_epi32(blockSum, _mm_unpacklo_epi16(v, zero));
+            blockSum = _mm_add_epi32(blockSum, _mm_unpackhi_epi16(v, zero));
+            __m128i pl = _mm_mullo_epi16(v, v), ph = _mm_mulhi_epu16(v, v);
+            __m128i sq0 = _mm_unpacklo_epi16(pl, ph), sq1 = _mm_unpackhi_epi16(pl, ph);
+            squares = _mm_add_epi64(squares, _mm_unpacklo_epi32(sq0, zero));
+            squares = _mm_add_epi64(squares, _mm_unpackhi_epi32(sq0, zero));
+            squares = _mm_add_epi64(squares, _mm_unpacklo_epi32(sq1, zero));
+            squares = _mm_add_epi64(squares, _mm_unpackhi_epi32(sq1, zero));
+        }
+        sum = _mm_add_epi64(sum, _mm_unpacklo_epi32(blockSum, zero));
+        sum = _mm_add_epi64(sum, _mm_unpackhi_epi32(blockSum, zero));
+    }
+
+    uint16_t lanes[8];
+    _mm_storeu_si128((__m128i *)lanes, _mm_xor_si128(lo, bias));
+    out.min = 0xffff;
+    for (uint16_t l : lanes) {
+        out.min = l < out.min ? l : out.min;
+    }
+    _mm_storeu_si128((__m128i *)lanes, _mm_xor_si128(hi, bias));
+    out.max = 0;
+    for (uint16_t l : lanes) {
+        out.max = l > out.max ? l : out.max;
+    }
+    uint64_t words[2];
+    _mm_storeu_si128((__m128i *)words, sum);
+    out.sum = words[0] + words[1];
+    _mm_storeu_si128((__m128i *)words, squares);
+    out.sumSquares = words[0] + words[1];
+    addTail(pixels + i, count - i, out);
+}
+
+__attribute__((target("avx2")))
+static void pixelSumsAVX2(const uint16_t *pixels, size_t count, PixelSums &out) {
+    const __m256i zero = _mm256_setzero_si256();
+    __m256i lo = _mm256_set1_epi16((short)0xffff), hi = zero;
+    __m256i sum = zero, squares = zero;
+    size_t i = 0;
+    while (i + 16 <= count) {
+        size_t end = i + block_pixels < count ? i + block_pixels : count;
+        __m256i blockSum = zero;
+        for (; i + 16 <= end; i += 16) {
+            __m256i v = _mm256_loadu_si256((const __m256i *)(pixels + i));
+            lo = _mm256_min_epu16(lo, v);
+            hi = _mm256_max_epu16(hi, v);
+            blockSum = _mm256_add_epi32(blockSum, _mm256_unpacklo_epi16(v, zero));
+            blockSum = _mm256_add_epi32(blockSum, _mm256_unpackhi_epi16(v, zero));
+            __m256i pl = _mm256_mullo_epi16(v, v), ph = _mm256_mulhi_epu16(v, v);
+            __m256i sq0 = _mm256_unpacklo_epi16(pl, ph), sq1 = _mm256_unpackhi_epi16(pl, ph);
+            squares = _mm256_add_epi64(squares, _mm256_unpacklo_epi32(sq0, zero));
+            squares = _mm256_add_epi64(squares, _mm256_unpackhi_epi32(sq0, zero));
+            squares = _mm256_add_epi64(squares, _mm256_unpacklo_epi32(sq1, zero));
+            squares = _mm256_add_epi64(squares, _mm256_unpackhi_epi32(sq1, zero));
+        }
+        sum = _mm256_add_epi64(sum, _mm256_unpacklo_epi32(blockSum, zero));
+        sum = _mm256_add_epi64(sum, _mm256_unpackhi_epi32(blockSum, zero));
+    }
+
+    uint16_t lanes[16];
+    _mm256_storeu_si256((__m256i *)lanes, lo);
+    out.min = 0xffff;
+    for (uint16_t l : lanes) {
+        out.min = l < out.min ? l : out.min;
+    }
+    _mm256_storeu_si256((__m256i *)lanes, hi);
+    out.max = 0;
+    for (uint16_t l : lanes) {
+        out.max = l > out.max ? l : out.max;
+    }
+    uint64_t words[4];
+    _mm256_storeu_si256((__m256i *)words, sum);
+    out.sum = words[0] + words[1] + words[2] + words[3];
+    _mm256_storeu_si256((__m256i *)words, squares);
+    out.sumSquares = words[0] + words[1] + words[2] + words[3];
+    addTail(pixels + i, count - i, out);
+}
+
+#endif
+
+typedef void (*PixelSumsFn)(const uint16_t *, size_t, PixelSums &);
+
+static PixelSumsFn chooseKernel(const char **name) {
+#if defined(__ARM_NEON)
+    *name = "neon";
+    return pixelSumsNeon;
+#elif defined(__x86_64__) || defined(__SSE2__)
+    __builtin_cpu_init();   // may run before libgcc has done it
+    if (__builtin_cpu_supports("avx2")) {
+        *name = "avx2";
+        return pixelSumsAVX2;
+    }
+    *name = "sse2";
+    return pixelSumsSSE2;
+#else
+    *name = "scalar";
+    return pixelSumsScalar;
+#endif
+}
+
+static const char *kernelName;
+static const PixelSumsFn kernel = chooseKernel(&kernelName);
+
+void pixelSums(const uint16_t *pixels, size_t count, PixelSums &out) {
+    kernel(pixels, count, out);
+}
+
+const char *pixelSumsKernel() {
+    return kernelName;
+}
+
+
+FrameStatsStage::FrameStatsStage() :
+    hist(2 * histogram_bins) {
+}
+
+void FrameStatsStage::process(const uint16_t *pixels, size_t count, FrameStats &out) {
+    PixelSums sums;
+    pixelSums(pixels, count, sums);
+    out.min = sums.min;
+    out.max = sums.max;
+    out.mean = count ? (double)sums.sum / count : 0;
+    out.variance = count ? (double)sums.sumSquares / count - out.mean * out.mean : 0;
+
+    // Alternating between two tables keeps runs of equal pixels, which
+    // are common, from serialising on one counter.
+    uint32_t *a = hist.data(), *b = a + histogram_bins;
+    memset(a, 0, hist.size() * sizeof(uint32_t));
+    const uint32_t top = histogram_bins - 1;
+    size_t i = 0;
+    for (; i + 2 <= count; i += 2) {
+        uint32_t v0 = pixels[i], v1 = pixels[i + 1];
+        a[v0 < top ? v0 : top]++;
+        b[v1 < top ? v1 : top]++;
+    }
+    if (i < count) {
+        a[pixels[i] < top ? pixels[i] : top]++;
+    }
+    for (uint32_t v = 0; v < (uint32_t)histogram_bins; v++) {
+        a[v] += b[v];
+    }
+    out.saturated = a[top];
+
+    uint64_t seen = 0;
+    uint32_t v = 0;
+    for (int p = 0; p < num_frame_percentiles; p++) {
+        uint64_t rank = (uint64_t)(frame_percentiles[p] * count);
+        while (v < top && seen + a[v] <= rank) {
+            seen += a[v++];
+        }
+        out.percentiles[p] = v;
+    }
+}
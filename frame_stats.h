@@ -0,0 +1,59 @@
+#ifndef FRAME_STATS_H
+#define FRAME_STATS_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <vector>
+
+// The Boson's pixels are 14 bit; larger values (only possible from
+// other sources) are counted in the top histogram bin.
+const int histogram_bits = 14;
+const int histogram_bins = 1 << histogram_bits;
+
+// Percentiles reported for each frame, derived from the histogram.
+const int num_frame_percentiles = 5;
+extern const double frame_percentiles[num_frame_percentiles];
+
+// Summary of one frame's pixel values.
+struct FrameStats {
+    uint16_t min;
+    uint16_t max;
+    double mean;
+    double variance;
+    uint16_t percentiles[num_frame_percentiles];
+    uint32_t saturated;     // pixels at or above the top histogram bin
+};
+
+// Raw sums over a run of pixels, from which the mean and variance are
+// derived exactly.
+struct PixelSums {
+    uint16_t min;
+    uint16_t max;
+    uint64_t sum;
+    uint64_t sumSquares;
+};
+
+// Portable reference implementation.
+void pixelSumsScalar(const uint16_t *pixels, size_t count, PixelSums &out);
+
+// The fastest implementation for this CPU: NEON on ARM, AVX2 or SSE2
+// on x86, or the scalar one.
+void pixelSums(const uint16_t *pixels, size_t count, PixelSums &out);
+const char *pixelSumsKernel();
+
+// Computes FrameStats for each frame, reusing one preallocated
+// histogram so that it doesn't allocate per frame.
+class FrameStatsStage {
+public:
+    FrameStatsStage();
+
+    void process(const uint16_t *pixels, size_t count, FrameStats &out);
+
+    // Histogram of the last frame processed, histogram_bins counts.
+    const uint32_t *histogram() const { return hist.data(); }
+
+private:
+    std::vector<uint32_t> hist;     // two interleaved tables, then merged
+};
+
+#endif // FRAME_STATS_H
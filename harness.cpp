@@ -0,0 +1,557 @@
+// End-to-end qualification harness: runs the real bosond binary against
+// a replayed recording and boson-emu, with a built-in subscriber that
+// checks every frame, so releases can be qualified without a camera.
+//
+// The recording is generated with a frame index in each frame's first
+// pixel and a CRC32 of every frame, so the subscriber can tell corrupt
+// frames from missing or reordered ones. Stress can be added: a slow
+// consumer, camera command errors from the emulator, and CPU hogs.
+// The result is one JSON object on stdout; the exit status is 0 only if
+// every check passed.
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <endian.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <zlib.h>
+#include <atomic>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+#include <tclap/CmdLine.h>
+
+#include "clock.h"
+#include "frame_codec.h"
+#include "frame_source.h"
+#include "mailbox.h"
+#include "pixel_pack.h"
+#include "stats.h"
+
+const int recording_frames = 64;
+const int startup_timeout_ms = 10000;
+const int shutdown_timeout_ms = 5000;
+const double min_rate_fraction = 0.95;  // of the nominal frame rate
+
+static std::string bosondPath;
+static std::string emuPath;
+static std::vector<std::string> bosondArgs;
+static double seconds;
+static int slowConsumerMs;
+static double cciCrcErrorRate;
+static double cciDropRate;
+static unsigned cciLatencyUs;
+static int cpuHogs;
+static bool useMailbox;
+static std::string workDir;
+
+static std::atomic<bool> stopping(false);
+static std::vector<uint32_t> checksums;
+
+// What a subscriber saw.
+struct Verifier {
+    uint64_t frames = 0;
+    uint64_t bytes = 0;
+    uint64_t wireBytes = 0;     // as sent, if compressed or packed
+    uint64_t corrupt = 0;       // bad checksum or frame index
+    uint64_t missing = 0;       // frames skipped in the recording's order
+    uint64_t firstNs = 0;
+    uint64_t lastNs = 0;
+    LatencyHistogram interval;  // between consecutive frames arriving
+    int last = -1;
+    std::string error;
+
+    // Check one frame; returns its index in the recording or -1.
+    int check(const uint16_t *data, size_t length) {
+        uint64_t now = monotonicNs();
+        if (frames > 0) {
+            interval.record(now - lastNs);
+        } else {
+            firstNs = now;
+        }
+        lastNs = now;
+        frames++;
+        bytes += length;
+
+        int index = data[0];
+        if (length != frame_pixels * pix_bytes || index >= (int)checksums.size() ||
+            crc32(0, (const Bytef *)data, length) != checksums[index]) {
+            corrupt++;
+            return -1;
+        }
+        return index;
+    }
+
+    double rate() const {
+        return frames > 1 ? (frames - 1) / ((lastNs - firstNs) / 1e9) : 0;
+    }
+
+    std::string toJSON() const {
+        LatencyHistogram::Snapshot *snap = new LatencyHistogram::Snapshot;
+        interval.snapshot(*snap);
+        std::ostringstream out;
+        out.precision(3);
+        out << std::fixed;
+        out << "{\"frames\":" << frames
+            << ",\"fps\":" << rate()
+            << ",\"mb_per_s\":" << (frames > 1 ? bytes / ((lastNs - firstNs) / 1e9) / 1e6 : 0);
+        if (wireBytes) {
+            out << ",\"compression_ratio\":" << (double)bytes / wireBytes;
+        }
+        out
+            << ",\"corrupt\":" << corrupt
+            << ",\"missing\":" << missing
+            << ",\"interval_ms\":{\"p50\":" << snap->percentile(0.5) / 1e6
+            << ",\"p99\":" << snap->percentile(0.99) / 1e6
+            << ",\"max\":" << snap->max / 1e6 << '}';
+        if (!error.empty()) {
+            out << ",\"error\":\"" << error << '"';
+        }
+        out << '}';
+        delete snap;
+        return out.str();
+    }
+};
+
+
+// Raw Y16 frames of noise, each with its index in the first pixel.
+static int writeRecording(const std::string &path) {
+    FILE *f = fopen(path.c_str(), "wb");
+    if (!f) {
+        perror("harness recording");
+        return -1;
+    }
+    std::vector<uint16_t> frame(frame_pixels);
+    uint32_t state = 12345;
+    for (int i = 0; i < recording_frames; i++) {
+        for (int p = 0; p < frame_pixels; p++) {
+            state = state * 1664525 + 1013904223;
+            frame[p] = 2000 + (state >> 20);
+        }
+        frame[0] = i;
+        checksums.push_back(crc32(0, (const Bytef *)frame.data(), frame.size() * pix_bytes));
+        fwrite(frame.data(), pix_bytes, frame.size(), f);
+    }
+    return fclose(f);
+}
+
+static pid_t spawn(const std::vector<std::string> &args, const std::string &logPath) {
+    pid_t pid = fork();
+    if (pid == 0) {
+        int log = open(logPath.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (log >= 0) {
+            dup2(log, 1);
+            dup2(log, 2);
+        }
+        std::vector<char *> argv;
+        for (const std::string &a : args) {
+            argv.push_back((char *)a.c_str());
+        }
+        argv.push_back(NULL);
+        execvp(argv[0], argv.data());
+        perror(argv[0]);
+        _exit(127);
+    }
+    if (pid < 0) {
+        perror("fork");
+    }
+    return pid;
+}
+
+// Wait for a process to exit, killing it if it takes too long. Returns
+// its wait status, or -1 if it had to be killed.
+static int reap(pid_t pid, int sig) {
+    kill(pid, sig);
+    int status;
+    for (int waited = 0; waited < shutdown_timeout_ms; waited += 10) {
+        if (waitpid(pid, &status, WNOHANG) == pid) {
+            return status;
+        }
+        usleep(10000);
+    }
+    kill(pid, SIGKILL);
+    waitpid(pid, &status, 0);
+    return -1;
+}
+
+static bool waitForPath(const std::string &path, pid_t pid) {
+    struct stat st;
+    for (int waited = 0; waited < startup_timeout_ms; waited += 10) {
+        if (stat(path.c_str(), &st) == 0) {
+            return true;
+        }
+        if (waitpid(pid, NULL, WNOHANG) == pid) {
+            return false;
+        }
+        usleep(10000);
+    }
+    return false;
+}
+
+static int listenUnix(const std::string &path) {
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, path.c_str(), sizeof(addr.sun_path)-1);
+    unlink(path.c_str());
+    if (fd < 0 || bind(fd, (sockaddr *)&addr, sizeof(addr)) < 0 || listen(fd, 1) < 0) {
+        perror("harness socket");
+        return -1;
+    }
+    return fd;
+}
+
+// Read exactly len bytes, giving up when stopping and nothing arrives.
+static bool readFull(int fd, void *data, size_t len) {
+    uint8_t *p = (uint8_t *)data;
+    while (len > 0) {
+        struct pollfd pfd = { fd, POLLIN, 0 };
+        int r = poll(&pfd, 1, 100);
+        if (r < 0 && errno != EINTR) {
+            return false;
+        }
+        if (r <= 0) {
+            if (stopping) {
+                return false;
+            }
+            continue;
+        }
+        ssize_t n = read(fd, p, len);
+        if (n <= 0) {
+            return false;
+        }
+        p += n;
+        len -= n;
+    }
+    return true;
+}
+
+// The stream subscriber: every frame must arrive intact and in order.
+static void consumeStream(int listenFd, Verifier *v) {
+    struct pollfd pfd = { listenFd, POLLIN, 0 };
+    while (poll(&pfd, 1, 100) <= 0) {
+        if (stopping) {
+            v->error = "bosond never connected";
+            return;
+        }
+    }
+    int fd = accept4(listenFd, NULL, NULL, SOCK_CLOEXEC);
+    if (fd < 0) {
+        v->error = "accept failed";
+        return;
+    }
+
+    std::string headers;
+    char c;
+    while (headers.size() < 4096 && headers.find("\n\n") == std::string::npos && readFull(fd, &c, 1)) {
+        headers += c;
+    }
+    size_t pos = headers.find("FrameSize: ");
+    size_t frameSize = pos == std::string::npos ? 0 : strtoul(headers.c_str() + pos + 11, NULL, 10);
+    // Packed frames are checked with the reference unpacker.
+    bool packed = headers.find("PixelBits: 14\n") != std::string::npos;
+    if (frameSize != (packed ? packedBytes(frame_pixels) : frame_pixels * pix_bytes)) {
+        v->error = "bad stream headers";
+        close(fd);
+        return;
+    }
+
+    // Compressed frames each come after their length.
+    bool compressed = headers.find("Compression: delta") != std::string::npos;
+    FrameDecoder decoder(frame_pixels);
+    std::vector<uint8_t> encoded(frame_pixels * pix_bytes * 2);
+    std::vector<uint16_t> frame(frame_pixels);
+    for (;;) {
+        if (compressed) {
+            uint32_t length;
+            if (!readFull(fd, &length, sizeof(length))) {
+                break;
+            }
+            length = le32toh(length);
+            if (length > encoded.size()) {
+                v->error = "bad compressed frame length";
+                break;
+            }
+            if (!readFull(fd, encoded.data(), length)) {
+                break;
+            }
+            v->wireBytes += sizeof(length) + length;
+            if (decoder.decode(encoded.data(), length, frame.data()) < 0) {
+                // Counted as corrupt by check().
+                memset(frame.data(), 0xff, frame_pixels * pix_bytes);
+            }
+        } else if (packed) {
+            if (!readFull(fd, encoded.data(), frameSize)) {
+                break;
+            }
+            v->wireBytes += frameSize;
+            unpack14Scalar(encoded.data(), frame_pixels, frame.data());
+        } else if (!readFull(fd, frame.data(), frameSize)) {
+            break;
+        }
+        int index = v->check(frame.data(), frame_pixels * pix_bytes);
+        if (index >= 0) {
+            if (v->last >= 0) {
+                v->missing += (index - v->last - 1 + recording_frames) % recording_frames;
+            }
+            v->last = index;
+        }
+        if (slowConsumerMs) {
+            usleep(slowConsumerMs * 1000);
+        }
+    }
+    close(fd);
+}
+
+// A mailbox subscriber may skip frames but must never see a torn or
+// stale one.
+static void consumeMailbox(const std::string &path, Verifier *v) {
+    MailboxReader reader;
+    if (reader.connect(path) < 0) {
+        v->error = "mailbox connect failed";
+        return;
+    }
+    std::vector<uint16_t> frame(reader.frameBytes() / pix_bytes);
+    uint64_t lastSequence = 0;
+    bool first = true;
+    while (!stopping) {
+        int r = reader.wait(100);
+        if (r < 0) {
+            break;
+        }
+        uint64_t sequence, timestampNs;
+        int length = r > 0 ? reader.latest(frame.data(), &sequence, &timestampNs) : 0;
+        if (length <= 0 || (!first && sequence == lastSequence)) {
+            continue;
+        }
+        if (!first && sequence < lastSequence) {
+            v->corrupt++;
+        }
+        v->check(frame.data(), length);
+        first = false;
+        lastSequence = sequence;
+        if (slowConsumerMs) {
+            usleep(slowConsumerMs * 1000);
+        }
+    }
+}
+
+static std::string control(const std::string &path, const std::string &command) {
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, path.c_str(), sizeof(addr.sun_path)-1);
+    std::string reply;
+    if (fd >= 0 && connect(fd, (sockaddr *)&addr, sizeof(addr)) == 0) {
+        std::string line = command + "\n";
+        if (write(fd, line.data(), line.size()) == (ssize_t)line.size()) {
+            char buf[4096];
+            ssize_t n;
+            while ((n = read(fd, buf, sizeof(buf))) > 0) {
+                reply.append(buf, n);
+            }
+        }
+    }
+    if (fd >= 0) {
+        close(fd);
+    }
+    while (!reply.empty() && reply.back() == '\n') {
+        reply.pop_back();
+    }
+    return reply.empty() || reply[0] != '{' ? "null" : reply;
+}
+
+// A number from a control reply, or 0 if it isn't there.
+static double jsonNumber(const std::string &json, const std::string &key) {
+    size_t pos = json.find("\"" + key + "\":");
+    return pos == std::string::npos ? 0 : strtod(json.c_str() + pos + key.size() + 3, NULL);
+}
+
+
+int main(int argc, char **argv) {
+    try {
+        TCLAP::CmdLine cmd("Run bosond end to end against a replayed recording and the CCI emulator", ' ', "0.1");
+
+        TCLAP::ValueArg<std::string> bosondArg("", "bosond", "bosond binary to qualify", false, "./bosond", "path");
+        cmd.add(bosondArg);
+
+        TCLAP::ValueArg<std::string> emuArg("", "emu", "boson-emu binary", false, "./boson-emu", "path");
+        cmd.add(emuArg);
+
+        TCLAP::MultiArg<std::string> argArg("a", "arg", "Extra argument for bosond (repeatable), e.g. -a --io-uring", false, "string");
+        cmd.add(argArg);
+
+        TCLAP::ValueArg<double> secondsArg("s", "seconds", "How long to stream for", false, 10, "float");
+        cmd.add(secondsArg);
+
+        TCLAP::ValueArg<int> slowArg("", "slow-consumer-ms", "Subscribers sleep this long after each frame", false, 0, "int");
+        cmd.add(slowArg);
+
+        TCLAP::ValueArg<double> crcArg("", "cci-crc-error-rate", "Fraction of camera command responses the emulator corrupts", false, 0, "float");
+        cmd.add(crcArg);
+
+        TCLAP::ValueArg<double> dropArg("", "cci-drop-rate", "Fraction of camera commands the emulator doesn't answer", false, 0, "float");
+        cmd.add(dropArg);
+
+        TCLAP::ValueArg<unsigned> latencyArg("", "cci-latency-us", "Emulator response latency", false, 0, "int");
+        cmd.add(latencyArg);
+
+        TCLAP::ValueArg<int> hogsArg("", "cpu-hogs", "Threads spinning on the CPU while streaming", false, 0, "int");
+        cmd.add(hogsArg);
+
+        TCLAP::SwitchArg mailboxArg("", "mailbox", "Also verify frames from a mailbox subscriber");
+        cmd.add(mailboxArg);
+
+        cmd.parse(argc, argv);
+        bosondPath = bosondArg.getValue();
+        emuPath = emuArg.getValue();
+        bosondArgs = argArg.getValue();
+        seconds = secondsArg.getValue();
+        slowConsumerMs = slowArg.getValue();
+        cciCrcErrorRate = crcArg.getValue();
+        cciDropRate = dropArg.getValue();
+        cciLatencyUs = latencyArg.getValue();
+        cpuHogs = hogsArg.getValue();
+        useMailbox = mailboxArg.getValue();
+    } catch (TCLAP::ArgException &e) {
+        std::cerr << "error: " << e.error() << " for arg " << e.argId() << std::endl;
+        exit(2);
+    }
+
+    char dirTemplate[] = "/tmp/bosond-harness-XXXXXX";
+    if (!mkdtemp(dirTemplate)) {
+        perror("mkdtemp");
+        exit(2);
+    }
+    workDir = dirTemplate;
+    std::string recording = workDir + "/recording.y16";
+    std::string cciPath = workDir + "/cci";
+    std::string framesPath = workDir + "/frames";
+    std::string controlPath = workDir + "/control";
+    std::string mailboxPath = workDir + "/mailbox";
+    if (writeRecording(recording) < 0) {
+        exit(2);
+    }
+    signal(SIGPIPE, SIG_IGN);
+
+    pid_t emu = spawn({ emuPath, "-s", cciPath,
+                        "-L", std::to_string(cciLatencyUs),
+                        "--crc-error-rate", std::to_string(cciCrcErrorRate),
+                        "--drop-rate", std::to_string(cciDropRate) },
+                      workDir + "/boson-emu.log");
+    if (emu < 0 || !waitForPath(cciPath, emu)) {
+        fprintf(stderr, "harness: boson-emu didn't start (see %s/boson-emu.log)\n", workDir.c_str());
+        exit(2);
+    }
+
+    int listenFd = listenUnix(framesPath);
+    if (listenFd < 0) {
+        exit(2);
+    }
+    Verifier *stream = new Verifier;
+    std::thread streamThread(consumeStream, listenFd, stream);
+
+    std::vector<std::string> args = { bosondPath, "-r", recording, "--loop", "-c", cciPath,
+                                      "-p", framesPath, "-s", controlPath };
+    if (useMailbox) {
+        args.push_back("--mailbox");
+        args.push_back(mailboxPath);
+    }
+    args.insert(args.end(), bosondArgs.begin(), bosondArgs.end());
+    pid_t bosond = spawn(args, workDir + "/bosond.log");
+
+    Verifier *mailbox = new Verifier;
+    std::thread mailboxThread;
+    if (useMailbox && bosond > 0 && waitForPath(mailboxPath, bosond)) {
+        mailboxThread = std::thread(consumeMailbox, mailboxPath, mailbox);
+    }
+
+    std::vector<std::thread> hogs;
+    for (int i = 0; i < cpuHogs; i++) {
+        hogs.emplace_back([] {
+            volatile uint64_t n = 0;
+            while (!stopping) {
+                n++;
+            }
+        });
+    }
+
+    // Stream for the requested time, or until bosond gives up.
+    bool exitedEarly = false;
+    for (uint64_t endNs = monotonicNs() + seconds * 1e9; monotonicNs() < endNs; ) {
+        int status;
+        if (bosond > 0 && waitpid(bosond, &status, WNOHANG) == bosond) {
+            exitedEarly = true;
+            bosond = -1;
+            break;
+        }
+        usleep(10000);
+    }
+
+    std::string bosondStats = control(controlPath, "stats");
+    std::string bosondJitter = control(controlPath, "jitter");
+    int status = bosond > 0 ? reap(bosond, SIGTERM) : -1;
+    bool cleanExit = !exitedEarly && status >= 0 && WIFEXITED(status) && WEXITSTATUS(status) == 0;
+    stopping = true;
+    for (std::thread &t : hogs) {
+        t.join();
+    }
+    streamThread.join();
+    if (mailboxThread.joinable()) {
+        mailboxThread.join();
+    }
+    close(listenFd);
+    reap(emu, SIGTERM);
+
+    // A stream which falls behind must show up as dropped frames or a
+    // low rate, not just as fewer frames. Late frames are only reported:
+    // stress makes some expected.
+    double periodUs = jsonNumber(bosondJitter, "nominal_period_us");
+    double nominalFps = periodUs > 0 ? 1e6 / periodUs : 0;
+    uint64_t dropped = jsonNumber(bosondStats, "dropped");
+    uint64_t late = jsonNumber(bosondStats, "late");
+    bool pass = cleanExit && stream->error.empty() && stream->frames > 0 &&
+                stream->corrupt == 0 && stream->missing == 0 && dropped == 0 &&
+                stream->rate() >= nominalFps * min_rate_fraction;
+    if (useMailbox) {
+        pass = pass && mailbox->error.empty() && mailbox->frames > 0 && mailbox->corrupt == 0;
+    }
+
+    printf("{\"pass\":%s,\"seconds\":%g,\"bosond_exit\":\"%s\",\"nominal_fps\":%.3f,"
+           "\"dropped\":%llu,\"late\":%llu,\"stream\":%s",
+           pass ? "true" : "false", seconds,
+           exitedEarly ? "early" : cleanExit ? "clean" : "failed",
+           nominalFps, (unsigned long long)dropped, (unsigned long long)late,
+           stream->toJSON().c_str());
+    if (useMailbox) {
+        printf(",\"mailbox\":%s", mailbox->toJSON().c_str());
+    }
+    printf(",\"bosond\":%s,\"jitter\":%s", bosondStats.c_str(), bosondJitter.c_str());
+    // Logs are kept for failed runs.
+    if (pass) {
+        for (const char *name : { "recording.y16", "boson-emu.log", "bosond.log", "frames" }) {
+            unlink((workDir + "/" + name).c_str());
+        }
+        rmdir(workDir.c_str());
+    } else {
+        printf(",\"logs\":\"%s\"", workDir.c_str());
+    }
+    printf("}\n");
+
+    delete stream;
+    delete mailbox;
+    return pass ? 0 : 1;
+}
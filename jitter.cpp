@@ -0,0 +1,259 @@
+#include "jitter.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <sched.h>
+#include <sys/resource.h>
+#include <algorithm>
+#include <chrono>
+#include <sstream>
+
+#include "clock.h"
+#include "control.h"
+
+JitterAnalyzer jitter;
+
+const double spike_fraction = 0.25;
+const int cpu_sample_ms = 100;
+
+static const char *event_names[] = {
+    "minor_faults",
+    "major_faults",
+    "voluntary_switches",
+    "involuntary_switches",
+    "slow_cpu",
+};
+
+
+JitterAnalyzer::JitterAnalyzer() :
+    periodNs(0),
+    lastTimestampNs(0),
+    lastMinflt(0), lastMajflt(0), lastNvcsw(0), lastNivcsw(0),
+    recentCount(0),
+    captureCPU(-1),
+    curKHz(0),
+    maxKHz(0),
+    stopping(false) {
+    reset();
+}
+
+JitterAnalyzer::~JitterAnalyzer() {
+    stop();
+}
+
+void JitterAnalyzer::reset() {
+    deviation.reset();
+    for (Slot &s : window) {
+        s.second.store(0, std::memory_order_relaxed);
+        s.worstNs.store(0, std::memory_order_relaxed);
+    }
+    spikeCount.store(0, std::memory_order_relaxed);
+    for (Correlation *c : { &spike, &normal }) {
+        c->intervals.store(0, std::memory_order_relaxed);
+        for (auto &e : c->events) {
+            e.store(0, std::memory_order_relaxed);
+        }
+    }
+    std::lock_guard<std::mutex> lock(spikeMutex);
+    recentCount = 0;
+}
+
+void JitterAnalyzer::record(uint32_t sequence, uint64_t timestampNs) {
+    uint64_t period = periodNs.load(std::memory_order_relaxed);
+    if (period == 0) {
+        return;
+    }
+
+    struct rusage ru;
+    getrusage(RUSAGE_THREAD, &ru);
+    long minflt = ru.ru_minflt - lastMinflt;
+    long majflt = ru.ru_majflt - lastMajflt;
+    long nvcsw = ru.ru_nvcsw - lastNvcsw;
+    long nivcsw = ru.ru_nivcsw - lastNivcsw;
+    lastMinflt = ru.ru_minflt;
+    lastMajflt = ru.ru_majflt;
+    lastNvcsw = ru.ru_nvcsw;
+    lastNivcsw = ru.ru_nivcsw;
+    captureCPU.store(sched_getcpu(), std::memory_order_relaxed);
+
+    uint64_t last = lastTimestampNs;
+    lastTimestampNs = timestampNs;
+    if (last == 0 || timestampNs <= last) {
+        return;
+    }
+
+    int64_t dev = (int64_t)(timestampNs - last) - (int64_t)period;
+    uint64_t absDev = llabs(dev);
+    deviation.record(absDev);
+
+    uint64_t second = timestampNs / 1000000000ULL;
+    Slot &slot = window[second % window_seconds];
+    if (slot.second.load(std::memory_order_relaxed) != second) {
+        slot.worstNs.store(absDev, std::memory_order_relaxed);
+        slot.second.store(second, std::memory_order_relaxed);
+    } else if (absDev > slot.worstNs.load(std::memory_order_relaxed)) {
+        slot.worstNs.store(absDev, std::memory_order_relaxed);
+    }
+
+    uint32_t khz = curKHz.load(std::memory_order_relaxed);
+    uint32_t maxkhz = maxKHz.load(std::memory_order_relaxed);
+    bool events[NUM_EVENTS] = {
+        minflt > 0,
+        majflt > 0,
+        nvcsw > 0,
+        nivcsw > 0,
+        khz && khz < maxkhz,
+    };
+    bool isSpike = absDev > period * spike_fraction;
+    Correlation &c = isSpike ? spike : normal;
+    c.intervals.fetch_add(1, std::memory_order_relaxed);
+    for (int e = 0; e < NUM_EVENTS; e++) {
+        if (events[e]) {
+            c.events[e].fetch_add(1, std::memory_order_relaxed);
+        }
+    }
+
+    if (isSpike) {
+        spikeCount.fetch_add(1, std::memory_order_relaxed);
+        std::lock_guard<std::mutex> lock(spikeMutex);
+        recent[recentCount++ % max_spikes] = {
+            sequence, timestampNs, dev, minflt, majflt, nvcsw, nivcsw, khz,
+        };
+    }
+}
+
+uint64_t JitterAnalyzer::windowWorstNs() const {
+    uint64_t now = monotonicNs() / 1000000000ULL;
+    uint64_t worst = 0;
+    for (const Slot &s : window) {
+        if (s.second.load(std::memory_order_relaxed) + window_seconds > now) {
+            worst = std::max(worst, s.worstNs.load(std::memory_order_relaxed));
+        }
+    }
+    return worst;
+}
+
+static uint32_t readKHz(int cpu, const char *file) {
+    char path[128];
+    snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d/cpufreq/%s", cpu, file);
+    FILE *f = fopen(path, "r");
+    if (!f) {
+        return 0;
+    }
+    unsigned khz = 0;
+    if (fscanf(f, "%u", &khz) != 1) {
+        khz = 0;
+    }
+    fclose(f);
+    return khz;
+}
+
+void JitterAnalyzer::sampleCPU() {
+    int cpu = captureCPU.load(std::memory_order_relaxed);
+    if (cpu < 0) {
+        return;
+    }
+    curKHz.store(readKHz(cpu, "scaling_cur_freq"), std::memory_order_relaxed);
+    maxKHz.store(readKHz(cpu, "cpuinfo_max_freq"), std::memory_order_relaxed);
+}
+
+void JitterAnalyzer::start() {
+    stopping = false;
+    thread = std::thread(&JitterAnalyzer::run, this);
+}
+
+void JitterAnalyzer::stop() {
+    {
+        std::lock_guard<std::mutex> lock(mu);
+        stopping = true;
+    }
+    wake.notify_all();
+    if (thread.joinable()) {
+        thread.join();
+    }
+}
+
+void JitterAnalyzer::run() {
+    demoteThread(SCHED_OTHER);
+
+    std::unique_lock<std::mutex> lock(mu);
+    while (!stopping) {
+        lock.unlock();
+        sampleCPU();
+        lock.lock();
+        wake.wait_for(lock, std::chrono::milliseconds(cpu_sample_ms), [this] { return stopping; });
+    }
+}
+
+std::string JitterAnalyzer::toJSON() const {
+    static const struct {
+        const char *name;
+        double q;
+    } percentiles[] = {
+        { "p50", 0.5 }, { "p90", 0.9 }, { "p99", 0.99 }, { "p999", 0.999 },
+    };
+
+    std::ostringstream out;
+    out.precision(3);
+    out << std::fixed;
+
+    LatencyHistogram::Snapshot *snap = new LatencyHistogram::Snapshot;
+    deviation.snapshot(*snap);
+    out << "{\"nominal_period_us\":" << periodNs.load(std::memory_order_relaxed) / 1e3
+        << ",\"deviation_us\":{\"count\":" << snap->count
+        << ",\"mean\":" << snap->mean() / 1e3;
+    for (auto &p : percentiles) {
+        out << ",\"" << p.name << "\":" << snap->percentile(p.q) / 1e3;
+    }
+    out << ",\"max\":" << snap->max / 1e3 << '}';
+    delete snap;
+
+    out << ",\"window_s\":" << window_seconds
+        << ",\"window_max_us\":" << windowWorstNs() / 1e3
+        << ",\"spikes\":" << spikes()
+        << ",\"cpu_khz\":" << cpuKHz()
+        << ",\"cpu_max_khz\":" << maxKHz.load(std::memory_order_relaxed);
+
+    // Fraction of spike and normal intervals in which each event
+    // happened; a much higher spike rate points at the cause.
+    out << ",\"correlation\":{";
+    const char *sep = "";
+    for (const Correlation *c : { &spike, &normal }) {
+        uint64_t n = c->intervals.load(std::memory_order_relaxed);
+        out << sep << '"' << (c == &spike ? "spike" : "normal") << "\":{\"intervals\":" << n;
+        for (int e = 0; e < NUM_EVENTS; e++) {
+            uint64_t k = c->events[e].load(std::memory_order_relaxed);
+            out << ",\"" << event_names[e] << "\":" << (n ? (double)k / n : 0.0);
+        }
+        out << '}';
+        sep = ",";
+    }
+    out << '}';
+
+    // Copy the spikes out and format them after unlocking, so the
+    // capture thread never waits behind this (lower priority) thread
+    // for longer than the copy.
+    JitterSpike spikes[max_spikes];
+    uint64_t count = 0;
+    {
+        std::lock_guard<std::mutex> lock(spikeMutex);
+        uint64_t first = recentCount > max_spikes ? recentCount - max_spikes : 0;
+        for (uint64_t i = first; i < recentCount; i++) {
+            spikes[count++] = recent[i % max_spikes];
+        }
+    }
+    out << ",\"recent_spikes\":[";
+    for (uint64_t i = 0; i < count; i++) {
+        const JitterSpike &s = spikes[i];
+        out << (i > 0 ? "," : "")
+            << "{\"frame\":" << s.sequence
+            << ",\"deviation_us\":" << s.deviationNs / 1e3
+            << ",\"minor_faults\":" << s.minorFaults
+            << ",\"major_faults\":" << s.majorFaults
+            << ",\"voluntary_switches\":" << s.voluntarySwitches
+            << ",\"involuntary_switches\":" << s.involuntarySwitches
+            << ",\"cpu_khz\":" << s.cpuKHz << '}';
+    }
+    out << "]}\n";
+    return out.str();
+}
@@ -0,0 +1,111 @@
+#ifndef JITTER_H
+#define JITTER_H
+
+#include <stdint.h>
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <string>
+#include <thread>
+
+#include "stats.h"
+
+// A frame interval which strayed from the nominal period by more than
+// spike_fraction of a period, with what else happened meanwhile.
+struct JitterSpike {
+    uint32_t sequence;
+    uint64_t timestampNs;
+    int64_t deviationNs;        // interval minus the nominal period
+    long minorFaults;           // capture thread events during the interval
+    long majorFaults;
+    long voluntarySwitches;
+    long involuntarySwitches;
+    uint32_t cpuKHz;            // capture CPU's clock, 0 if unknown
+};
+
+// Measures frame arrival jitter against the camera's nominal frame
+// period: a distribution of |interval - period|, the worst deviation
+// over a rolling window, and how often page faults, context switches
+// and a reduced CPU clock coincide with spikes compared with normal
+// intervals. This shows whether the FIFO priority and performance
+// governor are doing their job.
+class JitterAnalyzer {
+public:
+    static const int window_seconds = 60;
+    static const int max_spikes = 32;
+
+    JitterAnalyzer();
+    ~JitterAnalyzer();
+
+    // 0 disables analysis (e.g. unthrottled replay).
+    void setNominalPeriod(uint64_t ns) { periodNs = ns; }
+    uint64_t nominalPeriod() const { return periodNs; }
+
+    // Start sampling the CPU clock.
+    void start();
+    void stop();
+
+    // Called by the capture thread for every frame.
+    void record(uint32_t sequence, uint64_t timestampNs);
+
+    void reset();
+
+    const LatencyHistogram &histogram() const { return deviation; }
+    uint64_t windowWorstNs() const;
+    uint64_t spikes() const { return spikeCount.load(std::memory_order_relaxed); }
+    uint32_t cpuKHz() const { return curKHz.load(std::memory_order_relaxed); }
+
+    // Percentiles, window worst case, event correlation and the most
+    // recent spikes as a JSON object.
+    std::string toJSON() const;
+
+private:
+    // Intervals in which each kind of event happened at least once.
+    enum Event {
+        EVENT_MINOR_FAULT,
+        EVENT_MAJOR_FAULT,
+        EVENT_VOLUNTARY_SWITCH,
+        EVENT_INVOLUNTARY_SWITCH,
+        EVENT_SLOW_CPU,         // below the CPU's maximum clock
+        NUM_EVENTS
+    };
+    struct Correlation {
+        std::atomic<uint64_t> intervals;
+        std::atomic<uint64_t> events[NUM_EVENTS];
+    };
+    struct Slot {
+        std::atomic<uint64_t> second;
+        std::atomic<uint64_t> worstNs;
+    };
+
+    void sampleCPU();
+    void run();
+
+    std::atomic<uint64_t> periodNs;
+    LatencyHistogram deviation;
+    Slot window[window_seconds];
+    std::atomic<uint64_t> spikeCount;
+    Correlation spike, normal;
+
+    // Capture thread only.
+    uint64_t lastTimestampNs;
+    long lastMinflt, lastMajflt, lastNvcsw, lastNivcsw;
+
+    // Held only to copy a spike in or out, never while formatting.
+    mutable std::mutex spikeMutex;
+    JitterSpike recent[max_spikes];
+    uint64_t recentCount;
+
+    std::atomic<int> captureCPU;
+    std::atomic<uint32_t> curKHz;
+    std::atomic<uint32_t> maxKHz;
+
+    std::mutex mu;
+    std::condition_variable wake;
+    bool stopping;
+    std::thread thread;
+};
+
+extern JitterAnalyzer jitter;
+
+#endif // JITTER_H
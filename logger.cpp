@@ -0,0 +1,98 @@
+#include "logger.h"
+
+#include <stdarg.h>
+#include <sched.h>
+#include <chrono>
+
+#include "control.h"
+
+AsyncLogger logger;
+
+const int flush_interval_ms = 20;
+
+
+AsyncLogger::AsyncLogger() : enqueuePos(0), dequeuePos(0), drops(0), stopping(false) {
+    for (int i = 0; i < capacity; i++) {
+        slots[i].sequence.store(i, std::memory_order_relaxed);
+    }
+}
+
+AsyncLogger::~AsyncLogger() {
+    stop();
+}
+
+void AsyncLogger::log(FILE *stream, const char *format, ...) {
+    uint64_t pos = enqueuePos.load(std::memory_order_relaxed);
+    Slot *slot;
+    for (;;) {
+        slot = &slots[pos % capacity];
+        int64_t diff = (int64_t)slot->sequence.load(std::memory_order_acquire) - (int64_t)pos;
+        if (diff == 0) {
+            if (enqueuePos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+                break;
+            }
+        } else if (diff < 0) {
+            drops.fetch_add(1, std::memory_order_relaxed);
+            return;
+        } else {
+            pos = enqueuePos.load(std::memory_order_relaxed);
+        }
+    }
+
+    va_list args;
+    va_start(args, format);
+    vsnprintf(slot->text, max_message, format, args);
+    va_end(args);
+    slot->stream = stream;
+    slot->sequence.store(pos + 1, std::memory_order_release);
+}
+
+// Write out queued messages. Returns true if any were written.
+bool AsyncLogger::drain() {
+    bool wrote = false;
+    for (;;) {
+        Slot &slot = slots[dequeuePos % capacity];
+        if (slot.sequence.load(std::memory_order_acquire) != dequeuePos + 1) {
+            break;
+        }
+        fputs(slot.text, slot.stream);
+        fflush(slot.stream);
+        slot.sequence.store(dequeuePos + capacity, std::memory_order_release);
+        dequeuePos++;
+        wrote = true;
+    }
+    return wrote;
+}
+
+void AsyncLogger::start() {
+    stopping = false;
+    thread = std::thread(&AsyncLogger::run, this);
+}
+
+void AsyncLogger::stop() {
+    {
+        std::lock_guard<std::mutex> lock(mu);
+        stopping = true;
+    }
+    wake.notify_all();
+    if (thread.joinable()) {
+        thread.join();
+    }
+}
+
+void AsyncLogger::run() {
+    demoteThread(SCHED_OTHER);
+
+    std::unique_lock<std::mutex> lock(mu);
+    for (;;) {
+        lock.unlock();
+        drain();
+        lock.lock();
+        if (stopping) {
+            break;
+        }
+        wake.wait_for(lock, std::chrono::milliseconds(flush_interval_ms), [this] { return stopping; });
+    }
+    lock.unlock();
+    drain();
+}
@@ -0,0 +1,55 @@
+#ifndef LOGGER_H
+#define LOGGER_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+
+// Lets real-time threads log without blocking on stdio or allocating.
+// Messages are formatted into a fixed ring of slots (a bounded
+// multi-producer queue) and written out by a normal priority thread.
+// When the ring is full messages are dropped and counted.
+class AsyncLogger {
+public:
+    static const int max_message = 256;
+    static const int capacity = 128;
+
+    AsyncLogger();
+    ~AsyncLogger();
+
+    void start();
+
+    // Write out anything queued and stop the writer thread.
+    void stop();
+
+    void log(FILE *stream, const char *format, ...) __attribute__((format(printf, 3, 4)));
+
+    uint64_t dropped() const { return drops.load(std::memory_order_relaxed); }
+
+private:
+    struct Slot {
+        std::atomic<uint64_t> sequence;
+        FILE *stream;
+        char text[max_message];
+    };
+
+    bool drain();
+    void run();
+
+    Slot slots[capacity];
+    std::atomic<uint64_t> enqueuePos;
+    uint64_t dequeuePos;
+    std::atomic<uint64_t> drops;
+
+    std::mutex mu;
+    std::condition_variable wake;
+    bool stopping;
+    std::thread thread;
+};
+
+extern AsyncLogger logger;
+
+#endif // LOGGER_H
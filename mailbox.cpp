@@ -0,0 +1,324 @@
+#include "mailbox.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+#include "event_loop.h"
+#include "trace.h"
+
+#ifndef F_SEAL_FUTURE_WRITE
+#define F_SEAL_FUTURE_WRITE 0x0010
+#endif
+
+const char mailbox_magic[8] = { 'B', 'O', 'S', 'O', 'N', 'M', 'B', 'X' };
+const size_t max_header_message = 4096;
+
+static size_t alignUp(size_t n) {
+    return (n + mailbox_align - 1) & ~(mailbox_align - 1);
+}
+
+
+MailboxOutput::MailboxOutput(EventLoop *loop) :
+    Output(loop, 1),
+    listenFd(-1),
+    memFd(-1),
+    base((uint8_t *)MAP_FAILED),
+    size(0),
+    header(NULL),
+    numSubscribers(0) {
+}
+
+MailboxOutput::~MailboxOutput() {
+    for (int i = 0; i < numSubscribers; i++) {
+        close(subscriberFds[i]);
+    }
+    if (listenFd >= 0) {
+        loop->remove(listenFd);
+        close(listenFd);
+        unlink(path.c_str());
+    }
+    if (base != MAP_FAILED) {
+        munmap(base, size);
+    }
+    if (memFd >= 0) {
+        close(memFd);
+    }
+}
+
+int MailboxOutput::listen(const std::string &socketPath, const std::string &streamHeaders, size_t frameBytes) {
+    path = socketPath;
+    headers = streamHeaders;
+    if (headers.length() > max_header_message) {
+        fprintf(stderr, "mailbox: headers too long\n");
+        return -1;
+    }
+
+    size_t slotBytes = alignUp(sizeof(MailboxSlot)) + alignUp(frameBytes);
+    size = alignUp(sizeof(MailboxHeader)) + mailbox_slots * slotBytes;
+    memFd = memfd_create("bosond-mailbox", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+    if (memFd < 0) {
+        perror("memfd_create");
+        return -1;
+    }
+    if (ftruncate(memFd, size) < 0) {
+        perror("mailbox ftruncate");
+        return -1;
+    }
+    base = (uint8_t *)mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, memFd, 0);
+    if (base == MAP_FAILED) {
+        perror("mailbox mmap");
+        return -1;
+    }
+    // Subscribers may map it, but only to read.
+    if (fcntl(memFd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_FUTURE_WRITE | F_SEAL_SEAL) < 0) {
+        perror("mailbox seals");
+        return -1;
+    }
+
+    header = (MailboxHeader *)base;
+    memcpy(header->magic, mailbox_magic, sizeof(header->magic));
+    header->version = mailbox_version;
+    header->slots = mailbox_slots;
+    header->slotBytes = slotBytes;
+    header->frameBytes = frameBytes;
+    header->latest.store(~0u, std::memory_order_release);
+
+    listenFd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (listenFd < 0) {
+        perror("mailbox socket");
+        return -1;
+    }
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, path.c_str(), sizeof(addr.sun_path)-1);
+    unlink(path.c_str());
+    if (bind(listenFd, (sockaddr *)&addr, sizeof(addr)) < 0 || ::listen(listenFd, max_subscribers) < 0) {
+        perror("mailbox bind");
+        return -1;
+    }
+    return loop->add(listenFd, POLLIN, [this](uint32_t) { accept(); });
+}
+
+MailboxSlot *MailboxOutput::slot(uint32_t i) {
+    return (MailboxSlot *)(base + alignUp(sizeof(MailboxHeader)) + i * header->slotBytes);
+}
+
+// Runs on the capture thread, so it mustn't allocate.
+void MailboxOutput::accept() {
+    for (;;) {
+        int fd = accept4(listenFd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (fd < 0) {
+            if (errno != EAGAIN && errno != EINTR) {
+                perror("mailbox accept");
+            }
+            return;
+        }
+        if (numSubscribers == max_subscribers) {
+            close(fd);
+            continue;
+        }
+
+        struct iovec iov;
+        iov.iov_base = (void *)headers.data();
+        iov.iov_len = headers.length();
+        union {
+            struct cmsghdr align;
+            char buf[CMSG_SPACE(sizeof(int))];
+        } control;
+        struct msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+        msg.msg_control = control.buf;
+        msg.msg_controllen = sizeof(control.buf);
+        struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+        memcpy(CMSG_DATA(cmsg), &memFd, sizeof(int));
+        if (sendmsg(fd, &msg, MSG_NOSIGNAL) < 0) {
+            perror("mailbox subscribe");
+            close(fd);
+            continue;
+        }
+        subscriberFds[numSubscribers++] = fd;
+    }
+}
+
+int MailboxOutput::send(Frame *frame) {
+    if (numSubscribers == 0) {
+        release(frame);
+        return 0;
+    }
+
+    uint64_t sequence = frame->sequence;
+    {
+        TraceScope span("mailbox", frame->sequence);
+        uint32_t latest = header->latest.load(std::memory_order_relaxed);
+        uint32_t i = latest == ~0u ? 0 : (latest + 1) % mailbox_slots;
+        MailboxSlot *s = slot(i);
+        size_t length = frame->length < header->frameBytes ? frame->length : header->frameBytes;
+
+        uint32_t seq = s->seqlock.load(std::memory_order_relaxed);
+        s->seqlock.store(seq + 1, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_release);
+        memcpy((uint8_t *)s + alignUp(sizeof(MailboxSlot)), frame->data, length);
+        s->length = length;
+        s->sequence = frame->sequence;
+        s->timestampNs = frame->timestampNs;
+        s->seqlock.store(seq + 2, std::memory_order_release);
+        header->latest.store(i, std::memory_order_release);
+    }
+    release(frame);
+
+    // Ring each subscriber's doorbell. A full socket means it hasn't
+    // looked since the last frame, which is fine.
+    for (int i = 0; i < numSubscribers; ) {
+        if (::send(subscriberFds[i], &sequence, sizeof(sequence), MSG_DONTWAIT | MSG_NOSIGNAL) < 0 &&
+            errno != EAGAIN) {
+            close(subscriberFds[i]);
+            subscriberFds[i] = subscriberFds[--numSubscribers];
+            continue;
+        }
+        i++;
+    }
+    return 0;
+}
+
+
+MailboxReader::MailboxReader() :
+    sock(-1),
+    base((const uint8_t *)MAP_FAILED),
+    size(0),
+    header(NULL) {
+}
+
+MailboxReader::~MailboxReader() {
+    if (base != MAP_FAILED) {
+        munmap((void *)base, size);
+    }
+    if (sock >= 0) {
+        close(sock);
+    }
+}
+
+int MailboxReader::connect(const std::string &path) {
+    sock = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+    if (sock < 0) {
+        perror("mailbox socket");
+        return -1;
+    }
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, path.c_str(), sizeof(addr.sun_path)-1);
+    if (::connect(sock, (sockaddr *)&addr, sizeof(addr)) < 0) {
+        perror("mailbox connect");
+        return -1;
+    }
+
+    char buf[max_header_message];
+    struct iovec iov;
+    iov.iov_base = buf;
+    iov.iov_len = sizeof(buf);
+    union {
+        struct cmsghdr align;
+        char buf[CMSG_SPACE(sizeof(int))];
+    } control;
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.buf;
+    msg.msg_controllen = sizeof(control.buf);
+    ssize_t n = recvmsg(sock, &msg, MSG_CMSG_CLOEXEC);
+    struct cmsghdr *cmsg = n > 0 ? CMSG_FIRSTHDR(&msg) : NULL;
+    if (!cmsg || cmsg->cmsg_type != SCM_RIGHTS) {
+        fprintf(stderr, "mailbox: no mailbox from server\n");
+        return -1;
+    }
+    headers.assign(buf, n);
+    int memFd;
+    memcpy(&memFd, CMSG_DATA(cmsg), sizeof(int));
+
+    struct stat st;
+    if (fstat(memFd, &st) < 0 || (size_t)st.st_size < sizeof(MailboxHeader)) {
+        close(memFd);
+        return -1;
+    }
+    size = st.st_size;
+    base = (const uint8_t *)mmap(NULL, size, PROT_READ, MAP_SHARED, memFd, 0);
+    close(memFd);
+    if (base == MAP_FAILED) {
+        perror("mailbox mmap");
+        return -1;
+    }
+    header = (const MailboxHeader *)base;
+    if (memcmp(header->magic, mailbox_magic, sizeof(header->magic)) != 0 ||
+        header->version != mailbox_version ||
+        alignUp(sizeof(MailboxHeader)) + (size_t)header->slots * header->slotBytes > size ||
+        alignUp(sizeof(MailboxSlot)) + header->frameBytes > header->slotBytes) {
+        fprintf(stderr, "mailbox: unsupported layout\n");
+        return -1;
+    }
+    return 0;
+}
+
+int MailboxReader::wait(int timeoutMs) {
+    struct pollfd pfd = { sock, POLLIN, 0 };
+    int r = poll(&pfd, 1, timeoutMs);
+    if (r <= 0) {
+        return r;
+    }
+    // Only the newest doorbell matters.
+    uint64_t sequence;
+    ssize_t n;
+    bool any = false;
+    while ((n = recv(sock, &sequence, sizeof(sequence), MSG_DONTWAIT)) == sizeof(sequence)) {
+        any = true;
+    }
+    if (n == 0 || (n < 0 && errno != EAGAIN)) {
+        return -1;
+    }
+    return any ? 1 : 0;
+}
+
+int MailboxReader::latest(void *data, uint64_t *sequence, uint64_t *timestampNs) {
+    for (;;) {
+        uint32_t i = header->latest.load(std::memory_order_acquire);
+        if (i == ~0u) {
+            return 0;
+        }
+        if (i >= header->slots) {
+            return -1;
+        }
+        const MailboxSlot *s = (const MailboxSlot *)(base + alignUp(sizeof(MailboxHeader)) + i * header->slotBytes);
+        uint32_t before = s->seqlock.load(std::memory_order_acquire);
+        if (before & 1) {
+            continue;
+        }
+        uint32_t length = s->length;
+        uint64_t seq = s->sequence;
+        uint64_t ts = s->timestampNs;
+        if (length > header->frameBytes) {
+            continue;
+        }
+        memcpy(data, (const uint8_t *)s + alignUp(sizeof(MailboxSlot)), length);
+        std::atomic_thread_fence(std::memory_order_acquire);
+        if (s->seqlock.load(std::memory_order_relaxed) != before) {
+            continue;   // overwritten while copying; take the newer one
+        }
+        *sequence = seq;
+        *timestampNs = ts;
+        return length;
+    }
+}
@@ -0,0 +1,109 @@
+#ifndef MAILBOX_H
+#define MAILBOX_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <atomic>
+#include <string>
+
+#include "output.h"
+
+// Shared memory layout of a frame mailbox. bosond writes the newest
+// frame into one of mailbox_slots slots, never the one most recently
+// published, and then publishes it; a reader copies the latest slot
+// and checks its seqlock to see it wasn't overwritten meanwhile. A
+// reader therefore has at least mailbox_slots - 1 frame periods to
+// copy a frame.
+const uint32_t mailbox_version = 1;
+const uint32_t mailbox_slots = 3;
+const size_t mailbox_align = 64;
+
+struct MailboxSlot {
+    std::atomic<uint32_t> seqlock;  // odd while the slot is written
+    uint32_t length;                // bytes of frame data
+    uint64_t sequence;              // frame number from the source
+    uint64_t timestampNs;           // capture time (CLOCK_MONOTONIC)
+    // frame data follows at mailbox_align
+};
+
+struct MailboxHeader {
+    char magic[8];                  // "BOSONMBX"
+    uint32_t version;
+    uint32_t slots;
+    uint32_t slotBytes;             // stride between slots
+    uint32_t frameBytes;            // capacity of each slot's data
+    std::atomic<uint32_t> latest;   // newest complete slot, or ~0 if none
+    // slots follow at mailbox_align
+};
+
+// Publishes the newest frame to any number of subscribers, for
+// consumers such as live view which only want the latest frame and
+// would rather skip than queue. Subscribers connect to a SOCK_SEQPACKET
+// Unix socket and get one message with the stream's headers and a
+// memfd holding the mailbox (read-only for them); after that, each
+// published frame sends them its sequence number as an 8 byte
+// message, dropped if they aren't reading. Publishing copies the
+// frame once, however many subscribers there are, and never waits for
+// them.
+class MailboxOutput : public Output {
+public:
+    static const int max_subscribers = 8;
+
+    MailboxOutput(EventLoop *loop);
+    ~MailboxOutput();
+
+    int listen(const std::string &path, const std::string &headers, size_t frameBytes);
+
+    int send(Frame *frame);
+
+    // Connected subscribers.
+    int subscribers() const { return numSubscribers; }
+
+private:
+    void accept();
+    MailboxSlot *slot(uint32_t i);
+
+    std::string path;
+    std::string headers;
+    int listenFd;
+    int memFd;
+    uint8_t *base;
+    size_t size;
+    MailboxHeader *header;
+    int subscriberFds[max_subscribers];
+    int numSubscribers;
+};
+
+// Reference client for a mailbox, as used by the tests and benchmarks.
+class MailboxReader {
+public:
+    MailboxReader();
+    ~MailboxReader();
+
+    int connect(const std::string &path);
+
+    // The stream headers bosond sent when connecting.
+    const std::string &streamHeaders() const { return headers; }
+
+    // Readable when frames have been published since the last wait().
+    int fd() const { return sock; }
+
+    // Block until a frame newer than the last one read is published,
+    // or timeoutMs passes. Returns -1 if bosond has gone away.
+    int wait(int timeoutMs);
+
+    // Copy the newest frame into data (at least frameBytes()). Returns
+    // its length, 0 if nothing has been published yet, or -1 on error.
+    int latest(void *data, uint64_t *sequence, uint64_t *timestampNs);
+
+    size_t frameBytes() const { return header ? header->frameBytes : 0; }
+
+private:
+    int sock;
+    std::string headers;
+    const uint8_t *base;
+    size_t size;
+    const MailboxHeader *header;
+};
+
+#endif // MAILBOX_H
@@ -0,0 +1,188 @@
+#include "metadata.h"
+
+#include <stdarg.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "event_loop.h"
+#include "trace.h"
+
+static const char *percentile_names[num_frame_percentiles] = { "p1", "p5", "p50", "p95", "p99" };
+
+// Append to buf at *used, tracking whether it all fitted.
+static bool append(char *buf, size_t size, size_t *used, const char *format, ...)
+    __attribute__((format(printf, 4, 5)));
+
+static bool append(char *buf, size_t size, size_t *used, const char *format, ...) {
+    if (*used >= size) {
+        return false;
+    }
+    va_list args;
+    va_start(args, format);
+    int n = vsnprintf(buf + *used, size - *used, format, args);
+    va_end(args);
+    if (n < 0 || (size_t)n >= size - *used) {
+        *used = size;
+        return false;
+    }
+    *used += n;
+    return true;
+}
+
+int formatMetadata(const FrameMeta &meta, char *buf, size_t size) {
+    size_t used = 0;
+    append(buf, size, &used, "{\"sequence\":%u,\"timestamp_ns\":%llu",
+           meta.sequence, (unsigned long long)meta.timestampNs);
+    if (meta.ffcPhase != FFC_PHASE_NONE) {
+        append(buf, size, &used, ",\"ffc\":\"%s\"", ffcPhaseName(meta.ffcPhase));
+    }
+    if (meta.hasStats) {
+        const FrameStats &s = meta.stats;
+        append(buf, size, &used, ",\"stats\":{\"min\":%u,\"max\":%u,\"mean\":%.3f,\"variance\":%.3f",
+               s.min, s.max, s.mean, s.variance);
+        for (int p = 0; p < num_frame_percentiles; p++) {
+            append(buf, size, &used, ",\"%s\":%u", percentile_names[p], s.percentiles[p]);
+        }
+        append(buf, size, &used, ",\"saturated\":%u}", s.saturated);
+    }
+    if (meta.hasMotion) {
+        const MotionResult &m = meta.motion;
+        append(buf, size, &used, ",\"motion\":{\"active\":%s,\"pixels\":%u,\"peak_delta\":%u",
+               m.active ? "true" : "false", m.pixels, m.peakDelta);
+        if (m.pixels) {
+            append(buf, size, &used, ",\"bbox\":[%u,%u,%u,%u]", m.box.x0, m.box.y0, m.box.x1, m.box.y1);
+        }
+        append(buf, size, &used, "}");
+    }
+    if (meta.hasBlobs) {
+        const BlobList &blobs = meta.blobs;
+        append(buf, size, &used, ",\"blobs\":[");
+        for (int i = 0; i < blobs.count; i++) {
+            const Blob &b = blobs.blobs[i];
+            append(buf, size, &used, "%s{\"bbox\":[%u,%u,%u,%u],\"area\":%u,\"centroid\":[%.1f,%.1f],\"max\":%u,\"mean\":%.1f}",
+                   i ? "," : "", b.x0, b.y0, b.x1, b.y1, b.area, b.cx, b.cy, b.maxValue, b.meanValue);
+        }
+        append(buf, size, &used, "]");
+        if (blobs.found > (uint32_t)blobs.count) {
+            append(buf, size, &used, ",\"blobs_found\":%u", blobs.found);
+        }
+    }
+    if (meta.hasTracks) {
+        const TrackList &tracks = meta.tracks;
+        append(buf, size, &used, ",\"tracks\":[");
+        for (int i = 0; i < tracks.count; i++) {
+            const Track &t = tracks.tracks[i];
+            append(buf, size, &used, "%s{\"id\":%u,\"age\":%u,\"lost\":%u,\"centroid\":[%.1f,%.1f],\"velocity\":[%.1f,%.1f],\"bbox\":[%u,%u,%u,%u]",
+                   i ? "," : "", t.id, t.age, t.lost, t.x, t.y, t.vx, t.vy, t.x0, t.y0, t.x1, t.y1);
+            if (t.blob >= 0) {
+                append(buf, size, &used, ",\"blob\":%d", t.blob);
+            }
+            append(buf, size, &used, "}");
+        }
+        append(buf, size, &used, "]");
+    }
+    append(buf, size, &used, "}");
+    return used < size ? (int)used : -1;
+}
+
+int formatMotionEvent(const FrameMeta &meta, char *buf, size_t size) {
+    const MotionResult &m = meta.motion;
+    if (!meta.hasMotion || !(m.started || m.ended)) {
+        return 0;
+    }
+    size_t used = 0;
+    append(buf, size, &used, "{\"event\":\"%s\",\"sequence\":%u,\"timestamp_ns\":%llu",
+           m.started ? "motion_start" : "motion_end", meta.sequence, (unsigned long long)meta.timestampNs);
+    append(buf, size, &used, ",\"frames\":%u,\"pixels\":%u,\"peak_delta\":%u",
+           m.eventFrames, m.eventPixels, m.eventPeakDelta);
+    if (m.eventPixels) {
+        append(buf, size, &used, ",\"bbox\":[%u,%u,%u,%u]",
+               m.eventBox.x0, m.eventBox.y0, m.eventBox.x1, m.eventBox.y1);
+    }
+    append(buf, size, &used, "}");
+    return used < size ? (int)used : -1;
+}
+
+
+MetadataOutput::MetadataOutput(EventLoop *loop) :
+    loop(loop),
+    listenFd(-1),
+    numSubscribers(0) {
+}
+
+MetadataOutput::~MetadataOutput() {
+    for (int i = 0; i < numSubscribers; i++) {
+        close(subscriberFds[i]);
+    }
+    if (listenFd >= 0) {
+        loop->remove(listenFd);
+        close(listenFd);
+        unlink(path.c_str());
+    }
+}
+
+int MetadataOutput::listen(const std::string &socketPath) {
+    path = socketPath;
+    listenFd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (listenFd < 0) {
+        perror("metadata socket");
+        return -1;
+    }
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, path.c_str(), sizeof(addr.sun_path)-1);
+    unlink(path.c_str());
+    if (bind(listenFd, (sockaddr *)&addr, sizeof(addr)) < 0 || ::listen(listenFd, max_subscribers) < 0) {
+        perror("metadata bind");
+        return -1;
+    }
+    return loop->add(listenFd, POLLIN, [this](uint32_t) { accept(); });
+}
+
+void MetadataOutput::accept() {
+    for (;;) {
+        int fd = accept4(listenFd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (fd < 0) {
+            if (errno != EAGAIN && errno != EINTR) {
+                perror("metadata accept");
+            }
+            return;
+        }
+        if (numSubscribers == max_subscribers) {
+            close(fd);
+            continue;
+        }
+        subscriberFds[numSubscribers++] = fd;
+    }
+}
+
+void MetadataOutput::publish(const FrameMeta &meta) {
+    if (numSubscribers == 0) {
+        return;
+    }
+    TraceScope span("metadata", meta.sequence);
+    int length = formatMetadata(meta, message, sizeof(message));
+    if (length < 0) {
+        fprintf(stderr, "metadata: frame %u doesn't fit in a message\n", meta.sequence);
+        return;
+    }
+    broadcast(message, length);
+}
+
+void MetadataOutput::broadcast(const char *message, size_t length) {
+    for (int i = 0; i < numSubscribers; ) {
+        if (send(subscriberFds[i], message, length, MSG_DONTWAIT | MSG_NOSIGNAL) < 0 &&
+            errno != EAGAIN) {
+            close(subscriberFds[i]);
+            subscriberFds[i] = subscriberFds[--numSubscribers];
+            continue;
+        }
+        i++;
+    }
+}
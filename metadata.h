@@ -0,0 +1,70 @@
+#ifndef METADATA_H
+#define METADATA_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string>
+
+#include "blobs.h"
+#include "camera.h"
+#include "frame_stats.h"
+#include "motion.h"
+#include "tracker.h"
+
+class EventLoop;
+
+// What bosond worked out about one frame, published alongside it.
+struct FrameMeta {
+    uint32_t sequence;
+    uint64_t timestampNs;
+    FfcPhase ffcPhase;
+    bool hasStats;
+    FrameStats stats;
+    bool hasMotion;
+    MotionResult motion;
+    bool hasBlobs;
+    BlobList blobs;
+    bool hasTracks;
+    TrackList tracks;
+};
+
+// Format as a single line JSON object, without the newline. Returns
+// its length, or -1 if it doesn't fit in size bytes.
+int formatMetadata(const FrameMeta &meta, char *buf, size_t size);
+
+// The same for the start or end of a motion event, if the frame has
+// one; returns 0 if not.
+int formatMotionEvent(const FrameMeta &meta, char *buf, size_t size);
+
+// Streams each frame's metadata (or other messages, such as motion
+// events) to subscribers of a SOCK_SEQPACKET Unix socket, one JSON
+// object per message. As with the mailbox, a subscriber which isn't
+// reading misses messages rather than holding up the capture loop.
+// Runs on the loop and doesn't allocate per frame.
+class MetadataOutput {
+public:
+    static const int max_subscribers = 8;
+    static const size_t max_message_bytes = 8192;
+
+    MetadataOutput(EventLoop *loop);
+    ~MetadataOutput();
+
+    int listen(const std::string &path);
+
+    void publish(const FrameMeta &meta);
+    void broadcast(const char *message, size_t length);
+
+    int subscribers() const { return numSubscribers; }
+
+private:
+    void accept();
+
+    EventLoop *loop;
+    std::string path;
+    int listenFd;
+    int subscriberFds[max_subscribers];
+    int numSubscribers;
+    char message[max_message_bytes];
+};
+
+#endif // METADATA_H
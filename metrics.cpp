@@ -0,0 +1,268 @@
+#include "metrics.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <netdb.h>
+#include <poll.h>
+#include <sched.h>
+#include <unistd.h>
+#include <linux/sockios.h>
+#include <sys/eventfd.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sstream>
+
+#include "camera.h"
+#include "control.h"
+#include "jitter.h"
+#include "stats.h"
+
+const int request_timeout_ms = 200;
+
+static const char *counter_help[NUM_COUNTERS] = {
+    "Frames received from the frame source.",
+    "Frames missing from the source's sequence.",
+    "Frames which arrived more than 1.5 nominal frame periods after the previous one.",
+    "Failed writes to the frame output socket.",
+    "Failed camera command interface requests.",
+    "Flat field corrections performed by the camera.",
+    "Heap allocations by the capture thread while streaming (should be 0).",
+    "Frames not sent because they were captured during or just after an FFC.",
+    "Flat field corrections the scheduler put off because motion was active.",
+    "Frames left out of recorded clips because the clip writer fell behind.",
+};
+
+
+std::string renderMetrics() {
+    static const double quantiles[] = { 0.5, 0.9, 0.99, 0.999 };
+
+    std::ostringstream out;
+    out.precision(9);
+
+    for (int c = 0; c < NUM_COUNTERS; c++) {
+        const char *name = counterName((Counter)c);
+        out << "# TYPE bosond_" << name << " counter\n"
+            << "# HELP bosond_" << name << ' ' << counter_help[c] << '\n'
+            << "bosond_" << name << "_total "
+            << stats.counters[c].load(std::memory_order_relaxed) << '\n';
+    }
+
+    out << "# TYPE bosond_frame_rate_hertz gauge\n"
+        << "# HELP bosond_frame_rate_hertz Recently measured frame rate.\n"
+        << "bosond_frame_rate_hertz " << stats.frameRate.load(std::memory_order_relaxed) << '\n';
+
+    int fd = stats.outputFd.load(std::memory_order_relaxed);
+    int backlog = 0;
+    // A FIFO output reports its unread bytes through FIONREAD.
+    if (fd >= 0 && ioctl(fd, SIOCOUTQ, &backlog) < 0 && ioctl(fd, FIONREAD, &backlog) < 0) {
+        backlog = 0;
+    }
+    out << "# TYPE bosond_consumer_backlog_bytes gauge\n"
+        << "# HELP bosond_consumer_backlog_bytes Bytes written to the frame socket not yet read by the consumer.\n"
+        << "bosond_consumer_backlog_bytes " << backlog << '\n';
+
+    out << "# TYPE bosond_latency_seconds summary\n"
+        << "# HELP bosond_latency_seconds Time taken by each stage of frame handling.\n";
+    LatencyHistogram::Snapshot *snap = new LatencyHistogram::Snapshot;
+    for (int s = 0; s < NUM_STAGES; s++) {
+        stats.latency[s].snapshot(*snap);
+        const char *stage = stageName((Stage)s);
+        for (double q : quantiles) {
+            out << "bosond_latency_seconds{stage=\"" << stage << "\",quantile=\"" << q << "\"} "
+                << snap->percentile(q) / 1e9 << '\n';
+        }
+        out << "bosond_latency_seconds_sum{stage=\"" << stage << "\"} " << snap->sum / 1e9 << '\n'
+            << "bosond_latency_seconds_count{stage=\"" << stage << "\"} " << snap->count << '\n';
+    }
+
+    if (jitter.nominalPeriod()) {
+        jitter.histogram().snapshot(*snap);
+        out << "# TYPE bosond_frame_jitter_seconds summary\n"
+            << "# HELP bosond_frame_jitter_seconds Difference between frame intervals and the nominal frame period.\n";
+        for (double q : quantiles) {
+            out << "bosond_frame_jitter_seconds{quantile=\"" << q << "\"} " << snap->percentile(q) / 1e9 << '\n';
+        }
+        out << "bosond_frame_jitter_seconds_sum " << snap->sum / 1e9 << '\n'
+            << "bosond_frame_jitter_seconds_count " << snap->count << '\n'
+            << "# TYPE bosond_frame_jitter_window_max_seconds gauge\n"
+            << "# HELP bosond_frame_jitter_window_max_seconds Worst frame jitter over the last "
+            << JitterAnalyzer::window_seconds << " seconds.\n"
+            << "bosond_frame_jitter_window_max_seconds " << jitter.windowWorstNs() / 1e9 << '\n'
+            << "# TYPE bosond_jitter_spikes counter\n"
+            << "# HELP bosond_jitter_spikes Frame intervals more than a quarter period from nominal.\n"
+            << "bosond_jitter_spikes_total " << jitter.spikes() << '\n';
+        if (jitter.cpuKHz()) {
+            out << "# TYPE bosond_cpu_frequency_hertz gauge\n"
+                << "# HELP bosond_cpu_frequency_hertz Clock of the CPU running the capture thread.\n"
+                << "bosond_cpu_frequency_hertz " << jitter.cpuKHz() * 1000.0 << '\n';
+        }
+    }
+    delete snap;
+
+    if (camera.valid) {
+        out << "# TYPE bosond_fpa_temperature_celsius gauge\n"
+            << "# HELP bosond_fpa_temperature_celsius Camera focal plane array temperature.\n"
+            << "bosond_fpa_temperature_celsius " << camera.fpaTempCx10 / 10.0 << '\n'
+            << "# TYPE bosond_ffc_status gauge\n"
+            << "# HELP bosond_ffc_status Camera FFC state (0 never, 1 imminent, 2 in progress, 3 complete).\n"
+            << "bosond_ffc_status " << camera.ffcStatus << '\n'
+            << "# TYPE bosond_camera_frames gauge\n"
+            << "# HELP bosond_camera_frames Camera's own frame counter.\n"
+            << "bosond_camera_frames " << camera.frameCount << '\n'
+            << "# TYPE bosond_frames_since_ffc gauge\n"
+            << "# HELP bosond_frames_since_ffc Camera frames since the last FFC.\n"
+            << "bosond_frames_since_ffc " << camera.frameCount - camera.lastFFCFrame << '\n';
+    }
+
+    out << "# EOF\n";
+    return out.str();
+}
+
+
+MetricsServer::MetricsServer() : listenFd(-1), wakeFd(-1) {
+}
+
+MetricsServer::~MetricsServer() {
+    stop();
+}
+
+int MetricsServer::start(const std::string &address) {
+    if (!address.empty() && address[0] == '/') {
+        unixPath = address;
+        listenFd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        struct sockaddr_un addr;
+        memset(&addr, 0, sizeof(addr));
+        addr.sun_family = AF_UNIX;
+        strncpy(addr.sun_path, address.c_str(), sizeof(addr.sun_path)-1);
+        unlink(address.c_str());
+        if (listenFd < 0 || bind(listenFd, (sockaddr *)&addr, sizeof(addr)) < 0) {
+            perror("metrics bind");
+            return -1;
+        }
+    } else {
+        size_t colon = address.rfind(':');
+        if (colon == std::string::npos) {
+            fprintf(stderr, "metrics address must be a path or host:port\n");
+            return -1;
+        }
+        std::string host = address.substr(0, colon);
+        std::string port = address.substr(colon + 1);
+        struct addrinfo hints, *res;
+        memset(&hints, 0, sizeof(hints));
+        hints.ai_family = AF_UNSPEC;
+        hints.ai_socktype = SOCK_STREAM;
+        hints.ai_flags = AI_PASSIVE;
+        if (getaddrinfo(host.empty() ? NULL : host.c_str(), port.c_str(), &hints, &res) != 0) {
+            fprintf(stderr, "can't resolve metrics address %s\n", address.c_str());
+            return -1;
+        }
+        listenFd = socket(res->ai_family, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        int one = 1;
+        setsockopt(listenFd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+        int r = bind(listenFd, res->ai_addr, res->ai_addrlen);
+        freeaddrinfo(res);
+        if (listenFd < 0 || r < 0) {
+            perror("metrics bind");
+            return -1;
+        }
+    }
+    if (listen(listenFd, 8) < 0) {
+        perror("metrics listen");
+        return -1;
+    }
+
+    wakeFd = eventfd(0, EFD_CLOEXEC);
+    thread = std::thread(&MetricsServer::run, this);
+    return 0;
+}
+
+void MetricsServer::stop() {
+    if (thread.joinable()) {
+        uint64_t one = 1;
+        if (write(wakeFd, &one, sizeof(one)) < 0) {
+            perror("metrics stop");
+        }
+        thread.join();
+    }
+    if (listenFd >= 0) {
+        close(listenFd);
+        if (!unixPath.empty()) {
+            unlink(unixPath.c_str());
+        }
+        listenFd = -1;
+    }
+    if (wakeFd >= 0) {
+        close(wakeFd);
+        wakeFd = -1;
+    }
+}
+
+void MetricsServer::run() {
+    demoteThread(SCHED_IDLE);
+
+    for (;;) {
+        struct pollfd fds[2] = {
+            { listenFd, POLLIN, 0 },
+            { wakeFd, POLLIN, 0 },
+        };
+        if (poll(fds, 2, -1) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("metrics poll");
+            return;
+        }
+        if (fds[1].revents) {
+            return;
+        }
+        int client = accept4(listenFd, NULL, NULL, SOCK_CLOEXEC);
+        if (client < 0) {
+            continue;
+        }
+        serveClient(client);
+        close(client);
+    }
+}
+
+void MetricsServer::serveClient(int client) {
+    // Wait briefly for an HTTP request; bare socket clients send nothing.
+    std::string request;
+    char buf[1024];
+    while (request.find("\r\n\r\n") == std::string::npos && request.size() < 8192) {
+        struct pollfd pfd = { client, POLLIN, 0 };
+        if (poll(&pfd, 1, request_timeout_ms) <= 0) {
+            break;
+        }
+        ssize_t n = read(client, buf, sizeof(buf));
+        if (n <= 0) {
+            break;
+        }
+        request.append(buf, n);
+    }
+
+    std::string body = renderMetrics();
+    std::string reply;
+    if (request.compare(0, 4, "GET ") == 0) {
+        reply = "HTTP/1.0 200 OK\r\n"
+                "Content-Type: application/openmetrics-text; version=1.0.0; charset=utf-8\r\n"
+                "Content-Length: " + std::to_string(body.size()) + "\r\n"
+                "Connection: close\r\n\r\n";
+    }
+    reply += body;
+
+    const char *p = reply.data();
+    size_t left = reply.size();
+    while (left > 0) {
+        ssize_t n = send(client, p, left, MSG_NOSIGNAL);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return;
+        }
+        p += n;
+        left -= n;
+    }
+}
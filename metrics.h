@@ -0,0 +1,35 @@
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <string>
+#include <thread>
+
+// Serves bosond's counters, latency summaries and camera state in the
+// OpenMetrics text format for fleet monitoring. The address is either
+// a Unix domain socket path or host:port for TCP. Clients may send an
+// HTTP request (as Prometheus does) or nothing at all.
+//
+// The server runs as SCHED_IDLE and only reads atomics and histogram
+// snapshots, so scraping can't delay the capture thread.
+class MetricsServer {
+public:
+    MetricsServer();
+    ~MetricsServer();
+
+    int start(const std::string &address);
+    void stop();
+
+private:
+    void run();
+    void serveClient(int client);
+
+    std::string unixPath;
+    int listenFd;
+    int wakeFd;
+    std::thread thread;
+};
+
+// Current metrics in OpenMetrics text exposition format.
+std::string renderMetrics();
+
+#endif // METRICS_H
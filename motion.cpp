@@ -0,0 +1,244 @@
+#include "motion.h"
+
+#include <stdio.h>
+#include <string.h>
+
+#include "frame_source.h"
+
+// Learning rates, as right shifts: about a second for the background
+// at 60 Hz, and a quarter of a minute for pixels seen as foreground.
+const int background_shift = 6;
+const int foreground_shift = 10;
+
+// Limits on the variance (Q4), which keep the threshold sensible and
+// the fixed point arithmetic within 32 bits.
+const int32_t min_variance = 4 << 4;
+const int32_t max_variance = 4095 << 4;
+const int32_t initial_variance = 16 << 4;
+const int32_t max_delta = 2047;
+const double max_sigma = 45;
+
+typedef int32_t v8si __attribute__((vector_size(32)));
+typedef uint16_t v8hu __attribute__((vector_size(16)));
+typedef int8_t v8qi __attribute__((vector_size(8)));
+
+// Clones for AVX2 and baseline SSE2, picked when the program loads.
+#if defined(__x86_64__)
+#define MOTION_KERNEL __attribute__((target_clones("avx2", "default")))
+#else
+#define MOTION_KERNEL
+#endif
+
+struct RowResult {
+    uint32_t pixels;
+    int32_t peak;
+};
+
+// Compare count pixels (a multiple of 8, with the model 32 byte
+// aligned) with the model, mark foreground in mask and learn them.
+MOTION_KERNEL
+static void updatePixels(const uint16_t *pixels, int32_t *mean, int32_t *variance, uint8_t *mask,
+                         size_t count, int shift, int32_t sigma2, int32_t minDelta, bool detect,
+                         RowResult &out) {
+    const v8si zero = {};
+    const v8si bgShift = zero + shift, fgShift = zero + foreground_shift;
+    const v8si maxDelta = zero + max_delta, lowDelta = zero + minDelta;
+    const v8si minVar = zero + min_variance, maxVar = zero + max_variance;
+    const v8si enabled = zero - (detect ? 1 : 0);
+    v8si counted = zero, peak = zero;
+
+    for (size_t i = 0; i < count; i += 8) {
+        v8hu raw;
+        memcpy(&raw, pixels + i, sizeof(raw));
+        v8si x = __builtin_convertvector(raw, v8si);
+        v8si m = *(v8si *)(mean + i);
+        v8si v = *(v8si *)(variance + i);
+
+        v8si dq = (x << 8) - m;
+        v8si d = dq >> 8;
+        v8si ad = d < 0 ? -d : d;
+        ad = ad > maxDelta ? maxDelta : ad;
+        v8si d2 = ad * ad;
+        v8si fg = (d2 << 8) > v * sigma2 && ad >= lowDelta;
+        fg &= enabled;
+
+        v8si s = fg ? fgShift : bgShift;
+        m += dq >> s;
+        v += ((d2 << 4) - v) >> s;
+        v = v < minVar ? minVar : v;
+        v = v > maxVar ? maxVar : v;
+        *(v8si *)(mean + i) = m;
+        *(v8si *)(variance + i) = v;
+
+        v8qi mk = __builtin_convertvector(fg, v8qi);
+        memcpy(mask + i, &mk, sizeof(mk));
+        counted -= fg;
+        ad &= fg;
+        peak = ad > peak ? ad : peak;
+    }
+
+    out.pixels = 0;
+    out.peak = 0;
+    for (int l = 0; l < 8; l++) {
+        out.pixels += counted[l];
+        out.peak = peak[l] > out.peak ? peak[l] : out.peak;
+    }
+}
+
+
+MotionDetector::MotionDetector(const MotionConfig &config) :
+    config(config),
+    mean(NULL),
+    variance(NULL),
+    maskBuf(NULL),
+    learnt(0),
+    rebasing(false),
+    quietFrames(0) {
+    memset(&event, 0, sizeof(event));
+}
+
+int MotionDetector::open() {
+    if (arena.allocate(frame_pixels * sizeof(int32_t), 3) < 0) {
+        return -1;
+    }
+    mean = (int32_t *)arena.buffer(0);
+    variance = (int32_t *)arena.buffer(1);
+    maskBuf = arena.buffer(2);
+    return 0;
+}
+
+static void extend(MotionBox &box, const MotionBox &other, bool empty) {
+    if (empty) {
+        box = other;
+        return;
+    }
+    box.x0 = other.x0 < box.x0 ? other.x0 : box.x0;
+    box.y0 = other.y0 < box.y0 ? other.y0 : box.y0;
+    box.x1 = other.x1 > box.x1 ? other.x1 : box.x1;
+    box.y1 = other.y1 > box.y1 ? other.y1 : box.y1;
+}
+
+// The current event as of a frame with no foreground of its own.
+static void eventOnly(const MotionResult &event, MotionResult &out) {
+    memset(&out, 0, sizeof(out));
+    out.active = event.active;
+    out.eventFrames = event.eventFrames;
+    out.eventPixels = event.eventPixels;
+    out.eventPeakDelta = event.eventPeakDelta;
+    out.eventBox = event.eventBox;
+}
+
+void MotionDetector::hold(MotionResult &out) {
+    eventOnly(event, out);
+    if (event.active) {
+        event.eventFrames++;
+        out.eventFrames = event.eventFrames;
+    }
+}
+
+// Take each pixel's mean from the frame, except for pixels which are
+// foreground even allowing for the overall step, such as a target in
+// view, which would otherwise leave a ghost behind when it moves.
+// Those just take the step.
+void MotionDetector::rebaseModel(const uint16_t *pixels) {
+    int64_t total = 0;
+    for (int i = 0; i < frame_pixels; i++) {
+        total += ((int32_t)pixels[i] << 8) - mean[i];
+    }
+    int32_t step = total / frame_pixels;
+    double sigma = config.sigma < max_sigma ? config.sigma : max_sigma;
+    int64_t sigma2 = sigma * sigma * 16 + 0.5;
+    for (int i = 0; i < frame_pixels; i++) {
+        int32_t d = (((int32_t)pixels[i] << 8) - mean[i] - step) >> 8;
+        int64_t ad = d < 0 ? -d : d;
+        if (ad >= config.minDelta && (ad * ad << 8) > variance[i] * sigma2) {
+            mean[i] += step;
+        } else {
+            mean[i] = pixels[i] << 8;
+        }
+    }
+}
+
+void MotionDetector::process(const uint16_t *pixels, MotionResult &out) {
+    memset(&out, 0, sizeof(out));
+    if (rebasing && learnt > 0) {
+        rebaseModel(pixels);
+        memset(maskBuf, 0, frame_pixels);
+        rebasing = false;
+        hold(out);
+        return;
+    }
+    rebasing = false;
+    if (learnt == 0) {
+        for (int i = 0; i < frame_pixels; i++) {
+            mean[i] = pixels[i] << 8;
+            variance[i] = initial_variance;
+        }
+        memset(maskBuf, 0, frame_pixels);
+        learnt = 1;
+        // A relearnt background ends any event in progress.
+        if (event.active) {
+            event.active = false;
+            event.ended = true;
+            out = event;
+        }
+        return;
+    }
+
+    // Average the first frames evenly, then settle into the running
+    // average. Nothing is foreground until the model has settled.
+    int shift = 0;
+    while (shift < background_shift && (2 << shift) <= learnt + 1) {
+        shift++;
+    }
+    bool detect = learnt >= (1 << background_shift);
+    if (!detect) {
+        learnt++;
+    }
+    double sigma = config.sigma < max_sigma ? config.sigma : max_sigma;
+    int32_t sigma2 = sigma * sigma * 16 + 0.5;
+
+    for (int y = 0; y < height; y++) {
+        RowResult row;
+        int offset = y * width;
+        updatePixels(pixels + offset, mean + offset, variance + offset, maskBuf + offset,
+                     width, shift, sigma2, config.minDelta, detect, row);
+        if (!row.pixels) {
+            continue;
+        }
+        const uint8_t *m = maskBuf + offset;
+        MotionBox rowBox;
+        rowBox.y0 = rowBox.y1 = y;
+        rowBox.x0 = (const uint8_t *)memchr(m, 0xff, width) - m;
+        rowBox.x1 = width - 1;
+        while (!m[rowBox.x1]) {
+            rowBox.x1--;
+        }
+        extend(out.box, rowBox, out.pixels == 0);
+        out.pixels += row.pixels;
+        out.peakDelta = row.peak > out.peakDelta ? row.peak : out.peakDelta;
+    }
+
+    if (out.pixels >= (uint32_t)config.minPixels) {
+        quietFrames = 0;
+        if (!event.active) {
+            memset(&event, 0, sizeof(event));
+            event.active = true;
+            out.started = true;
+        }
+        extend(event.eventBox, out.box, event.eventPixels == 0);
+        event.eventPixels = out.pixels > event.eventPixels ? out.pixels : event.eventPixels;
+        event.eventPeakDelta = out.peakDelta > event.eventPeakDelta ? out.peakDelta : event.eventPeakDelta;
+    } else if (event.active && ++quietFrames >= config.holdFrames) {
+        event.active = false;
+        out.ended = true;
+    }
+    if (event.active || out.ended) {
+        event.eventFrames++;
+    }
+    out.active = event.active;
+    out.eventFrames = event.eventFrames;
+    out.eventPixels = event.eventPixels;
+    out.eventPeakDelta = event.eventPeakDelta;
+    out.eventBox = event.eventBox;
+}
@@ -0,0 +1,79 @@
+#ifndef MOTION_H
+#define MOTION_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "buffer_arena.h"
+
+struct MotionConfig {
+    double sigma = 4;           // deviations from the background to count as foreground
+    int minDelta = 40;          // and at least this many counts, to ignore noise
+    int minPixels = 25;         // foreground pixels in a frame for it to have motion
+    int holdFrames = 30;        // frames without motion before an event ends
+};
+
+struct MotionBox {
+    uint16_t x0, y0, x1, y1;    // inclusive
+};
+
+// Foreground found in one frame, and the motion event it is part of.
+struct MotionResult {
+    uint32_t pixels;            // foreground pixels
+    uint16_t peakDelta;         // largest difference from the background
+    MotionBox box;              // bounding box of the foreground, if any
+
+    bool active;                // inside a motion event
+    bool started;               // with this frame
+    bool ended;                 // with this frame, after holdFrames quiet ones
+    uint32_t eventFrames;       // frames since the event started
+    uint32_t eventPixels;       // most foreground pixels in one of them
+    uint16_t eventPeakDelta;
+    MotionBox eventBox;         // union of their boxes
+};
+
+// Per-pixel background model for motion detection: a running mean and
+// variance of each pixel in fixed point, updated every frame. Pixels
+// further from the mean than the configured number of deviations are
+// foreground, and are learnt into the background much more slowly so
+// a target has to stay still for a while to disappear. The update is
+// written with GCC vector extensions, so it becomes NEON on ARM and
+// SSE2 or (chosen at runtime) AVX2 on x86.
+class MotionDetector {
+public:
+    MotionDetector(const MotionConfig &config);
+
+    int open();
+
+    void process(const uint16_t *pixels, MotionResult &out);
+
+    // Skip a frame which shouldn't be learnt or detected in, such as
+    // one frozen by an FFC. Any event carries on.
+    void hold(MotionResult &out);
+
+    // Take the background level from the next frame but keep the
+    // learnt variance, after a step change such as an FFC. Costs two
+    // passes over the frame, and detection carries on straight away.
+    void rebase() { rebasing = true; }
+
+    // Relearn the background from scratch, starting with the next frame.
+    void reset() { learnt = 0; }
+
+    // 0xff for foreground pixels of the last frame processed, else 0.
+    const uint8_t *mask() const { return maskBuf; }
+
+private:
+    void rebaseModel(const uint16_t *pixels);
+
+    MotionConfig config;
+    BufferArena arena;
+    int32_t *mean;              // Q8 counts
+    int32_t *variance;          // Q4 counts squared
+    uint8_t *maskBuf;
+    int learnt;                 // frames in the model so far
+    bool rebasing;
+    int quietFrames;
+    MotionResult event;         // summary of the current event
+};
+
+#endif // MOTION_H
@@ -0,0 +1,677 @@
+#include "output.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <endian.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/timerfd.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+#include <linux/sockios.h>
+
+#include "clock.h"
+#include "control.h"
+#include "event_loop.h"
+#include "pixel_pack.h"
+#include "stats.h"
+#include "trace.h"
+
+// How often a splice output checks whether the consumer has read
+// frames it still holds.
+const uint64_t reclaim_poll_ns = 1000000;
+
+int sendAll(int sock, const char *data, size_t len) {
+    int left = len;
+    int n;
+
+    while (left > 0) {
+        n = send(sock, data, left, 0);
+        if (n < 0) {
+            return n;
+        }
+        left -= n;
+        data += n;
+    }
+    return 0;
+}
+
+
+Output::Output(EventLoop *loop, int maxFrames) :
+    loop(loop),
+    broken(false),
+    offset(0),
+    queue(maxFrames),
+    queuedNs(maxFrames),
+    head(0),
+    count(0) {
+}
+
+bool Output::push(Frame *frame) {
+    if (count == queue.size()) {
+        return false;
+    }
+    size_t tail = (head + count) % queue.size();
+    queue[tail] = frame;
+    queuedNs[tail] = monotonicNs();
+    count++;
+    return true;
+}
+
+void Output::sent() {
+    Frame *frame = queue[head];
+    uint64_t sentNs = monotonicNs();
+    stats.latency[STAGE_SEND].record(sentNs - queuedNs[head]);
+    stats.latency[STAGE_END_TO_END].record(sentNs - frame->timestampNs);
+    traceSpan("send", queuedNs[head], sentNs, frame->sequence);
+    offset = 0;
+    head = (head + 1) % queue.size();
+    count--;
+    release(frame);
+}
+
+void Output::fail() {
+    stats.count(COUNTER_SEND_ERRORS);
+    perror("SEND");
+    broken = true;
+    loop->stop();
+}
+
+// Connect to the consumer's socket, with a send buffer of about a frame.
+static int connectConsumer(const std::string &path, size_t frameBytes) {
+    int sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (sock < 0) {
+        perror("socket");
+        return -1;
+    }
+
+    int send_size = frameBytes;
+    if (setsockopt(sock, SOL_SOCKET, SO_SNDBUF, (const void *)&send_size, sizeof(send_size)) < 0) {
+        perror("SETSOCKOPT");
+        close(sock);
+        return -1;
+    }
+
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, path.c_str(), sizeof(addr.sun_path)-1);
+    if (connect(sock, (sockaddr *)&addr, sizeof(addr)) < 0) {
+        perror("CONNECT");
+        close(sock);
+        return -1;
+    }
+    return sock;
+}
+
+
+StreamOutput::StreamOutput(EventLoop *loop, int maxFrames, bool pack) :
+    Output(loop, maxFrames),
+    sock(-1),
+    pack(pack),
+    slotBytes(0),
+    packedHead(0),
+    packedTail(0) {
+}
+
+StreamOutput::~StreamOutput() {
+    if (sock >= 0) {
+        loop->remove(sock);
+        close(sock);
+    }
+}
+
+int StreamOutput::connect(const std::string &path, const std::string &headers, size_t frameBytes) {
+    if (pack) {
+        slotBytes = packedBytes(frameBytes / pix_bytes);
+        packed.resize(slotBytes * queueSize());
+        frameBytes = slotBytes;
+    }
+    sock = connectConsumer(path, frameBytes);
+    if (sock < 0) {
+        return -1;
+    }
+
+    if (sendAll(sock, headers.data(), headers.length()) < 0) {
+        perror("HEADERS");
+        return -1;
+    }
+
+    fcntl(sock, F_SETFL, fcntl(sock, F_GETFL) | O_NONBLOCK);
+    return loop->add(sock, 0, [this](uint32_t) { flush(); });
+}
+
+int StreamOutput::send(Frame *frame) {
+    if (broken) {
+        return -1;
+    }
+    if (!push(frame)) {
+        fprintf(stderr, "stream output: queue full\n");
+        return -1;
+    }
+    if (pack) {
+        TraceScope span("pack", frame->sequence);
+        uint8_t *slot = &packed[packedTail++ % queueSize() * slotBytes];
+        pack14(frame->data, frame->length / pix_bytes, slot);
+    }
+    if (front() == frame) {
+        flush();
+    }
+    return broken ? -1 : 0;
+}
+
+// Write as much as the socket takes, releasing frames as they complete.
+void StreamOutput::flush() {
+    while (Frame *frame = front()) {
+        const char *data = (const char *)frame->data;
+        size_t length = frame->length;
+        if (pack) {
+            data = (const char *)&packed[packedHead % queueSize() * slotBytes];
+            length = packedBytes(frame->length / pix_bytes);
+        }
+        ssize_t n = ::send(sock, data + offset, length - offset, MSG_DONTWAIT | MSG_NOSIGNAL);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno == EAGAIN) {
+                loop->modify(sock, POLLOUT);
+                return;
+            }
+            loop->modify(sock, 0);
+            fail();
+            return;
+        }
+        offset += n;
+        if (offset == length) {
+            packedHead++;
+            sent();
+        }
+    }
+    loop->modify(sock, 0);
+}
+
+
+UringOutput::UringOutput(EventLoop *loop, int maxFrames) :
+    Output(loop, maxFrames),
+    sock(-1),
+    headersSent(false),
+    inFlight(false),
+    headerRequest(this, true),
+    writeRequest(this, false) {
+}
+
+UringOutput::~UringOutput() {
+    if (sock >= 0) {
+        close(sock);
+    }
+}
+
+int UringOutput::connect(const std::string &path, const std::string &headers, size_t frameBytes) {
+    if (!loop->uring()) {
+        fprintf(stderr, "io_uring output needs an io_uring event loop\n");
+        return -1;
+    }
+    sock = connectConsumer(path, frameBytes);
+    if (sock < 0) {
+        return -1;
+    }
+    this->headers = headers;
+
+    // Writes have no MSG_NOSIGNAL; a consumer going away should show
+    // up as EPIPE from the write.
+    signal(SIGPIPE, SIG_IGN);
+    return 0;
+}
+
+int UringOutput::send(Frame *frame) {
+    if (broken) {
+        return -1;
+    }
+    if (!push(frame)) {
+        fprintf(stderr, "io_uring output: queue full\n");
+        return -1;
+    }
+    // Frames are written one at a time to keep them in order on the
+    // stream.
+    if (!inFlight) {
+        return submit();
+    }
+    return 0;
+}
+
+int UringOutput::submit() {
+    Uring *ring = loop->uring();
+    Frame *frame = front();
+
+    if (!headersSent) {
+        struct io_uring_sqe *sqe = ring->sqe(&headerRequest);
+        if (!sqe) {
+            fprintf(stderr, "io_uring output: submission queue full\n");
+            return -1;
+        }
+        sqe->opcode = IORING_OP_SEND;
+        sqe->fd = sock;
+        sqe->addr = (uint64_t)(uintptr_t)headers.data();
+        sqe->len = headers.length();
+        sqe->msg_flags = MSG_WAITALL | MSG_NOSIGNAL;
+        sqe->flags = IOSQE_IO_LINK;
+    }
+
+    struct io_uring_sqe *sqe = ring->sqe(&writeRequest);
+    if (!sqe) {
+        fprintf(stderr, "io_uring output: submission queue full\n");
+        return -1;
+    }
+    const uint8_t *data = (const uint8_t *)frame->data + offset;
+    size_t length = frame->length - offset;
+    int index = ring->fixedBuffer(data, length);
+    sqe->opcode = index >= 0 ? IORING_OP_WRITE_FIXED : IORING_OP_WRITE;
+    sqe->fd = sock;
+    sqe->addr = (uint64_t)(uintptr_t)data;
+    sqe->len = length;
+    sqe->buf_index = index >= 0 ? index : 0;
+    inFlight = true;
+    return 0;
+}
+
+void UringOutput::complete(bool isHeaders, int res, uint32_t) {
+    if (isHeaders) {
+        // A failed or short send cancels the linked write, which
+        // reports the error.
+        if (res >= 0 && (size_t)res == headers.length()) {
+            headersSent = true;
+        } else if (res >= 0) {
+            fprintf(stderr, "io_uring output: short header write\n");
+        } else {
+            errno = -res;
+            perror("HEADERS");
+        }
+        return;
+    }
+
+    inFlight = false;
+    if (res < 0) {
+        if (res == -EINTR || res == -EAGAIN) {
+            submit();
+            return;
+        }
+        if (res == -ECANCELED && !headersSent) {
+            res = -EPIPE;
+        }
+        errno = -res;
+        fail();
+        return;
+    }
+
+    if (res == 0) {
+        errno = EPIPE;
+        fail();
+        return;
+    }
+
+    // Stream writes can be short when the socket buffer is smaller
+    // than the frame; carry on from where it stopped.
+    offset += res;
+    if (offset == front()->length) {
+        sent();
+    }
+    if (front() && submit() < 0) {
+        broken = true;
+        loop->stop();
+    }
+}
+
+
+CompressedOutput::CompressedOutput(EventLoop *loop, int maxFrames, bool huffman) :
+    Output(loop, maxFrames),
+    encoder(frame_pixels, huffman),
+    sock(-1),
+    writtenFd(-1),
+    frames(maxFrames),
+    submitted(0),
+    written(0),
+    error(0),
+    reclaimed(0),
+    stopping(false) {
+}
+
+CompressedOutput::~CompressedOutput() {
+    if (thread.joinable()) {
+        {
+            std::lock_guard<std::mutex> lock(mu);
+            stopping = true;
+        }
+        wake.notify_all();
+        // Unblock a write to a consumer which has stopped reading.
+        shutdown(sock, SHUT_RDWR);
+        thread.join();
+    }
+    if (writtenFd >= 0) {
+        loop->remove(writtenFd);
+        close(writtenFd);
+    }
+    if (sock >= 0) {
+        close(sock);
+    }
+}
+
+int CompressedOutput::connect(const std::string &path, const std::string &headers, size_t frameBytes) {
+    sock = connectConsumer(path, frameBytes);
+    if (sock < 0) {
+        return -1;
+    }
+    if (sendAll(sock, headers.data(), headers.length()) < 0) {
+        perror("HEADERS");
+        return -1;
+    }
+
+    writtenFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (writtenFd < 0) {
+        perror("eventfd");
+        return -1;
+    }
+    if (loop->add(writtenFd, POLLIN, [this](uint32_t) { reclaim(); }) < 0) {
+        return -1;
+    }
+    thread = std::thread(&CompressedOutput::run, this);
+    return 0;
+}
+
+int CompressedOutput::send(Frame *frame) {
+    if (broken) {
+        return -1;
+    }
+    if (!push(frame)) {
+        fprintf(stderr, "compressed output: queue full\n");
+        return -1;
+    }
+    frames[submitted % frames.size()] = frame;
+    {
+        std::lock_guard<std::mutex> lock(mu);
+        submitted++;
+    }
+    wake.notify_one();
+    return 0;
+}
+
+void CompressedOutput::reclaim() {
+    uint64_t count;
+    if (read(writtenFd, &count, sizeof(count)) != sizeof(count)) {
+        return;
+    }
+    for (uint64_t done = written.load(std::memory_order_acquire); reclaimed < done; reclaimed++) {
+        sent();
+    }
+    if (int err = error.load(std::memory_order_acquire)) {
+        loop->modify(writtenFd, 0);
+        errno = err;
+        fail();
+    }
+}
+
+// Encode frames in order and write each, after its length.
+void CompressedOutput::run() {
+    demoteThread(SCHED_OTHER);
+    traceThreadStart("compress");
+
+    uint64_t next = 0;
+    std::unique_lock<std::mutex> lock(mu);
+    for (;;) {
+        wake.wait(lock, [&] { return stopping || next < submitted; });
+        if (stopping) {
+            break;
+        }
+        lock.unlock();
+
+        Frame *frame = frames[next % frames.size()];
+        size_t length;
+        const uint8_t *data;
+        {
+            TraceScope span("compress", frame->sequence);
+            data = encoder.encode(frame->data, &length);
+        }
+        int err = data ? 0 : EIO;
+        uint32_t prefix = htole32(length);
+        struct iovec iov[2] = {
+            { &prefix, sizeof(prefix) },
+            { (void *)data, length },
+        };
+        struct msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = iov;
+        msg.msg_iovlen = 2;
+        while (!err && msg.msg_iovlen > 0) {
+            ssize_t n = sendmsg(sock, &msg, MSG_NOSIGNAL);
+            if (n < 0) {
+                err = errno == EINTR ? 0 : errno;
+                continue;
+            }
+            // Partial write: skip what it covered.
+            while (msg.msg_iovlen > 0 && (size_t)n >= msg.msg_iov->iov_len) {
+                n -= msg.msg_iov->iov_len;
+                msg.msg_iov++;
+                msg.msg_iovlen--;
+            }
+            if (msg.msg_iovlen > 0) {
+                msg.msg_iov->iov_base = (uint8_t *)msg.msg_iov->iov_base + n;
+                msg.msg_iov->iov_len -= n;
+            }
+        }
+        if (err) {
+            error.store(err, std::memory_order_release);
+        } else {
+            written.store(++next, std::memory_order_release);
+        }
+        uint64_t one = 1;
+        if (write(writtenFd, &one, sizeof(one)) < 0) {
+            perror("compressed output: eventfd");
+        }
+        lock.lock();
+        if (err) {
+            break;
+        }
+    }
+}
+
+
+SpliceOutput::SpliceOutput(EventLoop *loop, int maxFrames) :
+    Output(loop, maxFrames),
+    out(-1),
+    fifo(false),
+    pipeFds{ -1, -1 },
+    timerFd(-1),
+    polling(false),
+    next(0),
+    spliceOffset(0),
+    inPipe(0),
+    written(0),
+    reclaimed(0) {
+}
+
+SpliceOutput::~SpliceOutput() {
+    if (timerFd >= 0) {
+        loop->remove(timerFd);
+        close(timerFd);
+    }
+    if (out >= 0) {
+        loop->remove(out);
+        close(out);
+    }
+    for (int fd : pipeFds) {
+        if (fd >= 0) {
+            close(fd);
+        }
+    }
+}
+
+int SpliceOutput::connect(const std::string &path, const std::string &headers, size_t frameBytes) {
+    struct stat st;
+    fifo = stat(path.c_str(), &st) == 0 && S_ISFIFO(st.st_mode);
+    if (fifo) {
+        // Blocks until the consumer opens the other end.
+        out = open(path.c_str(), O_WRONLY | O_CLOEXEC);
+        if (out < 0) {
+            perror("open output FIFO");
+            return -1;
+        }
+        for (size_t left = headers.length(); left > 0; ) {
+            ssize_t n = write(out, headers.data() + headers.length() - left, left);
+            if (n < 0) {
+                perror("HEADERS");
+                return -1;
+            }
+            left -= n;
+        }
+    } else {
+        out = connectConsumer(path, frameBytes);
+        if (out < 0) {
+            return -1;
+        }
+        if (sendAll(out, headers.data(), headers.length()) < 0) {
+            perror("HEADERS");
+            return -1;
+        }
+        if (pipe2(pipeFds, O_NONBLOCK | O_CLOEXEC) < 0) {
+            perror("pipe2");
+            return -1;
+        }
+        fcntl(pipeFds[1], F_SETPIPE_SZ, (int)frameBytes);
+    }
+    // Room for a whole frame, where the pipe size limit allows it.
+    if (fifo) {
+        fcntl(out, F_SETPIPE_SZ, (int)frameBytes);
+    }
+    written = reclaimed = headers.length();
+
+    timerFd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (timerFd < 0) {
+        perror("timerfd_create");
+        return -1;
+    }
+    fcntl(out, F_SETFL, fcntl(out, F_GETFL) | O_NONBLOCK);
+    if (loop->add(out, 0, [this](uint32_t) { flush(); }) < 0) {
+        return -1;
+    }
+    return loop->add(timerFd, POLLIN, [this](uint32_t) {
+        uint64_t expirations;
+        if (read(timerFd, &expirations, sizeof(expirations)) == sizeof(expirations)) {
+            reclaim();
+        }
+    });
+}
+
+int SpliceOutput::send(Frame *frame) {
+    if (broken) {
+        return -1;
+    }
+    if (!push(frame)) {
+        fprintf(stderr, "splice output: queue full\n");
+        return -1;
+    }
+    if (next == queued() - 1) {
+        flush();
+    }
+    return broken ? -1 : 0;
+}
+
+// Splice as much as the consumer's pipe or socket takes. Pages stay
+// referenced from there after this returns.
+void SpliceOutput::flush() {
+    for (;;) {
+        if (inPipe > 0) {
+            ssize_t n = splice(pipeFds[0], NULL, out, NULL, inPipe, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+            if (n < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                if (errno == EAGAIN) {
+                    loop->modify(out, POLLOUT);
+                    break;
+                }
+                loop->modify(out, 0);
+                fail();
+                return;
+            }
+            inPipe -= n;
+            written += n;
+            continue;
+        }
+        if (next == queued()) {
+            loop->modify(out, 0);
+            break;
+        }
+
+        Frame *frame = queuedFrame(next);
+        struct iovec iov;
+        iov.iov_base = (uint8_t *)frame->data + spliceOffset;
+        iov.iov_len = frame->length - spliceOffset;
+        ssize_t n = vmsplice(fifo ? out : pipeFds[1], &iov, 1, SPLICE_F_NONBLOCK);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno == EAGAIN && fifo) {
+                loop->modify(out, POLLOUT);
+                break;
+            }
+            if (errno == EFAULT) {
+                fprintf(stderr, "vmsplice: capture buffers can't be spliced (try --userptr)\n");
+            }
+            loop->modify(out, 0);
+            fail();
+            return;
+        }
+        spliceOffset += n;
+        if (fifo) {
+            written += n;
+        } else {
+            inPipe += n;
+        }
+        if (spliceOffset == frame->length) {
+            spliceOffset = 0;
+            next++;
+        }
+    }
+    reclaim();
+}
+
+// Bytes written which the consumer may not have read yet.
+uint64_t SpliceOutput::unread() {
+    int n = 0;
+    if (fifo) {
+        if (ioctl(out, FIONREAD, &n) == 0) {
+            return n;
+        }
+    } else if (ioctl(out, SIOCOUTQ, &n) == 0 && n == 0) {
+        return 0;
+    }
+    return written - reclaimed;
+}
+
+void SpliceOutput::reclaim() {
+    uint64_t consumed = written - unread();
+    while (next > 0 && consumed >= reclaimed + front()->length) {
+        reclaimed += front()->length;
+        next--;
+        sent();
+    }
+
+    // Poll while the consumer holds pages of queued frames.
+    if ((next > 0) != polling) {
+        polling = next > 0;
+        struct itimerspec spec = {};
+        if (polling) {
+            spec.it_interval.tv_nsec = reclaim_poll_ns;
+            spec.it_value = spec.it_interval;
+        }
+        timerfd_settime(timerFd, 0, &spec, NULL);
+    }
+}
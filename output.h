@@ -0,0 +1,221 @@
+#ifndef OUTPUT_H
+#define OUTPUT_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <atomic>
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "frame_codec.h"
+#include "frame_source.h"
+#include "uring.h"
+
+class EventLoop;
+
+// Write all of data to a stream socket. Returns 0, or -1 with errno set.
+int sendAll(int sock, const char *data, size_t len);
+
+// Somewhere frames are sent. An output may hold on to a frame after
+// send() returns (until the consumer has taken it) and calls the
+// release callback once it no longer needs the frame's buffer.
+class Output {
+public:
+    typedef std::function<void(Frame *)> Release;
+
+    virtual ~Output() {}
+
+    void onRelease(Release callback) { release = callback; }
+
+    // Start sending a frame. Returns -1 on a fatal error.
+    virtual int send(Frame *frame) = 0;
+
+    // True if the output hit an error after send() returned.
+    bool failed() const { return broken; }
+
+protected:
+    Output(EventLoop *loop, int maxFrames);
+
+    // Add a frame to the ring of frames waiting to be written. Returns
+    // false if it is full.
+    bool push(Frame *frame);
+
+    // The oldest frame not yet completely written, or NULL.
+    Frame *front() const { return count ? queue[head] : NULL; }
+
+    // Frames the ring holds.
+    size_t queueSize() const { return queue.size(); }
+
+    // Frames in the ring, oldest first.
+    size_t queued() const { return count; }
+    Frame *queuedFrame(size_t i) const { return queue[(head + i) % queue.size()]; }
+
+    // The front frame has been written: record its latency and release
+    // it.
+    void sent();
+
+    // Give up on the output after a write error (errno), stopping the
+    // event loop.
+    void fail();
+
+    EventLoop *loop;
+    Release release;
+    bool broken;
+    size_t offset;                  // bytes of the front frame written
+
+private:
+    std::vector<Frame *> queue;
+    std::vector<uint64_t> queuedNs;
+    size_t head;
+    size_t count;
+};
+
+// Streams frames, after a block of headers, to a consumer listening on
+// a Unix domain socket (thermal-recorder's protocol). Writes don't
+// block: when the socket buffer fills, the rest of the frame and any
+// later ones wait until the event loop reports it writable.
+// With pack, each frame is packed to 14 bits per pixel (see
+// pixel_pack.h) as it is sent, into a buffer for its place in the
+// queue, and the packed copy is written instead; the headers should
+// announce it.
+class StreamOutput : public Output {
+public:
+    StreamOutput(EventLoop *loop, int maxFrames, bool pack = false);
+    ~StreamOutput();
+
+    int connect(const std::string &path, const std::string &headers, size_t frameBytes);
+
+    int send(Frame *frame);
+
+    int fd() const { return sock; }
+
+private:
+    void flush();
+
+    int sock;
+    bool pack;
+    std::vector<uint8_t> packed;    // a packed frame for each queue slot
+    size_t slotBytes;
+    uint64_t packedHead;            // slot of the front frame
+    uint64_t packedTail;            // slot of the next frame sent
+};
+
+// The same stream as StreamOutput, written through the event loop's
+// io_uring. Each frame is one write straight from its capture buffer,
+// using the ring's registered buffers where the buffer is one of them
+// (so its pages aren't looked up and pinned on every send), and it is
+// submitted with the loop's next io_uring_enter() rather than costing
+// send() calls of its own. The headers go out as a send linked to the
+// first frame's write. Needs an io_uring loop.
+class UringOutput : public Output {
+public:
+    UringOutput(EventLoop *loop, int maxFrames);
+    ~UringOutput();
+
+    int connect(const std::string &path, const std::string &headers, size_t frameBytes);
+
+    int send(Frame *frame);
+
+    int fd() const { return sock; }
+
+private:
+    struct Request : public IoRequest {
+        Request(UringOutput *output, bool headers) : output(output), headers(headers) {}
+        void complete(int res, uint32_t flags) { output->complete(headers, res, flags); }
+
+        UringOutput *output;
+        bool headers;
+    };
+
+    // Submit the rest of the front frame.
+    int submit();
+    void complete(bool headers, int res, uint32_t flags);
+
+    int sock;
+    std::string headers;
+    bool headersSent;
+    bool inFlight;
+    Request headerRequest;
+    Request writeRequest;
+};
+
+// The same stream with frames losslessly compressed (see frame_codec.h),
+// for consumers short of bandwidth or storage; the headers should
+// announce it. Frames are encoded and written on a thread of the
+// output's own, with blocking writes, so encoding never holds up the
+// capture thread, and are handed back to the loop (through an eventfd)
+// as they are written.
+class CompressedOutput : public Output {
+public:
+    CompressedOutput(EventLoop *loop, int maxFrames, bool huffman);
+    ~CompressedOutput();
+
+    int connect(const std::string &path, const std::string &headers, size_t frameBytes);
+
+    int send(Frame *frame);
+
+    int fd() const { return sock; }
+
+private:
+    void run();
+
+    // Release the frames the thread has written.
+    void reclaim();
+
+    FrameEncoder encoder;
+    int sock;
+    int writtenFd;                  // eventfd the thread signals
+    std::vector<Frame *> frames;    // submitted frames, as in the queue
+    uint64_t submitted;
+    std::atomic<uint64_t> written;
+    std::atomic<int> error;         // errno from the thread's last write
+    uint64_t reclaimed;
+
+    std::mutex mu;
+    std::condition_variable wake;
+    bool stopping;
+    std::thread thread;
+};
+
+// The same stream, with the frames' pages handed to the kernel with
+// vmsplice() rather than copied: straight into the consumer's pipe if
+// path is a FIFO, or through a pipe and splice() into its socket. The
+// consumer then reads the capture buffer itself, so a frame is only
+// released once the consumer has read all of it: exactly for a FIFO
+// (FIONREAD), or once the socket's queue is empty for a socket, which
+// only says whether anything is left unread.
+class SpliceOutput : public Output {
+public:
+    SpliceOutput(EventLoop *loop, int maxFrames);
+    ~SpliceOutput();
+
+    int connect(const std::string &path, const std::string &headers, size_t frameBytes);
+
+    int send(Frame *frame);
+
+    int fd() const { return out; }
+
+private:
+    void flush();
+
+    // Release frames the consumer has finished reading.
+    void reclaim();
+    uint64_t unread();
+
+    int out;
+    bool fifo;
+    int pipeFds[2];         // between vmsplice() and splice() for sockets
+    int timerFd;            // polls for reads while frames are out
+    bool polling;
+    size_t next;            // queued frame being spliced
+    size_t spliceOffset;    // bytes of it spliced
+    size_t inPipe;          // bytes in pipeFds
+    uint64_t written;       // bytes given to the consumer's pipe or socket
+    uint64_t reclaimed;     // bytes of those in released frames
+};
+
+#endif // OUTPUT_H
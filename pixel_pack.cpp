@@ -0,0 +1,205 @@
+#include "pixel_pack.h"
+
+#if defined(__ARM_NEON)
+#include <arm_neon.h>
+#elif defined(__x86_64__) || defined(__SSE2__)
+#include <immintrin.h>
+#endif
+
+// Vector kernels work on 8 pixels (two groups) at a time: they widen
+// pairs of pixels to 28 bits in 32 bit lanes, then pairs of those to 56
+// bits in 64 bit lanes, and store each 64 bit lane 7 bytes after the
+// last. Each store (or load) runs a byte past its group, so they stop
+// while the next group still has a pixel and leave the rest to the
+// scalar code.
+
+
+void pack14Scalar(const uint16_t *pixels, size_t count, uint8_t *out) {
+    for (size_t i = 0; i < count; i += 4) {
+        size_t n = count - i < 4 ? count - i : 4;
+        uint64_t bits = 0;
+        for (size_t k = 0; k < n; k++) {
+            uint64_t v = pixels[i + k] < packed_pixel_max ? pixels[i + k] : packed_pixel_max;
+            bits |= v << (k * packed_pixel_bits);
+        }
+        size_t bytes = packedBytes(n);
+        for (size_t b = 0; b < bytes; b++) {
+            *out++ = bits >> (b * 8);
+        }
+    }
+}
+
+void unpack14Scalar(const uint8_t *in, size_t count, uint16_t *pixels) {
+    for (size_t i = 0; i < count; i += 4) {
+        size_t n = count - i < 4 ? count - i : 4;
+        size_t bytes = packedBytes(n);
+        uint64_t bits = 0;
+        for (size_t b = 0; b < bytes; b++) {
+            bits |= (uint64_t)*in++ << (b * 8);
+        }
+        for (size_t k = 0; k < n; k++) {
+            pixels[i + k] = (bits >> (k * packed_pixel_bits)) & packed_pixel_max;
+        }
+    }
+}
+
+#if defined(__ARM_NEON)
+
+static void pack14Neon(const uint16_t *pixels, size_t count, uint8_t *out) {
+    const uint16x8_t max = vdupq_n_u16(packed_pixel_max);
+    size_t i = 0;
+    for (; i + 8 < count; i += 8, out += 14) {
+        uint16x8_t v = vminq_u16(vld1q_u16(pixels + i), max);
+        uint32x4_t pairs = vreinterpretq_u32_u16(v);
+        pairs = vsliq_n_u32(pairs, vshrq_n_u32(pairs, 16), 14);
+        uint64x2_t groups = vreinterpretq_u64_u32(pairs);
+        groups = vsliq_n_u64(groups, vshrq_n_u64(groups, 32), 28);
+        vst1_u8(out, vreinterpret_u8_u64(vget_low_u64(groups)));
+        vst1_u8(out + 7, vreinterpret_u8_u64(vget_high_u64(groups)));
+    }
+    pack14Scalar(pixels + i, count - i, out);
+}
+
+static void unpack14Neon(const uint8_t *in, size_t count, uint16_t *pixels) {
+    const uint64x2_t pairMask = vdupq_n_u64(0x0fffffff0fffffffull);
+    const uint16x8_t max = vdupq_n_u16(packed_pixel_max);
+    size_t i = 0;
+    for (; i + 8 < count; i += 8, in += 14) {
+        uint64x2_t groups = vcombine_u64(vreinterpret_u64_u8(vld1_u8(in)),
+                                         vreinterpret_u64_u8(vld1_u8(in + 7)));
+        groups = vandq_u64(vsliq_n_u64(groups, vshrq_n_u64(groups, 28), 32), pairMask);
+        uint32x4_t pairs = vreinterpretq_u32_u64(groups);
+        pairs = vsliq_n_u32(pairs, vshrq_n_u32(pairs, 14), 16);
+        vst1q_u16(pixels + i, vandq_u16(vreinterpretq_u16_u32(pairs), max));
+    }
+    unpack14Scalar(in, count - i, pixels + i);
+}
+
+#elif defined(__x86_64__) || defined(__SSE2__)
+
+// SSE2 has no unsigned 16 bit min, so values are clamped by
+// subtracting whatever they exceed the maximum by. The pairs are
+// widened with a multiply-add by 1 and 1 << 14.
+static void pack14SSE2(const uint16_t *pixels, size_t count, uint8_t *out) {
+    const __m128i max = _mm_set1_epi16(packed_pixel_max);
+    const __m128i shift = _mm_set1_epi32(1 | (1 << packed_pixel_bits) << 16);
+    const __m128i lowPair = _mm_set1_epi64x(0x0fffffff);
+    const __m128i highPair = _mm_set1_epi64x(0x00fffffff0000000ll);
+    size_t i = 0;
+    for (; i + 8 < count; i += 8, out += 14) {
+        __m128i v = _mm_loadu_si128((const __m128i *)(pixels + i));
+        v = _mm_sub_epi16(v, _mm_subs_epu16(v, max));
+        __m128i pairs = _mm_madd_epi16(v, shift);
+        __m128i groups = _mm_or_si128(_mm_and_si128(pairs, lowPair),
+                                      _mm_and_si128(_mm_srli_epi64(pairs, 4), highPair));
+        _mm_storel_epi64((__m128i *)out, groups);
+        _mm_storel_epi64((__m128i *)(out + 7), _mm_unpackhi_epi64(groups, groups));
+    }
+    pack14Scalar(pixels + i, count - i, out);
+}
+
+static void unpack14SSE2(const uint8_t *in, size_t count, uint16_t *pixels) {
+    const __m128i lowPair = _mm_set1_epi64x(0x0fffffff);
+    const __m128i highPair = _mm_set1_epi64x(0x0fffffff00000000ll);
+    const __m128i lowPixel = _mm_set1_epi32(0x3fff);
+    const __m128i highPixel = _mm_set1_epi32(0x3fff0000);
+    size_t i = 0;
+    for (; i + 8 < count; i += 8, in += 14) {
+        __m128i groups = _mm_unpacklo_epi64(_mm_loadl_epi64((const __m128i *)in),
+                                            _mm_loadl_epi64((const __m128i *)(in + 7)));
+        __m128i pairs = _mm_or_si128(_mm_and_si128(groups, lowPair),
+                                     _mm_and_si128(_mm_slli_epi64(groups, 4), highPair));
+        __m128i v = _mm_or_si128(_mm_and_si128(pairs, lowPixel),
+                                 _mm_and_si128(_mm_slli_epi32(pairs, 2), highPixel));
+        _mm_storeu_si128((__m128i *)(pixels + i), v);
+    }
+    unpack14Scalar(in, count - i, pixels + i);
+}
+
+// As SSE2, 16 pixels at a time.
+__attribute__((target("avx2")))
+static void pack14AVX2(const uint16_t *pixels, size_t count, uint8_t *out) {
+    const __m256i max = _mm256_set1_epi16(packed_pixel_max);
+    const __m256i shift = _mm256_set1_epi32(1 | (1 << packed_pixel_bits) << 16);
+    const __m256i lowPair = _mm256_set1_epi64x(0x0fffffff);
+    const __m256i highPair = _mm256_set1_epi64x(0x00fffffff0000000ll);
+    size_t i = 0;
+    for (; i + 16 < count; i += 16, out += 28) {
+        __m256i v = _mm256_loadu_si256((const __m256i *)(pixels + i));
+        v = _mm256_min_epu16(v, max);
+        __m256i pairs = _mm256_madd_epi16(v, shift);
+        __m256i groups = _mm256_or_si256(_mm256_and_si256(pairs, lowPair),
+                                         _mm256_and_si256(_mm256_srli_epi64(pairs, 4), highPair));
+        __m128i lo = _mm256_castsi256_si128(groups), hi = _mm256_extracti128_si256(groups, 1);
+        _mm_storel_epi64((__m128i *)out, lo);
+        _mm_storel_epi64((__m128i *)(out + 7), _mm_unpackhi_epi64(lo, lo));
+        _mm_storel_epi64((__m128i *)(out + 14), hi);
+        _mm_storel_epi64((__m128i *)(out + 21), _mm_unpackhi_epi64(hi, hi));
+    }
+    pack14SSE2(pixels + i, count - i, out);
+}
+
+__attribute__((target("avx2")))
+static void unpack14AVX2(const uint8_t *in, size_t count, uint16_t *pixels) {
+    const __m256i lowPair = _mm256_set1_epi64x(0x0fffffff);
+    const __m256i highPair = _mm256_set1_epi64x(0x0fffffff00000000ll);
+    const __m256i lowPixel = _mm256_set1_epi32(0x3fff);
+    const __m256i highPixel = _mm256_set1_epi32(0x3fff0000);
+    size_t i = 0;
+    for (; i + 16 < count; i += 16, in += 28) {
+        __m128i lo = _mm_unpacklo_epi64(_mm_loadl_epi64((const __m128i *)in),
+                                        _mm_loadl_epi64((const __m128i *)(in + 7)));
+        __m128i hi = _mm_unpacklo_epi64(_mm_loadl_epi64((const __m128i *)(in + 14)),
+                                        _mm_loadl_epi64((const __m128i *)(in + 21)));
+        __m256i groups = _mm256_inserti128_si256(_mm256_castsi128_si256(lo), hi, 1);
+        __m256i pairs = _mm256_or_si256(_mm256_and_si256(groups, lowPair),
+                                        _mm256_and_si256(_mm256_slli_epi64(groups, 4), highPair));
+        __m256i v = _mm256_or_si256(_mm256_and_si256(pairs, lowPixel),
+                                    _mm256_and_si256(_mm256_slli_epi32(pairs, 2), highPixel));
+        _mm256_storeu_si256((__m256i *)(pixels + i), v);
+    }
+    unpack14SSE2(in, count - i, pixels + i);
+}
+
+#endif
+
+typedef void (*PackFn)(const uint16_t *, size_t, uint8_t *);
+typedef void (*UnpackFn)(const uint8_t *, size_t, uint16_t *);
+
+static const char *chooseKernels(PackFn *pack, UnpackFn *unpack) {
+#if defined(__ARM_NEON)
+    *pack = pack14Neon;
+    *unpack = unpack14Neon;
+    return "neon";
+#elif defined(__x86_64__) || defined(__SSE2__)
+    __builtin_cpu_init();   // may run before libgcc has done it
+    if (__builtin_cpu_supports("avx2")) {
+        *pack = pack14AVX2;
+        *unpack = unpack14AVX2;
+        return "avx2";
+    }
+    *pack = pack14SSE2;
+    *unpack = unpack14SSE2;
+    return "sse2";
+#else
+    *pack = pack14Scalar;
+    *unpack = unpack14Scalar;
+    return "scalar";
+#endif
+}
+
+static PackFn packKernel;
+static UnpackFn unpackKernel;
+static const char *kernelName = chooseKernels(&packKernel, &unpackKernel);
+
+void pack14(const uint16_t *pixels, size_t count, uint8_t *out) {
+    packKernel(pixels, count, out);
+}
+
+void unpack14(const uint8_t *in, size_t count, uint16_t *pixels) {
+    unpackKernel(in, count, pixels);
+}
+
+const char *pack14Kernel() {
+    return kernelName;
+}
@@ -0,0 +1,31 @@
+#ifndef PIXEL_PACK_H
+#define PIXEL_PACK_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// The Boson's pixels are 14 bit values in 16 bit words. Packed, every
+// 4 pixels take 7 bytes: a 56 bit little endian word holding the first
+// pixel in its bottom 14 bits, the next in the 14 above and so on. A
+// final group of fewer than 4 pixels takes only the bytes its bits
+// need. Values too big for 14 bits (only possible from other sources)
+// are packed as 0x3fff.
+const int packed_pixel_bits = 14;
+const uint16_t packed_pixel_max = (1 << packed_pixel_bits) - 1;
+
+inline size_t packedBytes(size_t count) {
+    return (count * packed_pixel_bits + 7) / 8;
+}
+
+// Portable reference implementations. unpack14Scalar() is also the
+// reference for consumers of packed frames.
+void pack14Scalar(const uint16_t *pixels, size_t count, uint8_t *out);
+void unpack14Scalar(const uint8_t *in, size_t count, uint16_t *pixels);
+
+// The fastest implementations for this CPU: NEON on ARM, AVX2 or SSE2
+// on x86, or the scalar ones. out must have packedBytes(count) bytes.
+void pack14(const uint16_t *pixels, size_t count, uint8_t *out);
+void unpack14(const uint8_t *in, size_t count, uint16_t *pixels);
+const char *pack14Kernel();
+
+#endif // PIXEL_PACK_H
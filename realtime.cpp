@@ -0,0 +1,87 @@
+#include "realtime.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <alloca.h>
+#include <malloc.h>
+#include <sys/mman.h>
+#include <new>
+
+#include "stats.h"
+
+static thread_local bool watched;
+
+
+int lockMemory() {
+    int flags = MCL_CURRENT | MCL_FUTURE;
+#ifdef MCL_ONFAULT
+    // Only lock pages as they are used, so that idle threads' stacks
+    // aren't pinned in full.
+    flags |= MCL_ONFAULT;
+#endif
+    if (mlockall(flags) < 0) {
+        perror("mlockall");
+        return -1;
+    }
+    mallopt(M_TRIM_THRESHOLD, -1);
+    mallopt(M_MMAP_MAX, 0);
+    return 0;
+}
+
+void prefaultStack(size_t bytes) {
+    volatile char *stack = (volatile char *)alloca(bytes);
+    for (size_t i = 0; i < bytes; i += 4096) {
+        stack[i] = 0;
+    }
+}
+
+void watchAllocations() {
+    watched = true;
+}
+
+
+// Replace the global allocation functions to count allocations made
+// by watched threads.
+
+static void *countedAlloc(size_t n) {
+    if (watched) {
+        stats.count(COUNTER_ALLOCATIONS);
+    }
+    return malloc(n ? n : 1);
+}
+
+void *operator new(size_t n) {
+    void *p = countedAlloc(n);
+    if (!p) {
+        throw std::bad_alloc();
+    }
+    return p;
+}
+
+void *operator new[](size_t n) {
+    return operator new(n);
+}
+
+void *operator new(size_t n, const std::nothrow_t &) noexcept {
+    return countedAlloc(n);
+}
+
+void *operator new[](size_t n, const std::nothrow_t &) noexcept {
+    return countedAlloc(n);
+}
+
+void operator delete(void *p) noexcept {
+    free(p);
+}
+
+void operator delete[](void *p) noexcept {
+    free(p);
+}
+
+void operator delete(void *p, size_t) noexcept {
+    free(p);
+}
+
+void operator delete[](void *p, size_t) noexcept {
+    free(p);
+}
@@ -0,0 +1,22 @@
+#ifndef REALTIME_H
+#define REALTIME_H
+
+#include <stddef.h>
+
+// Support for running the capture thread without page faults or heap
+// allocation once frames are flowing.
+
+// Lock all current and future memory once it has been touched and
+// stop malloc from returning memory to the system. Buffers should be
+// written once (frame sources clear theirs when opened) and the stack
+// pre-faulted with prefaultStack().
+int lockMemory();
+
+// Touch the next bytes of the calling thread's stack.
+void prefaultStack(size_t bytes);
+
+// Count any C++ heap allocation made by the calling thread from now
+// on in the "allocations" counter, which should stay at zero.
+void watchAllocations();
+
+#endif // REALTIME_H
@@ -0,0 +1,390 @@
+#include "recorder.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <sched.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <chrono>
+
+#include "camera.h"
+#include "clock.h"
+#include "control.h"
+#include "frame_source.h"
+#include "logger.h"
+#include "stats.h"
+#include "trace.h"
+
+// Room beyond the pre-trigger frames for the writer to fall behind.
+const double writer_slack_seconds = 2;
+// Clips are split after this long, so continuous motion doesn't make
+// one endless file.
+const double max_clip_seconds = 600;
+const int write_batch_frames = 16;      // about 10MB per write
+const int writer_poll_ms = 50;
+const int writer_nice = 10;
+const uint64_t open_clip = ~0ULL;
+
+// ioprio_set(2) has no glibc wrapper: best effort class, lowest level.
+const int ioprio_who_process = 1;
+const int ioprio_class_shift = 13;
+const int ioprio_class_be = 2;
+const int ioprio_lowest = 7;
+
+const size_t frame_bytes = frame_pixels * pix_bytes;
+
+
+Recorder::Recorder(const RecorderConfig &config) :
+    config(config),
+    slots(NULL),
+    capacity(0),
+    fps(0),
+    pre(0),
+    post(0),
+    maxClipFrames(0),
+    direct(false),
+    clipUntil(0),
+    lastEnd(0),
+    recording(false),
+    requested(0),
+    head(0),
+    written(0),
+    clipsHead(0),
+    clipsTail(0),
+    cptv(NULL),
+    fd(-1),
+    pos(0),
+    firstSequence(0),
+    lastSequence(0),
+    stopping(false) {
+}
+
+Recorder::~Recorder() {
+    stop();
+    if (fd >= 0) {
+        close(fd);
+    }
+    delete[] slots;
+}
+
+int Recorder::open(double frameRate) {
+    fps = frameRate;
+    pre = config.preSeconds * fps + 0.5;
+    post = config.postSeconds * fps + 0.5;
+    maxClipFrames = max_clip_seconds * fps;
+    capacity = pre + (uint64_t)(writer_slack_seconds * fps) + 1;
+    if (mkdir(config.dir.c_str(), 0755) < 0 && errno != EEXIST) {
+        perror("recording directory");
+        return -1;
+    }
+    if (arena.allocate(frame_bytes, capacity) < 0) {
+        return -1;
+    }
+    slots = new SlotInfo[capacity];
+    // O_DIRECT needs every write to be whole blocks.
+    direct = config.raw && frame_bytes % 4096 == 0;
+    char host[256];
+    if (gethostname(host, sizeof(host)) == 0) {
+        host[sizeof(host) - 1] = 0;
+        deviceName = host;
+    }
+    return 0;
+}
+
+void Recorder::start() {
+    stopping = false;
+    thread = std::thread(&Recorder::run, this);
+}
+
+void Recorder::stop() {
+    if (recording) {
+        uint64_t h = head.load(std::memory_order_relaxed);
+        clips[(clipsHead.load(std::memory_order_relaxed) - 1) % max_clips].end.store(h, std::memory_order_release);
+        recording = false;
+        lastEnd = h;
+    }
+    {
+        std::lock_guard<std::mutex> lock(mu);
+        stopping = true;
+    }
+    wake.notify_all();
+    if (thread.joinable()) {
+        thread.join();
+    }
+}
+
+void Recorder::request(double seconds) {
+    uint32_t frames = seconds > 0 ? seconds * fps + 0.5 : post;
+    requested.store(frames ? frames : 1, std::memory_order_relaxed);
+}
+
+void Recorder::trigger(const char *reason, uint32_t frames) {
+    uint64_t h = head.load(std::memory_order_relaxed);
+    if (recording) {
+        clipUntil = h + frames > clipUntil ? h + frames : clipUntil;
+        return;
+    }
+    uint64_t n = clipsHead.load(std::memory_order_relaxed);
+    if (n - clipsTail.load(std::memory_order_acquire) == max_clips) {
+        stats.count(COUNTER_RECORD_DROPPED);
+        return;
+    }
+    uint64_t start = h > pre ? h - pre : 0;
+    start = start > lastEnd ? start : lastEnd;
+
+    Clip &clip = clips[n % max_clips];
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    clip.start = start;
+    clip.end.store(open_clip, std::memory_order_relaxed);
+    clip.wallNs = (uint64_t)now.tv_sec * 1000000000ULL + now.tv_nsec;
+    clip.monotonicNs = monotonicNs();
+    clip.reason = reason;
+    clipsHead.store(n + 1, std::memory_order_release);
+    recording = true;
+    clipUntil = h + frames;
+    logger.log(stdout, "record: %s clip started, with %llu frames from before\n",
+               reason, (unsigned long long)(h - start));
+}
+
+void Recorder::push(const Frame *frame) {
+    if (uint32_t frames = requested.exchange(0, std::memory_order_relaxed)) {
+        trigger("requested", frames);
+    }
+
+    uint64_t h = head.load(std::memory_order_relaxed);
+    uint64_t tail = clipsTail.load(std::memory_order_acquire);
+    if (tail != clipsHead.load(std::memory_order_relaxed)) {
+        // Keep what the writer still needs.
+        uint64_t needed = written.load(std::memory_order_acquire);
+        uint64_t start = clips[tail % max_clips].start;
+        needed = start > needed ? start : needed;
+        if (h - needed >= capacity) {
+            stats.count(COUNTER_RECORD_DROPPED);
+            return;
+        }
+    }
+    TraceScope span("record", frame->sequence);
+    memcpy(arena.buffer(h % capacity), frame->data, frame_bytes);
+    // CPTV frame times are on the monotonic clock, like the last FFC's.
+    SlotInfo &slot = slots[h % capacity];
+    slot.sequence = frame->sequence;
+    slot.timestampNs = frame->timestampNs;
+    slot.info.timeOnMs = frame->timestampNs / 1000000;
+    slot.info.lastFFCMs = camera.ffcEndedNs.load(std::memory_order_relaxed) / 1000000;
+    slot.info.tempC = camera.fpaTempCx10.load(std::memory_order_relaxed) / 10.0f;
+    slot.info.lastFFCTempC = camera.ffcTempCx10.load(std::memory_order_relaxed) / 10.0f;
+    slot.info.background = false;
+    head.store(++h, std::memory_order_release);
+
+    if (recording) {
+        Clip &clip = clips[(clipsHead.load(std::memory_order_relaxed) - 1) % max_clips];
+        if (h >= clipUntil || h - clip.start >= maxClipFrames) {
+            clip.end.store(h, std::memory_order_release);
+            recording = false;
+            lastEnd = h;
+        }
+    }
+}
+
+int Recorder::openClip(const Clip &clip, std::string &path) {
+    time_t secs = clip.wallNs / 1000000000ULL;
+    struct tm tm;
+    gmtime_r(&secs, &tm);
+    char name[64];
+    size_t n = strftime(name, sizeof(name), "%Y%m%d-%H%M%S", &tm);
+    snprintf(name + n, sizeof(name) - n, ".%03u.%s", (unsigned)(clip.wallNs / 1000000 % 1000),
+             cptv ? "cptv" : "raw");
+    path = config.dir + "/" + name;
+
+    int flags = O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC;
+    int clipFd = ::open(path.c_str(), flags | (direct ? O_DIRECT : 0), 0644);
+    if (clipFd < 0 && direct && errno == EINVAL) {
+        // Not supported by this filesystem (tmpfs, for one).
+        clipFd = ::open(path.c_str(), flags, 0644);
+    }
+    if (clipFd < 0) {
+        logger.log(stderr, "record: can't create %s: %s\n", path.c_str(), strerror(errno));
+    }
+    return clipFd;
+}
+
+void Recorder::finishClip(const Clip &clip, uint64_t end) {
+    fd = -1;
+    logger.log(stdout, "record: wrote %s, %llu frames (%u to %u)\n", path.c_str(),
+               (unsigned long long)(end - clip.start), firstSequence, lastSequence);
+    clipsTail.store(clipsTail.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+}
+
+// Give up on the oldest clip after an error writing it.
+void Recorder::failClip() {
+    logger.log(stderr, "record: writing %s: %s\n", path.c_str(), strerror(errno));
+    // The CPTV writer closes its file itself.
+    if (!cptv) {
+        close(fd);
+    }
+    fd = -1;
+    clipsTail.store(clipsTail.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+}
+
+// Write some of the oldest clip. Returns false if there was nothing
+// to do.
+bool Recorder::writeClips() {
+    uint64_t tail = clipsTail.load(std::memory_order_relaxed);
+    if (tail == clipsHead.load(std::memory_order_acquire)) {
+        return false;
+    }
+    Clip &clip = clips[tail % max_clips];
+    if (fd < 0) {
+        pos = clip.start;
+        written.store(pos, std::memory_order_release);
+        fd = openClip(clip, path);
+        if (fd < 0) {
+            clipsTail.store(tail + 1, std::memory_order_release);
+            return true;
+        }
+        if (cptv) {
+            // The header has the time of the first frame, before the
+            // trigger.
+            uint64_t firstNs = slots[pos % capacity].timestampNs;
+            uint64_t beforeNs = clip.monotonicNs > firstNs ? clip.monotonicNs - firstNs : 0;
+            CptvHeader header = CptvHeader();
+            header.timestampUs = (clip.wallNs - beforeNs) / 1000;
+            header.fps = fps + 0.5;
+            header.brand = "FLIR";
+            header.model = "Boson";
+            header.deviceName = deviceName;
+            header.cameraSerial = config.cameraSerial;
+            if (cptv->open(fd, header) < 0) {
+                failClip();
+                return true;
+            }
+        }
+    }
+
+    uint64_t end = clip.end.load(std::memory_order_acquire);
+    uint64_t available = head.load(std::memory_order_acquire);
+    available = end < available ? end : available;
+    return cptv ? writeCptv(clip, available, end) : writeRaw(clip, available, end);
+}
+
+bool Recorder::writeCptv(const Clip &clip, uint64_t available, uint64_t end) {
+    bool busy = pos < available;
+    if (busy) {
+        const SlotInfo &slot = slots[pos % capacity];
+        if (pos == clip.start) {
+            firstSequence = slot.sequence;
+        }
+        TraceScope span("record write", slot.sequence);
+        const uint16_t *prev = pos > clip.start ? (const uint16_t *)arena.buffer((pos - 1) % capacity) : NULL;
+        if (cptv->add(prev, (const uint16_t *)arena.buffer(pos % capacity), slot.info) < 0) {
+            failClip();
+            return true;
+        }
+        lastSequence = slot.sequence;
+        pos++;
+    } else if (pos == end) {
+        if (cptv->close() < 0) {
+            failClip();
+        } else {
+            finishClip(clip, end);
+        }
+        return true;
+    } else if (cptv->flush(false) < 0) {
+        failClip();
+        return true;
+    }
+    // Frames still being compressed, and the one each is delta encoded
+    // against, must stay in the ring.
+    uint64_t done = clip.start + cptv->written();
+    written.store(done > clip.start ? done - 1 : done, std::memory_order_release);
+    return busy;
+}
+
+bool Recorder::writeRaw(const Clip &clip, uint64_t available, uint64_t end) {
+    if (pos < available) {
+        struct iovec iov[write_batch_frames];
+        int n = 0;
+        for (; n < write_batch_frames && pos + n < available; n++) {
+            iov[n].iov_base = arena.buffer((pos + n) % capacity);
+            iov[n].iov_len = frame_bytes;
+        }
+        if (pos == clip.start) {
+            firstSequence = slots[pos % capacity].sequence;
+        }
+        TraceScope span("record write", slots[pos % capacity].sequence);
+        struct iovec *next = iov;
+        int left = n;
+        while (left > 0) {
+            ssize_t w = writev(fd, next, left);
+            if (w < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                failClip();
+                return true;
+            }
+            // Partial write: skip the iovecs it covered.
+            while (left > 0 && (size_t)w >= next->iov_len) {
+                w -= next->iov_len;
+                next++;
+                left--;
+            }
+            if (left > 0) {
+                next->iov_base = (uint8_t *)next->iov_base + w;
+                next->iov_len -= w;
+            }
+        }
+        pos += n;
+        lastSequence = slots[(pos - 1) % capacity].sequence;
+        written.store(pos, std::memory_order_release);
+        return true;
+    }
+    if (pos != end) {
+        return false;
+    }
+
+    close(fd);
+    finishClip(clip, end);
+    return true;
+}
+
+void Recorder::run() {
+    demoteThread(SCHED_OTHER);
+    setpriority(PRIO_PROCESS, syscall(SYS_gettid), writer_nice);
+    syscall(SYS_ioprio_set, ioprio_who_process, 0, ioprio_class_be << ioprio_class_shift | ioprio_lowest);
+    traceThreadStart("recorder");
+    // Created here so the workers share this thread's low priority.
+    if (!config.raw) {
+        int threads = config.threads;
+        if (threads <= 0) {
+            int cpus = std::thread::hardware_concurrency();
+            threads = cpus > 1 ? cpus - 1 : 1;
+        }
+        cptv = new CptvWriter(width, height, threads);
+        logger.log(stdout, "record: compressing CPTV on %d thread%s\n", threads, threads == 1 ? "" : "s");
+    }
+
+    std::unique_lock<std::mutex> lock(mu);
+    for (;;) {
+        lock.unlock();
+        bool busy = writeClips();
+        lock.lock();
+        if (busy) {
+            continue;
+        }
+        // Everything queued is written.
+        if (stopping) {
+            break;
+        }
+        wake.wait_for(lock, std::chrono::milliseconds(writer_poll_ms), [this] { return stopping; });
+    }
+    delete cptv;
+    cptv = NULL;
+}
@@ -0,0 +1,123 @@
+#ifndef RECORDER_H
+#define RECORDER_H
+
+#include <stdint.h>
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <string>
+#include <thread>
+
+#include "buffer_arena.h"
+#include "cptv.h"
+
+struct Frame;
+
+struct RecorderConfig {
+    std::string dir;            // where clips are written
+    double preSeconds = 3;      // frames kept from before a trigger
+    double postSeconds = 5;     // frames recorded after the last trigger
+    bool raw = false;           // raw Y16 clips rather than CPTV
+    int threads = 0;            // CPTV compression threads, 0 for one per spare CPU
+    uint32_t cameraSerial = 0;  // for CPTV headers, if known
+};
+
+// Keeps the last few seconds of frames in a preallocated ring, and on
+// a trigger writes a clip, starting preSeconds before it, to a file in
+// the recording directory. Each trigger keeps the clip going for at
+// least postSeconds more. The capture thread only copies frames (and
+// the camera's state) into the ring; a low priority thread writes
+// clips out as CPTV, compressed on a pool of workers, or as raw Y16
+// frames with large aligned (O_DIRECT where the filesystem allows)
+// writes.
+// If the writer falls so far behind that the ring is full, new frames
+// are left out of the clip and counted as record_dropped, so the
+// capture thread never waits for the disk.
+class Recorder {
+public:
+    Recorder(const RecorderConfig &config);
+    ~Recorder();
+
+    int open(double fps);
+    void start();
+
+    // Finish the clip in progress, write out what is queued and stop
+    // the writer. Call from the capture thread, or once it has stopped.
+    void stop();
+
+    // Capture thread: copy a frame into the ring.
+    void push(const Frame *frame);
+
+    // Capture thread: start a clip, or keep one going, for at least
+    // frames more frames.
+    void trigger(const char *reason, uint32_t frames);
+
+    // Any thread: trigger a clip from the capture thread's next frame.
+    void request(double seconds);
+
+    uint32_t postFrames() const { return post; }
+
+private:
+    static const int max_clips = 8;
+
+    struct SlotInfo {
+        uint32_t sequence;
+        uint64_t timestampNs;
+        CptvFrameInfo info;
+    };
+
+    struct Clip {
+        uint64_t start;                 // ring index of its first frame
+        std::atomic<uint64_t> end;      // one past its last, or ~0 while open
+        uint64_t wallNs;                // realtime clock when triggered
+        uint64_t monotonicNs;           // and the monotonic clock
+        const char *reason;
+    };
+
+    void run();
+    bool writeClips();
+    bool writeCptv(const Clip &clip, uint64_t available, uint64_t end);
+    bool writeRaw(const Clip &clip, uint64_t available, uint64_t end);
+    void finishClip(const Clip &clip, uint64_t end);
+    void failClip();
+    int openClip(const Clip &clip, std::string &path);
+
+    RecorderConfig config;
+    BufferArena arena;
+    SlotInfo *slots;
+    uint64_t capacity;
+    double fps;
+    uint32_t pre;
+    uint32_t post;
+    uint32_t maxClipFrames;
+    bool direct;                        // frames suit O_DIRECT
+    std::string deviceName;
+
+    // Owned by the capture thread.
+    uint64_t clipUntil;                 // ring index the open clip runs to
+    uint64_t lastEnd;                   // where the last clip ended
+    bool recording;
+    std::atomic<uint32_t> requested;    // frames asked for by request()
+
+    // Shared with the writer.
+    std::atomic<uint64_t> head;         // ring index of the next frame
+    std::atomic<uint64_t> written;      // clip frames before this are on disk
+    std::atomic<uint64_t> clipsHead;    // clips started
+    std::atomic<uint64_t> clipsTail;    // clips finished by the writer
+    Clip clips[max_clips];
+
+    // Owned by the writer.
+    CptvWriter *cptv;
+    int fd;                             // the clip's file, once open
+    std::string path;
+    uint64_t pos;                       // next frame to write
+    uint32_t firstSequence;
+    uint32_t lastSequence;
+
+    std::mutex mu;
+    std::condition_variable wake;
+    bool stopping;
+    std::thread thread;
+};
+
+#endif // RECORDER_H
@@ -0,0 +1,123 @@
+#include "frame_source.h"
+
+#include <stdio.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "cptv.h"
+
+const double raw_replay_fps = 60;
+
+
+ReplaySource::ReplaySource(const std::string &path, int numBuffers, bool realtime, bool loop) :
+    GeneratedSource(numBuffers, realtime ? raw_replay_fps : 0),
+    path(path),
+    loop(loop),
+    cptv(NULL),
+    rawFd(-1),
+    lastTimeOnMs(0),
+    lastInterval(0) {
+}
+
+ReplaySource::~ReplaySource() {
+    delete cptv;
+    if (rawFd >= 0) {
+        close(rawFd);
+    }
+}
+
+int ReplaySource::open() {
+    if (rewind() < 0) {
+        return -1;
+    }
+    if (cptv) {
+        const CptvHeader &hdr = cptv->header();
+        if (hdr.width != (uint32_t)width || hdr.height != (uint32_t)height) {
+            fprintf(stderr, "%s: resolution %ux%u doesn't match %dx%d\n",
+                    path.c_str(), hdr.width, hdr.height, width, height);
+            return -1;
+        }
+        if (fps > 0 && hdr.fps > 0) {
+            fps = hdr.fps;
+        }
+    }
+    return allocate();
+}
+
+// (Re)open the file from the start.
+int ReplaySource::rewind() {
+    delete cptv;
+    cptv = NULL;
+    if (rawFd >= 0) {
+        close(rawFd);
+    }
+
+    rawFd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (rawFd < 0) {
+        perror("replay open");
+        return -1;
+    }
+
+    // CPTV files are gzipped; anything else is treated as raw frames.
+    uint8_t magic[2] = { 0, 0 };
+    if (pread(rawFd, magic, 2, 0) == 2 && magic[0] == 0x1f && magic[1] == 0x8b) {
+        close(rawFd);
+        rawFd = -1;
+        cptv = new CptvReader();
+        return cptv->open(path);
+    }
+    posix_fadvise(rawFd, 0, 0, POSIX_FADV_SEQUENTIAL);
+    return 0;
+}
+
+bool ReplaySource::fill(Frame *frame) {
+    for (int attempt = 0; attempt < 2; attempt++) {
+        if (cptv) {
+            CptvFrameInfo info;
+            int r = cptv->next(frame->data, &info);
+            if (r == 1) {
+                // Pace by the recorded capture times when they look sane.
+                uint32_t prevTimeOn = lastTimeOnMs;
+                lastTimeOnMs = info.timeOnMs;
+                uint32_t gap = info.timeOnMs - prevTimeOn;
+                lastInterval = (prevTimeOn && gap > 0 && gap < 1000) ? gap / 1000.0 : 0;
+                return true;
+            }
+            if (r < 0) {
+                fprintf(stderr, "%s: corrupt CPTV frame\n", path.c_str());
+                return false;
+            }
+        } else {
+            size_t want = frameBytes();
+            size_t got = 0;
+            while (got < want) {
+                ssize_t n = read(rawFd, (uint8_t *)frame->data + got, want - got);
+                if (n < 0 && errno == EINTR) {
+                    continue;
+                }
+                if (n <= 0) {
+                    break;
+                }
+                got += n;
+            }
+            if (got == want) {
+                return true;
+            }
+            if (got > 0) {
+                fprintf(stderr, "%s: ignoring partial frame at end\n", path.c_str());
+            }
+        }
+
+        // End of file.
+        if (!loop || rewind() < 0) {
+            return false;
+        }
+        lastTimeOnMs = 0;
+    }
+    return false;
+}
+
+double ReplaySource::interval() {
+    return lastInterval > 0 ? lastInterval : 1.0 / fps;
+}
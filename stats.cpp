@@ -0,0 +1,173 @@
+#include "stats.h"
+
+#include <sstream>
+
+#include "clock.h"
+
+Stats stats;
+
+static const char *stage_names[NUM_STAGES] = {
+    "dqbuf_wait",
+    "queue",
+    "send",
+    "cci",
+    "end_to_end",
+    "analysis",
+};
+
+static const char *counter_names[NUM_COUNTERS] = {
+    "frames",
+    "dropped",
+    "late",
+    "send_errors",
+    "cci_errors",
+    "ffc",
+    "allocations",
+    "ffc_dropped",
+    "ffc_deferred",
+    "record_dropped",
+};
+
+const char *stageName(Stage stage) {
+    return stage_names[stage];
+}
+
+const char *counterName(Counter counter) {
+    return counter_names[counter];
+}
+
+
+LatencyHistogram::LatencyHistogram() {
+    reset();
+}
+
+void LatencyHistogram::reset() {
+    for (auto &c : counts) {
+        c.store(0, std::memory_order_relaxed);
+    }
+    count.store(0, std::memory_order_relaxed);
+    sum.store(0, std::memory_order_relaxed);
+    min.store(UINT64_MAX, std::memory_order_relaxed);
+    max.store(0, std::memory_order_relaxed);
+}
+
+int LatencyHistogram::bucketIndex(uint64_t ns) {
+    const uint64_t limit = (1ULL << max_exponent) - 1;
+    if (ns > limit) {
+        ns = limit;
+    }
+    if (ns < 2 * sub_buckets) {
+        return (int)ns;
+    }
+    int exponent = 63 - __builtin_clzll(ns);
+    int shift = exponent - sub_bucket_bits;
+    return (shift + 1) * sub_buckets + (int)(ns >> shift) - sub_buckets;
+}
+
+// The highest value which falls in the bucket.
+uint64_t LatencyHistogram::bucketValue(int index) {
+    if (index < 2 * sub_buckets) {
+        return index;
+    }
+    int shift = index / sub_buckets - 1;
+    uint64_t sub = index % sub_buckets + sub_buckets;
+    return (sub << shift) + (1ULL << shift) - 1;
+}
+
+void LatencyHistogram::record(uint64_t ns) {
+    counts[bucketIndex(ns)].fetch_add(1, std::memory_order_relaxed);
+    count.fetch_add(1, std::memory_order_relaxed);
+    sum.fetch_add(ns, std::memory_order_relaxed);
+
+    uint64_t cur = min.load(std::memory_order_relaxed);
+    while (ns < cur && !min.compare_exchange_weak(cur, ns, std::memory_order_relaxed)) {
+    }
+    cur = max.load(std::memory_order_relaxed);
+    while (ns > cur && !max.compare_exchange_weak(cur, ns, std::memory_order_relaxed)) {
+    }
+}
+
+void LatencyHistogram::snapshot(Snapshot &out) const {
+    out.count = 0;
+    for (int i = 0; i < num_buckets; i++) {
+        out.counts[i] = counts[i].load(std::memory_order_relaxed);
+        out.count += out.counts[i];
+    }
+    out.sum = sum.load(std::memory_order_relaxed);
+    out.min = out.count ? min.load(std::memory_order_relaxed) : 0;
+    out.max = max.load(std::memory_order_relaxed);
+}
+
+uint64_t LatencyHistogram::Snapshot::percentile(double q) const {
+    if (count == 0) {
+        return 0;
+    }
+    uint64_t rank = (uint64_t)(q * count + 0.5);
+    if (rank < 1) {
+        rank = 1;
+    }
+    uint64_t seen = 0;
+    for (int i = 0; i < num_buckets; i++) {
+        seen += counts[i];
+        if (seen >= rank) {
+            uint64_t v = bucketValue(i);
+            return v < max ? v : max;
+        }
+    }
+    return max;
+}
+
+
+Stats::Stats() : frameRate(0), outputFd(-1), startNs(monotonicNs()) {
+    for (auto &c : counters) {
+        c.store(0, std::memory_order_relaxed);
+    }
+}
+
+void Stats::reset() {
+    for (auto &h : latency) {
+        h.reset();
+    }
+    for (auto &c : counters) {
+        c.store(0, std::memory_order_relaxed);
+    }
+    startNs = monotonicNs();
+}
+
+std::string Stats::toJSON() const {
+    static const struct {
+        const char *name;
+        double q;
+    } percentiles[] = {
+        { "p50", 0.5 }, { "p90", 0.9 }, { "p99", 0.99 }, { "p999", 0.999 },
+    };
+
+    std::ostringstream out;
+    out.precision(3);
+    out << std::fixed;
+    out << "{\"uptime_s\":" << (monotonicNs() - startNs) / 1e9;
+    out << ",\"frame_rate_hz\":" << frameRate.load(std::memory_order_relaxed);
+
+    out << ",\"counters\":{";
+    for (int c = 0; c < NUM_COUNTERS; c++) {
+        out << (c ? "," : "") << '"' << counter_names[c] << "\":"
+            << counters[c].load(std::memory_order_relaxed);
+    }
+
+    out << "},\"latency_us\":{";
+    LatencyHistogram::Snapshot *snap = new LatencyHistogram::Snapshot;
+    for (int s = 0; s < NUM_STAGES; s++) {
+        latency[s].snapshot(*snap);
+        out << (s ? "," : "") << '"' << stage_names[s] << "\":{"
+            << "\"count\":" << snap->count
+            << ",\"min\":" << snap->min / 1e3
+            << ",\"mean\":" << snap->mean() / 1e3;
+        for (auto &p : percentiles) {
+            out << ",\"" << p.name << "\":" << snap->percentile(p.q) / 1e3;
+        }
+        out << ",\"max\":" << snap->max / 1e3 << '}';
+    }
+    delete snap;
+    out << "}}\n";
+    return out.str();
+}
@@ -0,0 +1,99 @@
+#ifndef STATS_H
+#define STATS_H
+
+#include <stdint.h>
+#include <atomic>
+#include <string>
+
+// Log-linear latency histogram in the style of HdrHistogram: each
+// power of two range of nanoseconds is split into sub_buckets linear
+// buckets, giving about 3% precision from 1 ns up to max_exponent.
+// Recording is a relaxed atomic increment so other threads can read
+// the histogram while it is being written.
+class LatencyHistogram {
+public:
+    static const int sub_bucket_bits = 5;
+    static const int sub_buckets = 1 << sub_bucket_bits;
+    static const int max_exponent = 40;   // ~18 minutes in ns
+    static const int num_buckets = (max_exponent - sub_bucket_bits + 1) * sub_buckets;
+
+    LatencyHistogram();
+
+    void record(uint64_t ns);
+    void reset();
+
+    // A consistent enough copy for computing percentiles.
+    struct Snapshot {
+        uint64_t counts[num_buckets];
+        uint64_t count;
+        uint64_t sum;
+        uint64_t min;
+        uint64_t max;
+
+        // Value (ns) at or below which the fraction q of samples lie.
+        uint64_t percentile(double q) const;
+        double mean() const { return count ? (double)sum / count : 0; }
+    };
+    void snapshot(Snapshot &out) const;
+
+private:
+    static int bucketIndex(uint64_t ns);
+    static uint64_t bucketValue(int index);
+
+    std::atomic<uint64_t> counts[num_buckets];
+    std::atomic<uint64_t> count;
+    std::atomic<uint64_t> sum;
+    std::atomic<uint64_t> min;
+    std::atomic<uint64_t> max;
+};
+
+// Stages of a frame's (and the camera link's) life that are timed.
+enum Stage {
+    STAGE_DQBUF_WAIT,       // blocked waiting for the next frame
+    STAGE_QUEUE,            // frame completed to dequeued by bosond
+    STAGE_SEND,             // writing the frame to the output socket
+    STAGE_CCI,              // camera command round trip
+    STAGE_END_TO_END,       // frame completed to last byte written
+    STAGE_ANALYSIS,         // per-frame processing for metadata
+    NUM_STAGES
+};
+
+enum Counter {
+    COUNTER_FRAMES,
+    COUNTER_DROPPED,        // gaps in the source's frame sequence
+    COUNTER_LATE,           // frames arriving > 1.5 nominal periods after the last
+    COUNTER_SEND_ERRORS,
+    COUNTER_CCI_ERRORS,     // failed camera commands (USB/serial errors)
+    COUNTER_FFC,            // flat field corrections seen by the poller
+    COUNTER_ALLOCATIONS,    // heap allocations by the capture thread
+    COUNTER_FFC_DROPPED,    // frames not sent because of an FFC
+    COUNTER_FFC_DEFERRED,   // scheduled FFCs put off because of motion
+    COUNTER_RECORD_DROPPED, // frames left out of clips because the writer fell behind
+    NUM_COUNTERS
+};
+
+struct Stats {
+    LatencyHistogram latency[NUM_STAGES];
+    std::atomic<uint64_t> counters[NUM_COUNTERS];
+    std::atomic<double> frameRate;  // measured over recent frames, Hz
+    std::atomic<int> outputFd;      // frame output socket, for backlog
+    uint64_t startNs;
+
+    Stats();
+
+    void count(Counter c, uint64_t n = 1) {
+        counters[c].fetch_add(n, std::memory_order_relaxed);
+    }
+
+    void reset();
+
+    // All counters and latency percentiles as a JSON object.
+    std::string toJSON() const;
+};
+
+extern Stats stats;
+
+const char *stageName(Stage stage);
+const char *counterName(Counter counter);
+
+#endif // STATS_H
@@ -0,0 +1,94 @@
+#include "frame_source.h"
+
+#include <stdio.h>
+
+const uint16_t background_level = 8000;
+const int noise_span = 32;          // sensor noise amplitude, in counts
+const int noise_period = 4096;      // extra noise samples to offset into
+
+
+SyntheticSource::SyntheticSource(const std::string &pattern, int numBuffers, double fps) :
+    GeneratedSource(numBuffers, fps),
+    pattern(pattern),
+    count(0) {
+}
+
+int SyntheticSource::open() {
+    if (pattern != "ramp" && pattern != "blobs") {
+        fprintf(stderr, "unknown synthetic pattern: %s (use ramp or blobs)\n", pattern.c_str());
+        return -1;
+    }
+
+    // Precompute noise once; each frame reads it at a different offset
+    // so generation stays cheap enough to run far above 60 Hz.
+    noise.resize(frame_pixels + noise_period);
+    uint32_t lcg = 12345;
+    for (auto &n : noise) {
+        lcg = lcg * 1664525 + 1013904223;
+        n = (lcg >> 16) % noise_span;
+    }
+
+    blobs = {
+        { 100, 100, 2.5f, 1.5f, 20, 600 },
+        { 500, 300, -1.5f, 2.0f, 12, 900 },
+        { 320, 450, 1.0f, -0.5f, 30, 400 },
+    };
+
+    return allocate();
+}
+
+bool SyntheticSource::fill(Frame *frame) {
+    uint16_t *pix = frame->data;
+
+    if (pattern == "ramp") {
+        for (int y = 0; y < height; y++) {
+            for (int x = 0; x < width; x++) {
+                pix[y * width + x] = background_level + (((x + y + count) & 1023) << 3);
+            }
+        }
+        count++;
+        return true;
+    }
+
+    const uint16_t *n = &noise[(count * 2654435761u) % noise_period];
+    for (int y = 0; y < height; y++) {
+        uint16_t level = background_level + y / 4;
+        for (int x = 0; x < width; x++) {
+            pix[y * width + x] = level + n[y * width + x];
+        }
+    }
+
+    for (auto &b : blobs) {
+        int r = (int)b.radius;
+        int x0 = (int)b.x, y0 = (int)b.y;
+        for (int y = y0 - r; y <= y0 + r; y++) {
+            if (y < 0 || y >= height) {
+                continue;
+            }
+            for (int x = x0 - r; x <= x0 + r; x++) {
+                if (x < 0 || x >= width) {
+                    continue;
+                }
+                int d2 = (x - x0) * (x - x0) + (y - y0) * (y - y0);
+                if (d2 <= r * r) {
+                    pix[y * width + x] += b.heat - b.heat * d2 / (r * r + 1);
+                }
+            }
+        }
+
+        // Move, bouncing off the edges.
+        b.x += b.dx;
+        b.y += b.dy;
+        if (b.x < 0 || b.x >= width) {
+            b.dx = -b.dx;
+            b.x += 2 * b.dx;
+        }
+        if (b.y < 0 || b.y >= height) {
+            b.dy = -b.dy;
+            b.y += 2 * b.dy;
+        }
+    }
+
+    count++;
+    return true;
+}
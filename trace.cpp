@@ -0,0 +1,170 @@
+#include "trace.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <algorithm>
+#include <mutex>
+#include <thread>
+
+std::atomic<bool> trace_enabled(false);
+
+// Synthetic thread ids for tracks which aren't real threads.
+const int track_tid_base = 1 << 22;
+
+static std::mutex trace_mutex;
+static std::vector<TraceBuffer *> trace_buffers;
+static size_t trace_capacity = 1 << 16;
+static std::string trace_path;
+static thread_local TraceBuffer *thread_buffer;
+
+
+static size_t roundUpPow2(size_t n) {
+    size_t p = 1;
+    while (p < n) {
+        p <<= 1;
+    }
+    return p;
+}
+
+TraceBuffer::TraceBuffer(const std::string &name, int tid, size_t capacity) :
+    name(name),
+    tid(tid),
+    events(roundUpPow2(capacity)),
+    mask(events.size() - 1),
+    head(0) {
+}
+
+void TraceBuffer::read(std::vector<TraceEvent> &out) const {
+    uint64_t end = head.load(std::memory_order_acquire);
+    uint64_t size = events.size();
+    uint64_t begin = end > size ? end - size : 0;
+    size_t first = out.size();
+    for (uint64_t i = begin; i < end; i++) {
+        out.push_back(events[i & mask]);
+    }
+
+    // Anything the writer may have lapped while we copied is suspect.
+    std::atomic_thread_fence(std::memory_order_acquire);
+    uint64_t now = head.load(std::memory_order_relaxed);
+    if (now >= size && now - size >= begin) {
+        uint64_t torn = std::min(now - size - begin + 1, end - begin);
+        out.erase(out.begin() + first, out.begin() + first + torn);
+    }
+}
+
+static TraceBuffer *newBuffer(const std::string &name, int tid) {
+    std::lock_guard<std::mutex> lock(trace_mutex);
+    TraceBuffer *buffer = new TraceBuffer(name, tid, trace_capacity);
+    trace_buffers.push_back(buffer);
+    return buffer;
+}
+
+TraceBuffer *traceThread(const char *name) {
+    if (!thread_buffer) {
+        int tid = syscall(SYS_gettid);
+        thread_buffer = newBuffer(name ? name : "thread " + std::to_string(tid), tid);
+    }
+    return thread_buffer;
+}
+
+TraceBuffer *traceTrack(const char *name) {
+    size_t n;
+    {
+        std::lock_guard<std::mutex> lock(trace_mutex);
+        n = trace_buffers.size();
+    }
+    return newBuffer(name, track_tid_base + n);
+}
+
+static void jsonString(FILE *f, const std::string &s) {
+    fputc('"', f);
+    for (char c : s) {
+        if (c == '"' || c == '\\') {
+            fputc('\\', f);
+        }
+        fputc(c, f);
+    }
+    fputc('"', f);
+}
+
+int traceDump(const std::string &path) {
+    std::vector<TraceBuffer *> buffers;
+    {
+        std::lock_guard<std::mutex> lock(trace_mutex);
+        buffers = trace_buffers;
+    }
+
+    FILE *f = fopen(path.c_str(), "w");
+    if (!f) {
+        perror("trace dump");
+        return -1;
+    }
+
+    int pid = getpid();
+    std::vector<TraceEvent> events;
+    size_t total = 0;
+    fprintf(f, "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[\n");
+    bool first = true;
+    for (TraceBuffer *b : buffers) {
+        fprintf(f, "%s{\"ph\":\"M\",\"name\":\"thread_name\",\"pid\":%d,\"tid\":%d,\"args\":{\"name\":",
+                first ? "" : ",\n", pid, b->tid);
+        jsonString(f, b->name);
+        fprintf(f, "}}");
+        first = false;
+
+        events.clear();
+        b->read(events);
+        total += events.size();
+        for (const TraceEvent &e : events) {
+            fprintf(f, ",\n{\"ph\":\"X\",\"name\":\"%s\",\"pid\":%d,\"tid\":%d,\"ts\":%.3f,\"dur\":%.3f",
+                    e.name, pid, b->tid, e.startNs / 1e3, e.durNs / 1e3);
+            if (e.arg >= 0) {
+                fprintf(f, ",\"args\":{\"frame\":%lld}", (long long)e.arg);
+            }
+            fputc('}', f);
+        }
+    }
+    fprintf(f, "\n]}\n");
+
+    if (fclose(f) != 0) {
+        perror("trace dump");
+        return -1;
+    }
+    fprintf(stderr, "wrote %zu trace events to %s\n", total, path.c_str());
+    return 0;
+}
+
+static void dumpOnSignal(sigset_t set) {
+    for (;;) {
+        int sig;
+        if (sigwait(&set, &sig) != 0) {
+            return;
+        }
+        traceDump(trace_path);
+    }
+}
+
+int traceStart(size_t capacity, const std::string &dumpPath) {
+    trace_capacity = capacity;
+    trace_path = dumpPath;
+
+    // Block SIGUSR2 here so every thread started after this inherits
+    // the mask and only the dumper thread receives it.
+    sigset_t set;
+    sigemptyset(&set);
+    sigaddset(&set, SIGUSR2);
+    int err = pthread_sigmask(SIG_BLOCK, &set, NULL);
+    if (err) {
+        fprintf(stderr, "trace: pthread_sigmask: %s\n", strerror(err));
+        return -1;
+    }
+    std::thread(dumpOnSignal, set).detach();
+
+    trace_enabled = true;
+    return 0;
+}
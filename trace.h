@@ -0,0 +1,106 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stdint.h>
+#include <atomic>
+#include <string>
+#include <vector>
+
+#include "clock.h"
+
+// Opt-in tracing of timestamped spans (frame dequeue, send, requeue,
+// processing stages, camera commands, ...) for finding which stage
+// and thread causes occasional hiccups.
+//
+// Each thread writes into its own fixed size ring buffer with no locks
+// or allocation; the oldest spans are overwritten. A dump (SIGUSR2 or
+// the "trace" control command) writes everything still in the rings as
+// Chrome trace event JSON, viewable in Perfetto or chrome://tracing.
+
+struct TraceEvent {
+    const char *name;   // must be a string literal or otherwise static
+    uint64_t startNs;
+    uint64_t durNs;
+    int64_t arg;        // frame sequence number or -1
+};
+
+class TraceBuffer {
+public:
+    TraceBuffer(const std::string &name, int tid, size_t capacity);
+
+    // Only ever called by the owning thread.
+    void add(const char *name, uint64_t startNs, uint64_t endNs, int64_t arg) {
+        uint64_t h = head.load(std::memory_order_relaxed);
+        TraceEvent &e = events[h & mask];
+        e.name = name;
+        e.startNs = startNs;
+        e.durNs = endNs - startNs;
+        e.arg = arg;
+        head.store(h + 1, std::memory_order_release);
+    }
+
+    // Copy out the events which are still intact. Safe to call from
+    // any thread while the owner keeps writing.
+    void read(std::vector<TraceEvent> &out) const;
+
+    const std::string name;
+    const int tid;
+
+private:
+    std::vector<TraceEvent> events;
+    uint64_t mask;
+    std::atomic<uint64_t> head;
+};
+
+extern std::atomic<bool> trace_enabled;
+
+// The calling thread's buffer, created on first use.
+TraceBuffer *traceThread(const char *name = NULL);
+
+// Name the calling thread's track and create its buffer up front, so
+// that doesn't happen mid-stream. Does nothing unless tracing is on.
+inline void traceThreadStart(const char *name) {
+    if (trace_enabled.load(std::memory_order_relaxed)) {
+        traceThread(name);
+    }
+}
+
+// A separate track, e.g. for time spent in the driver's queue, which
+// would otherwise overlap the spans on the thread recording it.
+TraceBuffer *traceTrack(const char *name);
+
+inline void traceSpan(const char *name, uint64_t startNs, uint64_t endNs, int64_t arg = -1) {
+    if (trace_enabled.load(std::memory_order_relaxed)) {
+        traceThread()->add(name, startNs, endNs, arg);
+    }
+}
+
+// Records a span covering its own lifetime.
+class TraceScope {
+public:
+    explicit TraceScope(const char *name, int64_t arg = -1) :
+        name(name),
+        arg(arg),
+        startNs(trace_enabled.load(std::memory_order_relaxed) ? monotonicNs() : 0) {
+    }
+    ~TraceScope() {
+        if (startNs) {
+            traceThread()->add(name, startNs, monotonicNs(), arg);
+        }
+    }
+
+private:
+    const char *name;
+    int64_t arg;
+    uint64_t startNs;
+};
+
+// Enable tracing with capacity events per thread. SIGUSR2 dumps the
+// trace to dumpPath. Must be called before any other threads are
+// started so that they all leave SIGUSR2 to the trace dumper.
+int traceStart(size_t capacity, const std::string &dumpPath);
+
+// Write the trace as Chrome trace event JSON.
+int traceDump(const std::string &path);
+
+#endif // TRACE_H
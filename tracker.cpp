@@ -0,0 +1,133 @@
+#include "tracker.h"
+
+// Weight of each new velocity measurement against the track's estimate.
+const float velocity_gain = 0.5f;
+
+
+Tracker::Tracker(const TrackerConfig &config) :
+    config(config),
+    numStates(0),
+    nextId(1),
+    started(false),
+    lastSequence(0) {
+}
+
+// Move the tracks on to sequence, returning how many frames that was.
+uint32_t Tracker::predict(uint32_t sequence) {
+    uint32_t frames = started ? sequence - lastSequence : 0;
+    started = true;
+    lastSequence = sequence;
+    for (int i = 0; i < numStates; i++) {
+        Track &t = states[i].track;
+        t.x += t.vx * frames;
+        t.y += t.vy * frames;
+        t.blob = -1;
+        t.age += frames;
+    }
+    return frames;
+}
+
+void Tracker::update(const BlobList &blobs, uint32_t sequence, TrackList &out) {
+    uint32_t frames = predict(sequence);
+
+    // Greedy assignment: repeatedly take the closest remaining pair.
+    bool trackUsed[TrackList::max_tracks] = {};
+    bool blobUsed[BlobList::max_blobs] = {};
+    float maxDist2 = config.maxDistance * config.maxDistance;
+    for (;;) {
+        int bestTrack = -1, bestBlob = -1;
+        float bestDist2 = maxDist2;
+        for (int i = 0; i < numStates; i++) {
+            if (trackUsed[i]) {
+                continue;
+            }
+            const Track &t = states[i].track;
+            for (int b = 0; b < blobs.count; b++) {
+                if (blobUsed[b]) {
+                    continue;
+                }
+                float dx = blobs.blobs[b].cx - t.x, dy = blobs.blobs[b].cy - t.y;
+                float d2 = dx * dx + dy * dy;
+                if (d2 <= bestDist2) {
+                    bestDist2 = d2;
+                    bestTrack = i;
+                    bestBlob = b;
+                }
+            }
+        }
+        if (bestTrack < 0) {
+            break;
+        }
+        trackUsed[bestTrack] = blobUsed[bestBlob] = true;
+
+        State &s = states[bestTrack];
+        Track &t = s.track;
+        const Blob &b = blobs.blobs[bestBlob];
+        // The prediction has already moved the track by its velocity,
+        // so the residual corrects it.
+        if (sequence != s.seen) {
+            float frames = sequence - s.seen;
+            float gain = s.hits == 1 ? 1 : velocity_gain;
+            t.vx += gain * (b.cx - t.x) / frames;
+            t.vy += gain * (b.cy - t.y) / frames;
+        }
+        t.x = b.cx;
+        t.y = b.cy;
+        t.x0 = b.x0;
+        t.y0 = b.y0;
+        t.x1 = b.x1;
+        t.y1 = b.y1;
+        t.blob = bestBlob;
+        t.lost = 0;
+        s.hits++;
+        s.seen = sequence;
+    }
+
+    // Drop tracks lost for too long, keeping the rest in order.
+    int kept = 0;
+    for (int i = 0; i < numStates; i++) {
+        if (!trackUsed[i] && (states[i].track.lost += frames) > (uint32_t)config.maxLostFrames) {
+            continue;
+        }
+        states[kept++] = states[i];
+    }
+    numStates = kept;
+
+    // Blobs are biggest first, so when tracks run out the big ones get them.
+    for (int b = 0; b < blobs.count && numStates < TrackList::max_tracks; b++) {
+        if (blobUsed[b]) {
+            continue;
+        }
+        const Blob &blob = blobs.blobs[b];
+        State &s = states[numStates++];
+        Track &t = s.track;
+        t.id = nextId++;
+        t.age = 0;
+        t.lost = 0;
+        t.blob = b;
+        t.x = blob.cx;
+        t.y = blob.cy;
+        t.vx = t.vy = 0;
+        t.x0 = blob.x0;
+        t.y0 = blob.y0;
+        t.x1 = blob.x1;
+        t.y1 = blob.y1;
+        s.hits = 1;
+        s.seen = sequence;
+    }
+    report(out);
+}
+
+void Tracker::hold(uint32_t sequence, TrackList &out) {
+    predict(sequence);
+    report(out);
+}
+
+void Tracker::report(TrackList &out) const {
+    out.count = 0;
+    for (int i = 0; i < numStates; i++) {
+        if (states[i].hits >= (uint32_t)config.confirmFrames) {
+            out.tracks[out.count++] = states[i].track;
+        }
+    }
+}
@@ -0,0 +1,69 @@
+#ifndef TRACKER_H
+#define TRACKER_H
+
+#include <stdint.h>
+
+#include "blobs.h"
+
+struct TrackerConfig {
+    double maxDistance = 50;    // furthest a blob may be from a track's prediction, in pixels
+    int confirmFrames = 3;      // matches before a track is reported
+    int maxLostFrames = 30;     // frames without a match before a track is dropped
+};
+
+struct Track {
+    uint32_t id;
+    uint32_t age;               // frames since the track started
+    uint32_t lost;              // frames since it last matched a blob
+    int blob;                   // index in this frame's BlobList, or -1
+    float x, y;                 // position, predicted while lost
+    float vx, vy;               // velocity, pixels per frame
+    uint16_t x0, y0, x1, y1;    // bounding box when last matched
+};
+
+// Confirmed tracks as of one frame.
+struct TrackList {
+    static const int max_tracks = 16;
+
+    int count;
+    Track tracks[max_tracks];
+};
+
+// Follows blobs from frame to frame. Each track predicts where its
+// blob has got to assuming constant velocity, and blobs are matched to
+// tracks greedily, closest pair first, within maxDistance. Matching is
+// at most max_blobs by max_tracks pairs, so the cost is trivial next
+// to finding the blobs. Unmatched blobs start new tracks, which are
+// reported once confirmed; tracks are dropped after maxLostFrames
+// without a match. Time is counted in frame sequence numbers rather
+// than timestamps, which jitter with USB and scheduling delays.
+class Tracker {
+public:
+    Tracker(const TrackerConfig &config);
+
+    void update(const BlobList &blobs, uint32_t sequence, TrackList &out);
+
+    // Carry the tracks on by their velocities through a frame with no
+    // blobs of its own, such as one frozen by an FFC, without counting
+    // it against them.
+    void hold(uint32_t sequence, TrackList &out);
+
+private:
+    struct State {
+        Track track;
+        uint32_t hits;
+        uint32_t seen;          // sequence when it last matched
+    };
+
+    uint32_t predict(uint32_t sequence);
+    void report(TrackList &out) const;
+
+    TrackerConfig config;
+    State states[TrackList::max_tracks];
+    int numStates;
+    uint32_t nextId;
+    bool started;
+    uint32_t lastSequence;
+};
+
+#endif // TRACKER_H
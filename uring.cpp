@@ -0,0 +1,167 @@
+#include "uring.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+
+static int ioUringSetup(unsigned entries, struct io_uring_params *p) {
+    return syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int ioUringEnter(int fd, unsigned toSubmit, unsigned minComplete, unsigned flags) {
+    return syscall(__NR_io_uring_enter, fd, toSubmit, minComplete, flags, NULL, 0);
+}
+
+Uring::Uring() :
+    fd(-1),
+    sqRing(MAP_FAILED), sqRingBytes(0),
+    cqRing(MAP_FAILED), cqRingBytes(0),
+    sqes((struct io_uring_sqe *)MAP_FAILED), sqesBytes(0),
+    sqEntries(0),
+    localTail(0),
+    submitted(0) {
+}
+
+Uring::~Uring() {
+    if (sqes != MAP_FAILED) {
+        munmap(sqes, sqesBytes);
+    }
+    if (cqRing != MAP_FAILED && cqRing != sqRing) {
+        munmap(cqRing, cqRingBytes);
+    }
+    if (sqRing != MAP_FAILED) {
+        munmap(sqRing, sqRingBytes);
+    }
+    if (fd >= 0) {
+        close(fd);
+    }
+}
+
+int Uring::init(unsigned entries) {
+    struct io_uring_params p;
+    memset(&p, 0, sizeof(p));
+    fd = ioUringSetup(entries, &p);
+    if (fd < 0) {
+        return -1;
+    }
+
+    sqRingBytes = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    cqRingBytes = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        sqRingBytes = cqRingBytes = sqRingBytes > cqRingBytes ? sqRingBytes : cqRingBytes;
+    }
+
+    sqRing = mmap(NULL, sqRingBytes, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+    if (sqRing == MAP_FAILED) {
+        return -1;
+    }
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        cqRing = sqRing;
+    } else {
+        cqRing = mmap(NULL, cqRingBytes, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+        if (cqRing == MAP_FAILED) {
+            return -1;
+        }
+    }
+    sqesBytes = p.sq_entries * sizeof(struct io_uring_sqe);
+    sqes = (struct io_uring_sqe *)mmap(NULL, sqesBytes, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+    if (sqes == MAP_FAILED) {
+        return -1;
+    }
+
+    uint8_t *sq = (uint8_t *)sqRing;
+    sqHead = (unsigned *)(sq + p.sq_off.head);
+    sqTail = (unsigned *)(sq + p.sq_off.tail);
+    sqMask = (unsigned *)(sq + p.sq_off.ring_mask);
+    sqArray = (unsigned *)(sq + p.sq_off.array);
+    uint8_t *cq = (uint8_t *)cqRing;
+    cqHead = (unsigned *)(cq + p.cq_off.head);
+    cqTail = (unsigned *)(cq + p.cq_off.tail);
+    cqMask = (unsigned *)(cq + p.cq_off.ring_mask);
+    cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+    sqEntries = p.sq_entries;
+    localTail = submitted = *sqTail;
+    return 0;
+}
+
+struct io_uring_sqe *Uring::sqe(IoRequest *request) {
+    unsigned head = __atomic_load_n(sqHead, __ATOMIC_ACQUIRE);
+    if (localTail - head >= sqEntries) {
+        submit();
+        head = __atomic_load_n(sqHead, __ATOMIC_ACQUIRE);
+        if (localTail - head >= sqEntries) {
+            return NULL;
+        }
+    }
+    unsigned index = localTail & *sqMask;
+    struct io_uring_sqe *s = &sqes[index];
+    memset(s, 0, sizeof(*s));
+    s->user_data = (uint64_t)(uintptr_t)request;
+    sqArray[index] = index;
+    localTail++;
+    return s;
+}
+
+int Uring::submit(unsigned minComplete) {
+    unsigned toSubmit = localTail - submitted;
+    __atomic_store_n(sqTail, localTail, __ATOMIC_RELEASE);
+    if (toSubmit == 0 && minComplete == 0) {
+        return 0;
+    }
+    int r;
+    do {
+        r = ioUringEnter(fd, toSubmit, minComplete, minComplete ? IORING_ENTER_GETEVENTS : 0);
+    } while (r < 0 && errno == EINTR && minComplete == 0);
+    if (r > 0) {
+        // The kernel may take fewer than offered (short of memory, or
+        // the completion queue overflowing); the rest stay published
+        // and are offered again next time.
+        submitted += r;
+    }
+    if (r < 0 && errno == EINTR) {
+        return 0;
+    }
+    return r;
+}
+
+int Uring::reap() {
+    unsigned head = *cqHead;
+    unsigned tail = __atomic_load_n(cqTail, __ATOMIC_ACQUIRE);
+    int n = 0;
+    while (head != tail) {
+        struct io_uring_cqe cqe = cqes[head & *cqMask];
+        head++;
+        // Release the slot before the callback, which may submit more.
+        __atomic_store_n(cqHead, head, __ATOMIC_RELEASE);
+        IoRequest *request = (IoRequest *)(uintptr_t)cqe.user_data;
+        if (request) {
+            request->complete(cqe.res, cqe.flags);
+        }
+        n++;
+        tail = __atomic_load_n(cqTail, __ATOMIC_ACQUIRE);
+    }
+    return n;
+}
+
+int Uring::registerBuffers(const std::vector<struct iovec> &buffers) {
+    if (syscall(__NR_io_uring_register, fd, IORING_REGISTER_BUFFERS, buffers.data(), buffers.size()) < 0) {
+        return -1;
+    }
+    registered = buffers;
+    return 0;
+}
+
+int Uring::fixedBuffer(const void *data, size_t length) const {
+    const uint8_t *p = (const uint8_t *)data;
+    for (size_t i = 0; i < registered.size(); i++) {
+        const uint8_t *base = (const uint8_t *)registered[i].iov_base;
+        if (p >= base && p + length <= base + registered[i].iov_len) {
+            return i;
+        }
+    }
+    return -1;
+}
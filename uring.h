@@ -0,0 +1,65 @@
+#ifndef URING_H
+#define URING_H
+
+#include <stdint.h>
+#include <linux/io_uring.h>
+#include <sys/uio.h>
+#include <vector>
+
+// An operation submitted to an io_uring. The SQE's user_data points at
+// it and complete() is called with the CQE's result.
+class IoRequest {
+public:
+    virtual ~IoRequest() {}
+    virtual void complete(int res, uint32_t flags) = 0;
+};
+
+// A minimal io_uring wrapper using the raw system calls (so there's no
+// liburing dependency). Single threaded: one thread submits and reaps.
+class Uring {
+public:
+    Uring();
+    ~Uring();
+
+    // Returns -1 with errno set if the kernel lacks io_uring or it is
+    // disabled (ENOSYS, EPERM).
+    int init(unsigned entries);
+
+    // A cleared SQE to fill in, submitting pending ones first if the
+    // submission queue is full. user_data is set to request (NULL for
+    // completions which should be ignored).
+    struct io_uring_sqe *sqe(IoRequest *request);
+
+    // Submit pending SQEs and wait for at least minComplete completions.
+    int submit(unsigned minComplete = 0);
+
+    // Call complete() for every available completion. Returns how many.
+    int reap();
+
+    // Register buffers with the kernel, so operations on them can use
+    // the _FIXED opcodes and skip pinning the pages on every call.
+    int registerBuffers(const std::vector<struct iovec> &buffers);
+
+    // The index of the registered buffer holding [data, data + length),
+    // or -1.
+    int fixedBuffer(const void *data, size_t length) const;
+
+private:
+    int fd;
+    void *sqRing;
+    size_t sqRingBytes;
+    void *cqRing;
+    size_t cqRingBytes;
+    struct io_uring_sqe *sqes;
+    size_t sqesBytes;
+
+    unsigned *sqHead, *sqTail, *sqMask, *sqArray;
+    unsigned *cqHead, *cqTail, *cqMask;
+    struct io_uring_cqe *cqes;
+    unsigned sqEntries;
+    unsigned localTail;     // SQEs handed out
+    unsigned submitted;     // SQEs the kernel has taken
+    std::vector<struct iovec> registered;
+};
+
+#endif // URING_H